@@ -1,30 +1,37 @@
-grammar Formula;
-
-main
-    : expr EOF
-    ;
-
-expr
-    : '(' expr ')'  # Parens
-    | (ADD | SUB) expr  # UnaryOp
-    | expr (MUL | DIV) expr  # BinaryOp
-    | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
-    | NUMBER  # Literal
-    ;
-
-// number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
-fragment INT: [-+]? UINT ;
-fragment UINT: [0-9]+ ;
-fragment EXPONENT: [eE] INT;
-NUMBER
-    : UINT EXPONENT?
-    | UINT? '.' UINT EXPONENT?
-    ;
-
-ADD: '+' ;
-SUB: '-' ;
-MUL: '*' ;
-DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+grammar Formula;
+
+main
+    : expr EOF
+    ;
+
+expr
+    : '(' expr ')'  # Parens
+    | (ADD | SUB) expr  # UnaryOp
+    | expr (MUL | DIV) expr  # BinaryOp
+    | expr (ADD | SUB) expr  # BinaryOp
+    | FUNCTION '(' argument (',' argument)* ')'  # Function
+    | CELL  # Cell
+    | NUMBER  # Literal
+    ;
+
+argument
+    : CELL ':' CELL  # RangeArgument
+    | expr  # ExprArgument
+    ;
+
+// number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
+fragment INT: [-+]? UINT ;
+fragment UINT: [0-9]+ ;
+fragment EXPONENT: [eE] INT;
+NUMBER
+    : UINT EXPONENT?
+    | UINT? '.' UINT EXPONENT?
+    ;
+
+ADD: '+' ;
+SUB: '-' ;
+MUL: '*' ;
+DIV: '/' ;
+FUNCTION: 'SUM' | 'AVERAGE' | 'MIN' | 'MAX' | 'COUNT' ;
+CELL: [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
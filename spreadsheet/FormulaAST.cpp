@@ -1,378 +1,1012 @@
-#include "FormulaAST.h"
-
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
-#include <cassert>
-#include <cmath>
-#include <memory>
-#include <optional>
-#include <sstream>
-#include <utility>
-
-namespace ASTImpl {
-
-    enum ExprPrecedence {
-        EP_ADD,
-        EP_SUB,
-        EP_MUL,
-        EP_DIV,
-        EP_UNARY,
-        EP_ATOM,
-        EP_END,
-    };
-
-    enum PrecedenceRule {
-        PR_NONE = 0b00,                // never needed
-        PR_LEFT = 0b01,                // needed for a left child
-        PR_RIGHT = 0b10,               // needed for a right child
-        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
-    };
-
-    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-            /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-            /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-            /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    };
-
-    class Expr {
-    public:
-
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(std::function<double(Position pos)> eval) const = 0;
-
-        [[nodiscard]] virtual ExprPrecedence GetPrecedence() const = 0;
-
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                          bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-
-            if (parens_needed) {out << '(';}
-            DoPrintFormula(out, precedence);
-            if (parens_needed) {out << ')';}
-        }
-    };
-
-    namespace {
-        class BinaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
-
-        public:
-
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs) : type_(type)
-                    , lhs_(std::move(lhs))
-                    , rhs_(std::move(rhs)) {}
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, true);
-            }
-
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                    case Add:
-                        return EP_ADD;
-                    case Subtract:
-                        return EP_SUB;
-                    case Multiply:
-                        return EP_MUL;
-                    case Divide:
-                        return EP_DIV;
-                    default:
-                        assert(false);
-                        //return static_cast<ExprPrecedence>(INT_MAX);
-                }
-            }
-
-            double Evaluate(std::function<double(Position pos)> eval) const override {
-
-                switch (type_) {
-
-                    case Add:
-                        return lhs_->Evaluate(eval) + rhs_->Evaluate(eval);
-
-                    case Subtract:
-                        return lhs_->Evaluate(eval) - rhs_->Evaluate(eval);
-
-                    case Multiply:
-                        return lhs_->Evaluate(eval) * rhs_->Evaluate(eval);
-
-                    case Divide:
-
-                        if (rhs_->Evaluate(eval) != 0) {
-                            return lhs_->Evaluate(eval) / rhs_->Evaluate(eval);
-
-                        } else {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        }
-
-                    default:
-                        throw std::invalid_argument("unidentified operation type");
-                }
-            }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
-
-        public:
-
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand) : type_(type)
-                    , operand_(std::move(operand)) {}
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
-            }
-
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override {return EP_UNARY;}
-
-            double Evaluate(std::function<double(Position pos)> args) const override {
-                switch (type_) {
-                    case UnaryPlus:
-                        return operand_->Evaluate(args);
-                    case UnaryMinus:
-                        return -operand_->Evaluate(args);
-                    default:
-                        throw std::invalid_argument("unidentified operation type");
-                }
-            }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
-
-        class CellExpr final : public Expr {
-        public:
-
-            explicit CellExpr(const Position* cell) : cell_(cell) {}
-
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                } else {
-                    out << cell_->ToString();
-                }
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {
-                Print(out);
-            }
-
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
-
-            double Evaluate(std::function<double(Position pos)> eval) const override {
-                return eval(*cell_);
-            }
-
-        private:
-            const Position* cell_;
-        };
-
-        class NumberExpr final : public Expr {
-        public:
-
-            explicit NumberExpr(double value) : value_(value) {}
-
-            void Print(std::ostream& out) const override {out << value_;}
-            void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {out << value_;}
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override {return EP_ATOM;}
-            double Evaluate(std::function<double(Position pos)> eval) const override {
-                return value_;
-            }
-
-        private:
-            double value_;
-        };
-
-        class ParseASTListener final : public FormulaBaseListener {
-        public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
-            }
-
-            std::forward_list<Position> MoveCells() {return std::move(cells_);}
-
-        public:
-            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(!args_.empty());
-
-                auto operand = std::move(args_.back());
-
-                UnaryOpExpr::Type type;
-                if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
-                } else {
-                    assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
-                }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
-            }
-
-            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
-                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
-                    throw ParsingError("Invalid number: " + valueStr);
-                }
-
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
-            }
-
-            void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
-
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
-            }
-
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
-
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
-
-                auto lhs = std::move(args_.back());
-
-                BinaryOpExpr::Type type;
-                if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
-                } else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
-                } else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
-                } else {
-                    assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
-                }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
-            }
-
-            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
-            }
-
-        private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
-        };
-
-        class BailErrorListener : public antlr4::BaseErrorListener {
-        public:
-            void syntaxError(antlr4::Recognizer*, antlr4::Token*, size_t, size_t, const std::string& msg, std::exception_ptr) override {
-                throw ParsingError("Error when lexing: " + msg);
-            }
-        };
-
-    }//end namespace
-}//end namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
-
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
-    }
-}
-
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
-}
-
-double FormulaAST::Execute(std::function<double(Position pos)> eval) const {
-    return root_expr_->Evaluate(std::move(eval));
-}
-
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells) :
-root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
-    cells_.sort();
-}
-
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+#include "FormulaAST.h"
+#include "binary_io.h"
+
+#ifdef SPREADSHEET_WITH_ANTLR
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+
+namespace ASTImpl {
+
+    enum ExprPrecedence {
+        EP_ADD,
+        EP_SUB,
+        EP_MUL,
+        EP_DIV,
+        EP_UNARY,
+        EP_ATOM,
+        EP_END,
+    };
+
+    enum PrecedenceRule {
+        PR_NONE = 0b00,                // never needed
+        PR_LEFT = 0b01,                // needed for a left child
+        PR_RIGHT = 0b10,               // needed for a right child
+        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
+    };
+
+    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
+            /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+            /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+            /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    };
+
+    namespace {
+        /// Приоритет выражения, вершиной которого является инструкция
+        ExprPrecedence GetPrecedence(OpCode code) {
+            switch (code) {
+                case OpCode::Add:
+                    return EP_ADD;
+                case OpCode::Subtract:
+                    return EP_SUB;
+                case OpCode::Multiply:
+                    return EP_MUL;
+                case OpCode::Divide:
+                    return EP_DIV;
+                case OpCode::UnaryPlus:
+                case OpCode::Negate:
+                    return EP_UNARY;
+                default:
+                    return EP_ATOM;
+            }
+        }
+
+        char GetSign(OpCode code) {
+            switch (code) {
+                case OpCode::Add:
+                case OpCode::UnaryPlus:
+                    return '+';
+                case OpCode::Subtract:
+                case OpCode::Negate:
+                    return '-';
+                case OpCode::Multiply:
+                    return '*';
+                case OpCode::Divide:
+                    return '/';
+                default:
+                    throw std::invalid_argument("unidentified operation type");
+            }
+        }
+
+        /// Результат операции, не являющийся конечным числом, считается ошибкой вычисления
+        FormulaAST::Value CheckFinite(double value) {
+            if (!std::isfinite(value)) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            return value;
+        }
+
+        struct FunctionName {
+            AggregateFunction function;
+            std::string_view name;
+        };
+
+        constexpr FunctionName FUNCTION_NAMES[] = {
+                {AggregateFunction::Sum, "SUM"},
+                {AggregateFunction::Average, "AVERAGE"},
+                {AggregateFunction::Min, "MIN"},
+                {AggregateFunction::Max, "MAX"},
+                {AggregateFunction::Count, "COUNT"},
+        };
+
+        std::string_view GetFunctionName(AggregateFunction function) {
+            for (const auto& [candidate, name] : FUNCTION_NAMES) {
+                if (candidate == function) {
+                    return name;
+                }
+            }
+            throw std::invalid_argument("unidentified aggregate function");
+        }
+
+        /// Промежуточное состояние агрегатной функции
+        struct Accumulator {
+            AggregateFunction function = AggregateFunction::Sum;
+            double sum = 0;
+            double min = std::numeric_limits<double>::infinity();
+            double max = -std::numeric_limits<double>::infinity();
+            size_t count = 0;
+
+            void Add(double value) {
+                sum += value;
+                min = std::min(min, value);
+                max = std::max(max, value);
+                ++count;
+            }
+
+            /// Учитывает непрерывный массив значений диапазона. Циклы ведут несколько
+            /// независимых аккумуляторов, чтобы компилятор мог их векторизовать
+            void AddValues(const double* values, size_t size) {
+                constexpr size_t LANES = 4;
+                const size_t vector_end = size - size % LANES;
+
+                switch (function) {
+                    case AggregateFunction::Sum:
+                    case AggregateFunction::Average: {
+                        double lanes[LANES] = {};
+                        for (size_t i = 0; i < vector_end; i += LANES) {
+                            for (size_t lane = 0; lane < LANES; ++lane) {
+                                lanes[lane] += values[i + lane];
+                            }
+                        }
+                        for (size_t i = vector_end; i < size; ++i) {
+                            lanes[0] += values[i];
+                        }
+                        sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+                        break;
+                    }
+                    case AggregateFunction::Min: {
+                        double lanes[LANES] = {min, min, min, min};
+                        for (size_t i = 0; i < vector_end; i += LANES) {
+                            for (size_t lane = 0; lane < LANES; ++lane) {
+                                lanes[lane] = std::min(lanes[lane], values[i + lane]);
+                            }
+                        }
+                        for (size_t i = vector_end; i < size; ++i) {
+                            lanes[0] = std::min(lanes[0], values[i]);
+                        }
+                        min = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+                        break;
+                    }
+                    case AggregateFunction::Max: {
+                        double lanes[LANES] = {max, max, max, max};
+                        for (size_t i = 0; i < vector_end; i += LANES) {
+                            for (size_t lane = 0; lane < LANES; ++lane) {
+                                lanes[lane] = std::max(lanes[lane], values[i + lane]);
+                            }
+                        }
+                        for (size_t i = vector_end; i < size; ++i) {
+                            lanes[0] = std::max(lanes[0], values[i]);
+                        }
+                        max = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+                        break;
+                    }
+                    case AggregateFunction::Count:
+                        break;
+                }
+                count += size;
+            }
+
+            [[nodiscard]] FormulaAST::Value GetResult() const {
+                switch (function) {
+                    case AggregateFunction::Sum:
+                        return CheckFinite(sum);
+                    case AggregateFunction::Average:
+                        if (count == 0) {
+                            return FormulaError(FormulaError::Category::Div0);
+                        }
+                        return CheckFinite(sum / static_cast<double>(count));
+                    case AggregateFunction::Min:
+                        return count == 0 ? 0.0 : min;
+                    case AggregateFunction::Max:
+                        return count == 0 ? 0.0 : max;
+                    case AggregateFunction::Count:
+                        return static_cast<double>(count);
+                    default:
+                        throw std::invalid_argument("unidentified aggregate function");
+                }
+            }
+        };
+
+        /// Печать программы в виде выражения. Для каждой инструкции заранее
+        /// находятся вершины её операндов (для агрегатной функции — аргументов)
+        class ProgramPrinter {
+        public:
+            ProgramPrinter(ArrayView<Instruction> program, ArrayView<Range> ranges, Position offset = {0, 0})
+                    : program_(program)
+                    , ranges_(ranges)
+                    , offset_(offset)
+                    , children_(program.size()) {
+                std::vector<size_t> roots;
+                for (size_t i = 0; i < program_.size(); ++i) {
+                    const OpCode code = program_[i].code;
+                    if (code == OpCode::EndAggregate) {
+                        // Аргументы лежат на стеке над отметкой BeginAggregate
+                        auto& args = children_[i];
+                        while (program_[roots.back()].code != OpCode::BeginAggregate) {
+                            args.push_back(roots.back());
+                            roots.pop_back();
+                        }
+                        std::reverse(args.begin(), args.end());
+                        roots.back() = i;
+                        continue;
+                    }
+
+                    const int arity = code == OpCode::AccumulateValue ? 1 : GetArity(code);
+                    auto& operands = children_[i];
+                    operands.resize(arity);
+                    for (int arg = arity - 1; arg >= 0; --arg) {
+                        operands[arg] = roots.back();
+                        roots.pop_back();
+                    }
+                    roots.push_back(i);
+                }
+            }
+
+            void Print(std::ostream& out, size_t index) const {
+                const auto& instruction = program_[index];
+                const auto& children = children_[index];
+                switch (instruction.code) {
+                    case OpCode::AccumulateValue:
+                        Print(out, children.front());
+                        break;
+                    case OpCode::EndAggregate:
+                        out << '(' << GetFunctionName(instruction.operand.function);
+                        for (size_t child : children) {
+                            out << ' ';
+                            Print(out, child);
+                        }
+                        out << ')';
+                        break;
+                    default:
+                        if (children.empty()) {
+                            PrintAtom(out, instruction);
+                            break;
+                        }
+                        out << '(' << GetSign(instruction.code);
+                        for (size_t child : children) {
+                            out << ' ';
+                            Print(out, child);
+                        }
+                        out << ')';
+                }
+            }
+
+            void PrintFormula(std::ostream& out, size_t index, ExprPrecedence parent_precedence,
+                              bool right_child = false) const {
+                const auto& instruction = program_[index];
+                const auto& children = children_[index];
+                auto precedence = GetPrecedence(instruction.code);
+                auto mask = right_child ? PR_RIGHT : PR_LEFT;
+                bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+
+                if (parens_needed) {out << '(';}
+                switch (instruction.code) {
+                    case OpCode::AccumulateValue:
+                        PrintFormula(out, children.front(), EP_ATOM);
+                        break;
+                    case OpCode::EndAggregate: {
+                        out << GetFunctionName(instruction.operand.function) << '(';
+                        bool first = true;
+                        for (size_t child : children) {
+                            if (!first) {out << ',';}
+                            first = false;
+                            PrintFormula(out, child, EP_ATOM);
+                        }
+                        out << ')';
+                        break;
+                    }
+                    default:
+                        if (children.size() == 2) {
+                            PrintFormula(out, children[0], precedence);
+                            out << GetSign(instruction.code);
+                            PrintFormula(out, children[1], precedence, true);
+                        } else if (children.size() == 1) {
+                            out << GetSign(instruction.code);
+                            PrintFormula(out, children[0], precedence);
+                        } else {
+                            PrintAtom(out, instruction);
+                        }
+                }
+                if (parens_needed) {out << ')';}
+            }
+
+        private:
+            ArrayView<Instruction> program_;
+            ArrayView<Range> ranges_;
+            Position offset_;
+            std::vector<std::vector<size_t>> children_;
+
+            void PrintAtom(std::ostream& out, const Instruction& instruction) const {
+                if (instruction.code == OpCode::PushNumber) {
+                    out << instruction.operand.number;
+                } else if (instruction.code == OpCode::AccumulateRange) {
+                    const Range range = Translate(ranges_[instruction.operand.range], offset_);
+                    if (!range.IsValid()) {
+                        out << FormulaError::Category::Ref;
+                    } else {
+                        out << range.ToString();
+                    }
+                } else if (!instruction.operand.cell.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                } else {
+                    char buffer[Position::MAX_STRING_LENGTH];
+                    out.write(buffer, Translate(instruction.operand.cell, offset_).ToChars(buffer) - buffer);
+                }
+            }
+        };
+
+    }//end namespace
+
+    std::optional<AggregateFunction> FindAggregateFunction(std::string_view name) {
+        for (const auto& [function, candidate] : FUNCTION_NAMES) {
+            if (candidate == name) {
+                return function;
+            }
+        }
+        return std::nullopt;
+    }
+
+    int GetArity(OpCode code) {
+        switch (code) {
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                return 2;
+            case OpCode::UnaryPlus:
+            case OpCode::Negate:
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    int GetStackEffect(OpCode code) {
+        switch (code) {
+            case OpCode::PushNumber:
+            case OpCode::LoadCell:
+            case OpCode::EndAggregate:
+            case OpCode::LoadLocal:
+                return 1;
+            case OpCode::AccumulateValue:
+                return -1;
+            case OpCode::BeginAggregate:
+            case OpCode::AccumulateRange:
+            case OpCode::StoreLocal:
+                return 0;
+            default:
+                return 1 - GetArity(code);
+        }
+    }
+
+    namespace {
+#ifdef SPREADSHEET_WITH_ANTLR
+        class ParseASTListener final : public FormulaBaseListener {
+        public:
+            std::vector<Instruction> MoveProgram() {
+                assert(depth_ == 1);
+                depth_ = 0;
+
+                return std::move(program_);
+            }
+
+            std::vector<Position> MoveCells() {return std::move(cells_);}
+            std::vector<Range> MoveRanges() {return std::move(ranges_);}
+
+        public:
+            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+                assert(depth_ >= 1);
+
+                if (ctx->SUB()) {
+                    Emit(OpCode::Negate);
+                } else {
+                    assert(ctx->ADD() != nullptr);
+                    Emit(OpCode::UnaryPlus);
+                }
+            }
+
+            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+                double value = 0;
+                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+                std::istringstream in(valueStr);
+                in >> value;
+                if (!in) {
+                    throw ParsingError("Invalid number: " + valueStr);
+                }
+
+                Instruction instruction;
+                instruction.code = OpCode::PushNumber;
+                instruction.operand.number = value;
+                program_.push_back(instruction);
+                ++depth_;
+            }
+
+            void exitCell(FormulaParser::CellContext* ctx) override {
+                auto value_str = ctx->CELL()->getSymbol()->getText();
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+
+                cells_.push_back(value);
+
+                Instruction instruction;
+                instruction.code = OpCode::LoadCell;
+                instruction.operand.cell = value;
+                program_.push_back(instruction);
+                ++depth_;
+            }
+
+            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+                assert(depth_ >= 2);
+
+                if (ctx->ADD()) {
+                    Emit(OpCode::Add);
+                } else if (ctx->SUB()) {
+                    Emit(OpCode::Subtract);
+                } else if (ctx->MUL()) {
+                    Emit(OpCode::Multiply);
+                } else {
+                    assert(ctx->DIV() != nullptr);
+                    Emit(OpCode::Divide);
+                }
+                --depth_;
+            }
+
+            void enterFunction(FormulaParser::FunctionContext* ctx) override {
+                EmitAggregate(OpCode::BeginAggregate, ctx);
+            }
+
+            void exitFunction(FormulaParser::FunctionContext* ctx) override {
+                EmitAggregate(OpCode::EndAggregate, ctx);
+                ++depth_;
+            }
+
+            void exitRangeArgument(FormulaParser::RangeArgumentContext* ctx) override {
+                auto from_str = ctx->CELL(0)->getSymbol()->getText();
+                auto to_str = ctx->CELL(1)->getSymbol()->getText();
+                auto from = Position::FromString(from_str);
+                auto to = Position::FromString(to_str);
+                if (!from.IsValid() || !to.IsValid()) {
+                    throw FormulaException("Invalid range: " + from_str + ':' + to_str);
+                }
+
+                ranges_.push_back(Range::FromCorners(from, to));
+
+                Instruction instruction;
+                instruction.code = OpCode::AccumulateRange;
+                instruction.operand.range = static_cast<std::uint32_t>(ranges_.size() - 1);
+                program_.push_back(instruction);
+            }
+
+            void exitExprArgument(FormulaParser::ExprArgumentContext*) override {
+                assert(depth_ >= 1);
+
+                Emit(OpCode::AccumulateValue);
+                --depth_;
+            }
+
+            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+            }
+
+        private:
+            std::vector<Instruction> program_;
+            /// Количество готовых подвыражений, ещё не ставших операндами
+            size_t depth_ = 0;
+            std::vector<Position> cells_;
+            std::vector<Range> ranges_;
+
+            void Emit(OpCode code) {
+                Instruction instruction;
+                instruction.code = code;
+                program_.push_back(instruction);
+            }
+
+            void EmitAggregate(OpCode code, FormulaParser::FunctionContext* ctx) {
+                auto name = ctx->FUNCTION()->getSymbol()->getText();
+                auto function = FindAggregateFunction(name);
+                if (!function) {
+                    throw ParsingError("Unknown function: " + name);
+                }
+
+                Instruction instruction;
+                instruction.code = code;
+                instruction.operand.function = *function;
+                program_.push_back(instruction);
+            }
+        };
+
+        class BailErrorListener : public antlr4::BaseErrorListener {
+        public:
+            void syntaxError(antlr4::Recognizer*, antlr4::Token*, size_t, size_t, const std::string& msg, std::exception_ptr) override {
+                throw ParsingError("Error when lexing: " + msg);
+            }
+        };
+#endif
+
+    }//end namespace
+}//end namespace ASTImpl
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTAntlr(std::istream& in) {
+    using namespace antlr4;
+
+    ANTLRInputStream input(in);
+
+    FormulaLexer lexer(&input);
+    ASTImpl::BailErrorListener error_listener;
+    lexer.removeErrorListeners();
+    lexer.addErrorListener(&error_listener);
+
+    CommonTokenStream tokens(&lexer);
+
+    FormulaParser parser(&tokens);
+    auto error_handler = std::make_shared<BailErrorStrategy>();
+    parser.setErrorHandler(error_handler);
+    parser.removeErrorListeners();
+
+    tree::ParseTree* tree = parser.main();
+    ASTImpl::ParseASTListener listener;
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    return FormulaAST(listener.MoveProgram(), listener.MoveCells(), listener.MoveRanges());
+}
+#endif
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaASTNative(in_str);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
+    return ParseFormulaASTNative(in_str);
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserBackend backend) {
+    switch (backend) {
+        case FormulaParserBackend::Native:
+            return ParseFormulaASTNative(in_str);
+        case FormulaParserBackend::Antlr: {
+#ifdef SPREADSHEET_WITH_ANTLR
+            std::istringstream in{std::string(in_str)};
+            return ParseFormulaASTAntlr(in);
+#else
+            throw std::invalid_argument("ANTLR formula parser is not built");
+#endif
+        }
+        default:
+            throw std::invalid_argument("unidentified formula parser");
+    }
+}
+
+void FormulaAST::PrintCells(std::ostream& out) const {
+    for (auto cell : GetCells()) {
+        out << cell.ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    if (program_size_ == 0) {
+        return;
+    }
+    ASTImpl::ProgramPrinter(GetProgram(), GetRanges()).Print(out, program_size_ - 1);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    if (program_size_ == 0) {
+        return;
+    }
+    ASTImpl::ProgramPrinter(GetProgram(), GetRanges(), offset).PrintFormula(out, program_size_ - 1, ASTImpl::EP_ATOM);
+}
+
+FormulaAST::Value FormulaAST::Execute(const CellEvaluator& eval, const RangeEvaluator& eval_range) const {
+    using ASTImpl::OpCode;
+
+    // Неглубокие формулы вычисляются на стеке вызова без выделения памяти
+    constexpr size_t INLINE_STACK_SIZE = 32;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (max_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(max_depth_);
+        stack = heap_stack.data();
+    }
+
+    // Значения общих подвыражений
+    constexpr size_t INLINE_LOCAL_COUNT = 8;
+    double inline_locals[INLINE_LOCAL_COUNT];
+    std::vector<double> heap_locals;
+    double* locals = inline_locals;
+    if (local_count_ > INLINE_LOCAL_COUNT) {
+        heap_locals.resize(local_count_);
+        locals = heap_locals.data();
+    }
+
+    // Состояния вложенных агрегатных функций и буфер значений диапазона
+    constexpr size_t RANGE_RESERVE_LIMIT = 4096;
+    std::vector<ASTImpl::Accumulator> accumulators;
+    std::vector<double> range_values;
+    accumulators.reserve(max_aggregate_depth_);
+
+    // Первая же ошибка становится результатом всей формулы
+    const FormulaError div0(FormulaError::Category::Div0);
+    const Range* ranges = GetRangeData();
+    size_t top = 0;
+    for (const auto& instruction : GetExecutableProgram()) {
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                stack[top++] = instruction.operand.number;
+                break;
+
+            case OpCode::LoadCell: {
+                const auto value = eval(instruction.operand.cell);
+                if (const auto* error = std::get_if<FormulaError>(&value)) {
+                    return *error;
+                }
+                const double* number = std::get_if<double>(&value);
+                stack[top++] = number ? *number : 0.0;
+                break;
+            }
+
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide: {
+                --top;
+                const double rhs = stack[top];
+                double& lhs = stack[top - 1];
+                switch (instruction.code) {
+                    case OpCode::Add:
+                        lhs += rhs;
+                        break;
+                    case OpCode::Subtract:
+                        lhs -= rhs;
+                        break;
+                    case OpCode::Multiply:
+                        lhs *= rhs;
+                        break;
+                    default:
+                        if (rhs == 0) {
+                            return div0;
+                        }
+                        lhs /= rhs;
+                        break;
+                }
+                // Результат операции, не являющийся конечным числом, считается ошибкой вычисления
+                if (!std::isfinite(lhs)) {
+                    return div0;
+                }
+                break;
+            }
+
+            case OpCode::UnaryPlus:
+                break;
+
+            case OpCode::Negate:
+                stack[top - 1] = -stack[top - 1];
+                break;
+
+            case OpCode::BeginAggregate:
+                accumulators.emplace_back().function = instruction.operand.function;
+                break;
+
+            case OpCode::AccumulateRange: {
+                // Буфер сразу выделяется под весь диапазон, но не больше предела:
+                // большие диапазоны обычно заполнены редко
+                const Range& range = ranges[instruction.operand.range];
+                const Size size = range.GetSize();
+                range_values.clear();
+                range_values.reserve(std::min(static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols),
+                                              RANGE_RESERVE_LIMIT));
+                if (auto error = eval_range(range, range_values)) {
+                    return *error;
+                }
+                accumulators.back().AddValues(range_values.data(), range_values.size());
+                break;
+            }
+
+            case OpCode::AccumulateValue:
+                accumulators.back().Add(stack[--top]);
+                break;
+
+            case OpCode::StoreLocal:
+                locals[instruction.operand.local] = stack[top - 1];
+                break;
+
+            case OpCode::LoadLocal:
+                stack[top++] = locals[instruction.operand.local];
+                break;
+
+            case OpCode::EndAggregate: {
+                const Value result = accumulators.back().GetResult();
+                accumulators.pop_back();
+                if (const auto* error = std::get_if<FormulaError>(&result)) {
+                    return *error;
+                }
+                stack[top++] = std::get<double>(result);
+                break;
+            }
+
+            default:
+                throw std::invalid_argument("unidentified operation type");
+        }
+    }
+
+    assert(top == 1);
+    return stack[0];
+}
+
+FormulaAST::FormulaAST(const std::vector<ASTImpl::Instruction>& program, const std::vector<Position>& cells,
+                       const std::vector<Range>& ranges) {
+    using ASTImpl::Instruction;
+    static_assert(std::is_trivially_copyable_v<Instruction> && std::is_trivially_copyable_v<Range>
+                  && std::is_trivially_copyable_v<Position>);
+    static_assert(alignof(Instruction) >= alignof(Range) && alignof(Range) >= alignof(Position));
+
+    const auto optimized = ASTImpl::OptimizeProgram(program, ranges);
+    const size_t optimized_size = optimized ? optimized->program.size() : 0;
+
+    storage_ = std::make_unique<std::byte[]>((program.size() + optimized_size) * sizeof(Instruction)
+                                             + ranges.size() * sizeof(Range) + cells.size() * sizeof(Position));
+    auto* instructions = reinterpret_cast<Instruction*>(storage_.get());
+    auto* range_data = reinterpret_cast<Range*>(std::uninitialized_copy(program.begin(), program.end(), instructions));
+    if (optimized) {
+        range_data = reinterpret_cast<Range*>(std::uninitialized_copy(optimized->program.begin(),
+                                                                      optimized->program.end(),
+                                                                      instructions + program.size()));
+    }
+    auto* cell_data = reinterpret_cast<Position*>(std::uninitialized_copy(ranges.begin(), ranges.end(), range_data));
+    auto* cells_end = std::uninitialized_copy(cells.begin(), cells.end(), cell_data);
+    std::sort(cell_data, cells_end);
+    cells_end = std::unique(cell_data, cells_end);
+
+    program_size_ = static_cast<std::uint32_t>(program.size());
+    optimized_size_ = static_cast<std::uint32_t>(optimized_size);
+    range_count_ = static_cast<std::uint32_t>(ranges.size());
+    cell_count_ = static_cast<std::uint32_t>(cells_end - cell_data);
+    local_count_ = optimized ? static_cast<std::uint32_t>(optimized->local_count) : 0;
+
+    std::uint32_t depth = 0;
+    std::uint32_t aggregate_depth = 0;
+    for (const auto& instruction : GetExecutableProgram()) {
+        depth += ASTImpl::GetStackEffect(instruction.code);
+        max_depth_ = std::max(max_depth_, depth);
+
+        if (instruction.code == ASTImpl::OpCode::BeginAggregate) {
+            max_aggregate_depth_ = std::max(max_aggregate_depth_, ++aggregate_depth);
+        } else if (instruction.code == ASTImpl::OpCode::EndAggregate) {
+            --aggregate_depth;
+        }
+    }
+}
+
+FormulaAST::FormulaAST(FormulaAST&& other) noexcept
+    : storage_(std::move(other.storage_)),
+      program_size_(std::exchange(other.program_size_, 0)),
+      optimized_size_(std::exchange(other.optimized_size_, 0)),
+      range_count_(std::exchange(other.range_count_, 0)),
+      cell_count_(std::exchange(other.cell_count_, 0)),
+      local_count_(std::exchange(other.local_count_, 0)),
+      max_depth_(std::exchange(other.max_depth_, 0)),
+      max_aggregate_depth_(std::exchange(other.max_aggregate_depth_, 0)) {}
+
+FormulaAST& FormulaAST::operator=(FormulaAST&& other) noexcept {
+    if (this != &other) {
+        storage_ = std::move(other.storage_);
+        program_size_ = std::exchange(other.program_size_, 0);
+        optimized_size_ = std::exchange(other.optimized_size_, 0);
+        range_count_ = std::exchange(other.range_count_, 0);
+        cell_count_ = std::exchange(other.cell_count_, 0);
+        local_count_ = std::exchange(other.local_count_, 0);
+        max_depth_ = std::exchange(other.max_depth_, 0);
+        max_aggregate_depth_ = std::exchange(other.max_aggregate_depth_, 0);
+    }
+    return *this;
+}
+
+FormulaAST::~FormulaAST() = default;
+
+bool FormulaAST::IsAffectedBy(const SheetShift& shift, Position offset) const {
+    const auto cells = GetCells();
+    const auto ranges = GetRanges();
+    return std::any_of(cells.begin(), cells.end(), [&shift, offset](Position cell) {
+               return shift.Affects(ASTImpl::Translate(cell, offset));
+           })
+        || std::any_of(ranges.begin(), ranges.end(), [&shift, offset](const Range& range) {
+               return shift.Affects(ASTImpl::Translate(range, offset));
+           });
+}
+
+template <typename MapCell, typename MapRange>
+FormulaAST FormulaAST::Remap(MapCell map_cell, MapRange map_range) const {
+    std::vector<ASTImpl::Instruction> program(GetProgram().begin(), GetProgram().end());
+    std::vector<Position> cells;
+    for (auto& instruction : program) {
+        if (instruction.code == ASTImpl::OpCode::LoadCell) {
+            instruction.operand.cell = map_cell(instruction.operand.cell);
+            cells.push_back(instruction.operand.cell);
+        }
+    }
+
+    std::vector<Range> ranges;
+    ranges.reserve(range_count_);
+    for (const Range& range : GetRanges()) {
+        ranges.push_back(map_range(range));
+    }
+    return FormulaAST(program, cells, ranges);
+}
+
+FormulaAST FormulaAST::Shift(const SheetShift& shift, Position offset) const {
+    return Remap(
+            [&shift, offset](Position cell) {
+                return shift.Apply(ASTImpl::Translate(cell, offset));
+            },
+            [&shift, offset](const Range& range) {
+                return shift.Apply(ASTImpl::Translate(range, offset));
+            });
+}
+
+FormulaAST FormulaAST::Translate(Position offset) const {
+    return Remap(
+            [offset](Position cell) {
+                const Position moved = ASTImpl::Translate(cell, offset);
+                return moved.IsValid() ? moved : Position::NONE;
+            },
+            [offset](const Range& range) {
+                const Range moved = ASTImpl::Translate(range, offset);
+                return moved.IsValid() ? moved : Range{Position::NONE, Position::NONE};
+            });
+}
+void FormulaAST::Serialize(std::string& out, Position offset) const {
+    using ASTImpl::OpCode;
+
+    binary_io::Write(out, static_cast<std::uint32_t>(range_count_));
+    for (const Range& stored : GetRanges()) {
+        const Range range = ASTImpl::Translate(stored, offset);
+        binary_io::Write(out, static_cast<std::int32_t>(range.from.row));
+        binary_io::Write(out, static_cast<std::int32_t>(range.from.col));
+        binary_io::Write(out, static_cast<std::int32_t>(range.to.row));
+        binary_io::Write(out, static_cast<std::int32_t>(range.to.col));
+    }
+
+    binary_io::Write(out, static_cast<std::uint32_t>(program_size_));
+    for (const auto& instruction : GetProgram()) {
+        binary_io::Write(out, static_cast<std::uint8_t>(instruction.code));
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                binary_io::Write(out, instruction.operand.number);
+                break;
+            case OpCode::LoadCell: {
+                const Position cell = ASTImpl::Translate(instruction.operand.cell, offset);
+                binary_io::Write(out, static_cast<std::int32_t>(cell.row));
+                binary_io::Write(out, static_cast<std::int32_t>(cell.col));
+                break;
+            }
+            case OpCode::AccumulateRange:
+                binary_io::Write(out, instruction.operand.range);
+                break;
+            case OpCode::BeginAggregate:
+            case OpCode::EndAggregate:
+                binary_io::Write(out, static_cast<std::uint8_t>(instruction.operand.function));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+namespace ASTImpl {
+    namespace {
+        /// Position::NONE — ссылка на удалённую ячейку (#REF!)
+        Position ReadPosition(std::string_view& in) {
+            Position pos;
+            pos.row = binary_io::Read<std::int32_t>(in);
+            pos.col = binary_io::Read<std::int32_t>(in);
+            if (!pos.IsValid() && !(pos == Position::NONE)) {
+                throw BinaryFormatException("invalid cell position in formula");
+            }
+            return pos;
+        }
+    }//end namespace
+}//end namespace ASTImpl
+
+FormulaAST FormulaAST::Deserialize(std::string_view& in) {
+    using ASTImpl::OpCode;
+    using ASTImpl::AggregateFunction;
+
+    const auto range_count = binary_io::Read<std::uint32_t>(in);
+    if (range_count > in.size()) {
+        throw BinaryFormatException("invalid formula range count");
+    }
+    std::vector<Range> ranges;
+    ranges.reserve(range_count);
+    for (std::uint32_t i = 0; i < range_count; ++i) {
+        Range range;
+        range.from = ASTImpl::ReadPosition(in);
+        range.to = ASTImpl::ReadPosition(in);
+        if (!range.IsValid() && !(range == Range{Position::NONE, Position::NONE})) {
+            throw BinaryFormatException("invalid range in formula");
+        }
+        ranges.push_back(range);
+    }
+
+    const auto size = binary_io::Read<std::uint32_t>(in);
+    if (size == 0 || size > in.size()) {
+        throw BinaryFormatException("invalid formula program size");
+    }
+
+    // Программа выполняется без проверок, поэтому здесь повторяются
+    // инварианты, которые при разборе обеспечивает грамматика: операндов
+    // на стеке достаточно, агрегаты вложены правильно, результат один
+    std::vector<ASTImpl::Instruction> program(size);
+    std::vector<Position> cells;
+    std::vector<std::pair<AggregateFunction, size_t>> aggregates;
+    size_t depth = 0;
+    for (auto& instruction : program) {
+        const auto code = binary_io::Read<std::uint8_t>(in);
+        if (code > static_cast<std::uint8_t>(OpCode::EndAggregate)) {
+            throw BinaryFormatException("unidentified operation in formula");
+        }
+        instruction.code = static_cast<OpCode>(code);
+
+        const size_t base = aggregates.empty() ? 0 : aggregates.back().second;
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                instruction.operand.number = binary_io::Read<double>(in);
+                ++depth;
+                break;
+
+            case OpCode::LoadCell:
+                instruction.operand.cell = ASTImpl::ReadPosition(in);
+                cells.push_back(instruction.operand.cell);
+                ++depth;
+                break;
+
+            case OpCode::AccumulateRange:
+                instruction.operand.range = binary_io::Read<std::uint32_t>(in);
+                if (aggregates.empty() || instruction.operand.range >= ranges.size() || depth != base) {
+                    throw BinaryFormatException("invalid range argument in formula");
+                }
+                break;
+
+            case OpCode::BeginAggregate:
+            case OpCode::EndAggregate: {
+                const auto function = binary_io::Read<std::uint8_t>(in);
+                if (function > static_cast<std::uint8_t>(AggregateFunction::Count)) {
+                    throw BinaryFormatException("unidentified aggregate function in formula");
+                }
+                instruction.operand.function = static_cast<AggregateFunction>(function);
+
+                if (instruction.code == OpCode::BeginAggregate) {
+                    aggregates.emplace_back(instruction.operand.function, depth);
+                } else {
+                    if (aggregates.empty() || aggregates.back().first != instruction.operand.function
+                        || depth != base) {
+                        throw BinaryFormatException("unbalanced aggregate in formula");
+                    }
+                    aggregates.pop_back();
+                    ++depth;
+                }
+                break;
+            }
+
+            case OpCode::AccumulateValue:
+                if (aggregates.empty() || depth != base + 1) {
+                    throw BinaryFormatException("invalid value argument in formula");
+                }
+                --depth;
+                break;
+
+            default: {
+                const auto arity = static_cast<size_t>(ASTImpl::GetArity(instruction.code));
+                if (depth < base + arity) {
+                    throw BinaryFormatException("missing operand in formula");
+                }
+                depth = depth + 1 - arity;
+                break;
+            }
+        }
+    }
+
+    if (depth != 1 || !aggregates.empty()) {
+        throw BinaryFormatException("incomplete formula program");
+    }
+
+    return FormulaAST(program, cells, ranges);
+}
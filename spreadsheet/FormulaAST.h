@@ -1,42 +1,237 @@
-#pragma once
-
-#include "FormulaLexer.h"
-#include "common.h"
-
-#include <forward_list>
-#include <functional>
-#include <stdexcept>
-
-namespace ASTImpl {
-    class Expr;
-}
-
-class ParsingError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
-
-class FormulaAST {
-public:
-
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
-    ~FormulaAST();
-
-    double Execute(std::function<double(Position)> eval) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-
-    std::forward_list<Position>& GetCells() { return cells_; }
-    [[nodiscard]] const std::forward_list<Position>& GetCells() const { return cells_; }
-
-private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
-};
-
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace ASTImpl {
+
+    /// Операции стековой машины, в программу которой компилируется формула
+    enum class OpCode : std::uint8_t {
+        PushNumber,    // положить на стек константу
+        LoadCell,      // положить на стек значение ячейки
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,     // на значение не влияет, хранится для печати формулы
+        Negate,
+        BeginAggregate,     // начать вычисление агрегатной функции
+        AccumulateRange,    // учесть в агрегате значения диапазона
+        AccumulateValue,    // снять значение со стека и учесть в агрегате
+        EndAggregate,       // положить на стек результат агрегатной функции
+        // Инструкции ниже появляются только в оптимизированной программе
+        StoreLocal,    // скопировать вершину стека в локальную ячейку
+        LoadLocal,     // положить на стек значение локальной ячейки
+    };
+
+    /// Агрегатные функции над диапазонами и значениями
+    enum class AggregateFunction : std::uint8_t {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+    /// Агрегатная функция по имени в формуле
+    std::optional<AggregateFunction> FindAggregateFunction(std::string_view name);
+
+    /// Сдвигает ссылку на offset. Недействительная ссылка (#REF!) остаётся недействительной
+    inline Position Translate(Position pos, Position offset) {
+        return pos.IsValid() ? Position{pos.row + offset.row, pos.col + offset.col} : pos;
+    }
+
+    inline Range Translate(Range range, Position offset) {
+        return {Translate(range.from, offset), Translate(range.to, offset)};
+    }
+
+    /// Количество операндов-выражений у операции
+    int GetArity(OpCode code);
+    /// Изменение глубины стека значений после выполнения инструкции
+    int GetStackEffect(OpCode code);
+
+    /// Инструкция программы формулы. Операнд используется инструкциями
+    /// PushNumber, LoadCell, AccumulateRange (индекс диапазона формулы),
+    /// BeginAggregate/EndAggregate и StoreLocal/LoadLocal (номер локальной ячейки)
+    struct Instruction {
+        OpCode code = OpCode::PushNumber;
+        union Operand {
+            double number;
+            Position cell;
+            std::uint32_t range;
+            AggregateFunction function;
+            std::uint32_t local;
+
+            Operand() : number(0) {}
+        } operand;
+    };
+
+    /// Непрерывный массив только для чтения, принадлежащий формуле
+    template <typename T>
+    class ArrayView {
+    public:
+        ArrayView() = default;
+        ArrayView(const T* data, size_t size) : data_(data), size_(size) {}
+
+        [[nodiscard]] const T* begin() const { return data_; }
+        [[nodiscard]] const T* end() const { return data_ + size_; }
+        [[nodiscard]] const T* data() const { return data_; }
+        [[nodiscard]] size_t size() const { return size_; }
+        [[nodiscard]] bool empty() const { return size_ == 0; }
+        const T& operator[](size_t index) const { return data_[index]; }
+
+    private:
+        const T* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    /// Оптимизированная программа и количество локальных ячеек для общих подвыражений
+    struct OptimizedProgram {
+        std::vector<Instruction> program;
+        size_t local_count = 0;
+    };
+
+}//end namespace ASTImpl
+
+class ParsingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class FormulaAST {
+public:
+
+    /// Результат вычисления: число или ошибка. Ошибки передаются как значения,
+    /// без исключений, чтобы листы с большим числом ошибок пересчитывались быстро
+    using Value = std::variant<double, FormulaError>;
+    /// Вычисляет значение ячейки; std::monostate означает пустую ячейку
+    using CellEvaluator = std::function<CellInterface::NumericValue(Position)>;
+    /// Дописывает в конец вектора числовые значения непустых ячеек диапазона.
+    /// Возвращает ошибку первой ячейки диапазона, значение которой — ошибка
+    using RangeEvaluator = std::function<std::optional<FormulaError>(const Range&, std::vector<double>&)>;
+
+    /// Копирует программу, ячейки и диапазоны в один блок памяти вместе с
+    /// оптимизированной программой: формула занимает одно выделение памяти,
+    /// а её выполнение идёт по непрерывному массиву
+    FormulaAST(const std::vector<ASTImpl::Instruction>& program,
+               const std::vector<Position>& cells,
+               const std::vector<Range>& ranges = {});
+
+    /// Перемещённая формула остаётся пустой: без программы, ячеек и диапазонов
+    FormulaAST(FormulaAST&& other) noexcept;
+    FormulaAST& operator=(FormulaAST&& other) noexcept;
+    ~FormulaAST();
+
+    [[nodiscard]] Value Execute(const CellEvaluator& eval, const RangeEvaluator& eval_range) const;
+    void PrintCells(std::ostream& out) const;
+    void Print(std::ostream& out) const;
+    /// Печатает формулу, все ссылки которой сдвинуты на offset
+    void PrintFormula(std::ostream& out, Position offset = {0, 0}) const;
+
+    /// Дописывает в out двоичное представление программы и диапазонов,
+    /// сдвигая ссылки на offset
+    void Serialize(std::string& out, Position offset = {0, 0}) const;
+    /// Читает формулу, записанную Serialize, из начала in и сдвигает in за неё.
+    /// Программа проверяется так же строго, как результат разбора: при
+    /// повреждённых данных бросается BinaryFormatException
+    static FormulaAST Deserialize(std::string_view& in);
+
+    /// Затрагивает ли вставка или удаление строк (столбцов) ссылки формулы,
+    /// сдвинутые на offset
+    [[nodiscard]] bool IsAffectedBy(const SheetShift& shift, Position offset = {0, 0}) const;
+    /// Копия формулы, ссылки которой сдвинуты на offset и затем изменены shift.
+    /// Ссылки на удалённые ячейки становятся #REF!
+    [[nodiscard]] FormulaAST Shift(const SheetShift& shift, Position offset = {0, 0}) const;
+    /// Копия формулы, ссылки которой сдвинуты на offset. Ссылки, вышедшие
+    /// за пределы листа, становятся #REF!
+    [[nodiscard]] FormulaAST Translate(Position offset) const;
+
+    /// Ячейки формулы без повторов, по возрастанию
+    [[nodiscard]] ASTImpl::ArrayView<Position> GetCells() const {
+        return {reinterpret_cast<const Position*>(GetRangeData() + range_count_), cell_count_};
+    }
+    /// Диапазоны в порядке появления в формуле, на них ссылаются инструкции AccumulateRange
+    [[nodiscard]] ASTImpl::ArrayView<Range> GetRanges() const {
+        return {GetRangeData(), range_count_};
+    }
+    /// Программа в обратной польской записи в том виде, в каком формула записана.
+    /// По ней формула печатается и сохраняется
+    [[nodiscard]] ASTImpl::ArrayView<ASTImpl::Instruction> GetProgram() const {
+        return {GetInstructionData(), program_size_};
+    }
+    /// Программа, которая выполняется при вычислении (после оптимизации)
+    [[nodiscard]] ASTImpl::ArrayView<ASTImpl::Instruction> GetExecutableProgram() const {
+        return optimized_size_ == 0 ? GetProgram()
+                                    : ASTImpl::ArrayView<ASTImpl::Instruction>{GetInstructionData() + program_size_,
+                                                                               optimized_size_};
+    }
+
+private:
+    /// Блок памяти формулы: исходная программа, оптимизированная программа
+    /// (если оптимизация что-то изменила), диапазоны и ячейки подряд.
+    /// Типы в блоке расположены по убыванию выравнивания
+    std::unique_ptr<std::byte[]> storage_;
+    std::uint32_t program_size_ = 0;
+    std::uint32_t optimized_size_ = 0;
+    std::uint32_t range_count_ = 0;
+    std::uint32_t cell_count_ = 0;
+    /// Количество локальных ячеек для общих подвыражений
+    std::uint32_t local_count_ = 0;
+    /// Максимальная глубина стека при выполнении программы
+    std::uint32_t max_depth_ = 0;
+    /// Максимальная вложенность агрегатных функций
+    std::uint32_t max_aggregate_depth_ = 0;
+
+    [[nodiscard]] const ASTImpl::Instruction* GetInstructionData() const {
+        return reinterpret_cast<const ASTImpl::Instruction*>(storage_.get());
+    }
+    [[nodiscard]] const Range* GetRangeData() const {
+        return reinterpret_cast<const Range*>(GetInstructionData() + program_size_ + optimized_size_);
+    }
+
+    /// Копия формулы, в которой каждая ссылка заменена результатом map_cell
+    /// или map_range
+    template <typename MapCell, typename MapRange>
+    [[nodiscard]] FormulaAST Remap(MapCell map_cell, MapRange map_range) const;
+};
+
+/// Реализации разбора формул. Основной является собственный парсер (Native);
+/// парсер ANTLR собирается при SPREADSHEET_WITH_ANTLR и служит эталоном
+enum class FormulaParserBackend {
+    Native,
+    Antlr,
+};
+
+FormulaAST ParseFormulaAST(std::istream& in);
+FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserBackend backend);
+
+FormulaAST ParseFormulaASTNative(std::string_view in_str);
+
+/// Приводит текст формулы ячейки anchor к виду, не зависящему от её положения:
+/// ссылки записываются относительно anchor (R<сдвиг строки>C<сдвиг столбца>),
+/// лексемы разделяются одним пробелом. Формулы, скопированные со сдвигом
+/// (=A1*B1 в C1 и =A2*B2 в C2), получают одинаковый текст. При лексической
+/// ошибке бросает ParsingError
+std::string NormalizeFormulaText(std::string_view in_str, Position anchor);
+
+namespace ASTImpl {
+    /// Сворачивает константные подвыражения, убирает унарный плюс и вычисляет
+    /// повторяющиеся подвыражения один раз. Результат вычисления программы, в том
+    /// числе первая встреченная ошибка, не меняется. Возвращает nullopt, если
+    /// оптимизировать нечего
+    std::optional<OptimizedProgram> OptimizeProgram(const std::vector<Instruction>& program,
+                                                    const std::vector<Range>& ranges);
+}//end namespace ASTImpl
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTAntlr(std::istream& in);
+#endif
\ No newline at end of file
@@ -0,0 +1,433 @@
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <tuple>
+
+// Оптимизация программы формулы выполняется в два прохода:
+// 1. Свёртка констант: подвыражения из одних чисел заменяются результатом,
+//    унарный плюс убирается. Подвыражения, вычисление которых даёт ошибку
+//    (например, 1/0), не сворачиваются, чтобы ошибка возникала там же, где и раньше.
+// 2. Общие подвыражения: в обратной польской записи каждое подвыражение занимает
+//    непрерывный отрезок программы. Первое вхождение повторяющегося подвыражения
+//    сохраняет значение в локальную ячейку (StoreLocal), остальные заменяются
+//    чтением из неё (LoadLocal). Программа выполняется без переходов, поэтому
+//    первое вхождение всегда вычисляется раньше остальных, и если оно даёт
+//    ошибку, до остальных выполнение не доходит.
+
+namespace ASTImpl {
+    namespace {
+
+        /// Значение бинарной операции над константами или nullopt, если
+        /// операция даёт ошибку и должна выполняться во время вычисления
+        std::optional<double> FoldBinary(OpCode code, double lhs, double rhs) {
+            double result = 0;
+            switch (code) {
+                case OpCode::Add:
+                    result = lhs + rhs;
+                    break;
+                case OpCode::Subtract:
+                    result = lhs - rhs;
+                    break;
+                case OpCode::Multiply:
+                    result = lhs * rhs;
+                    break;
+                default:
+                    assert(code == OpCode::Divide);
+                    if (rhs == 0) {
+                        return std::nullopt;
+                    }
+                    result = lhs / rhs;
+                    break;
+            }
+            if (!std::isfinite(result)) {
+                return std::nullopt;
+            }
+            return result;
+        }
+
+        /// Есть ли что сворачивать. Самая глубокая операция над константами
+        /// всегда следует сразу за своими операндами-числами
+        bool HasFoldableConstants(const std::vector<Instruction>& program) {
+            for (size_t i = 0; i < program.size(); ++i) {
+                switch (program[i].code) {
+                    case OpCode::UnaryPlus:
+                        return true;
+                    case OpCode::Negate:
+                        if (program[i - 1].code == OpCode::PushNumber) {
+                            return true;
+                        }
+                        break;
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide:
+                        if (program[i - 1].code == OpCode::PushNumber && program[i - 2].code == OpCode::PushNumber) {
+                            return true;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return false;
+        }
+
+        bool FoldConstants(const std::vector<Instruction>& program, std::vector<Instruction>& folded) {
+            /// Готовое подвыражение: начало в новой программе и значение, если оно константа
+            struct Operand {
+                size_t start = 0;
+                std::optional<double> constant;
+            };
+
+            bool changed = false;
+            std::vector<Operand> operands;
+            std::vector<size_t> aggregates;
+            folded.reserve(program.size());
+            for (const auto& instruction : program) {
+                switch (instruction.code) {
+                    case OpCode::PushNumber:
+                        operands.push_back({folded.size(), instruction.operand.number});
+                        folded.push_back(instruction);
+                        break;
+
+                    case OpCode::LoadCell:
+                        operands.push_back({folded.size(), std::nullopt});
+                        folded.push_back(instruction);
+                        break;
+
+                    case OpCode::UnaryPlus:
+                        changed = true;
+                        break;
+
+                    case OpCode::Negate: {
+                        // Свёрнутая константа — это всегда одна последняя инструкция PushNumber
+                        auto& operand = operands.back();
+                        if (operand.constant) {
+                            operand.constant = -*operand.constant;
+                            folded.back().operand.number = *operand.constant;
+                            changed = true;
+                        } else {
+                            folded.push_back(instruction);
+                        }
+                        break;
+                    }
+
+                    case OpCode::Add:
+                    case OpCode::Subtract:
+                    case OpCode::Multiply:
+                    case OpCode::Divide: {
+                        const Operand rhs = operands.back();
+                        operands.pop_back();
+                        auto& lhs = operands.back();
+                        if (lhs.constant && rhs.constant) {
+                            if (auto result = FoldBinary(instruction.code, *lhs.constant, *rhs.constant)) {
+                                folded.resize(lhs.start + 1);
+                                folded.back().operand.number = *result;
+                                lhs.constant = result;
+                                changed = true;
+                                break;
+                            }
+                        }
+                        lhs.constant.reset();
+                        folded.push_back(instruction);
+                        break;
+                    }
+
+                    case OpCode::BeginAggregate:
+                        aggregates.push_back(folded.size());
+                        folded.push_back(instruction);
+                        break;
+
+                    case OpCode::AccumulateValue:
+                        operands.pop_back();
+                        folded.push_back(instruction);
+                        break;
+
+                    case OpCode::EndAggregate:
+                        operands.push_back({aggregates.back(), std::nullopt});
+                        aggregates.pop_back();
+                        folded.push_back(instruction);
+                        break;
+
+                    default:
+                        folded.push_back(instruction);
+                        break;
+                }
+            }
+            return changed;
+        }
+
+        /// Подвыражение программы: отрезок [start, end] и хеш его инструкций
+        struct Subtree {
+            size_t start = 0;
+            size_t end = 0;
+            size_t hash = 0;
+
+            [[nodiscard]] size_t GetSize() const { return end - start + 1; }
+        };
+
+        size_t CombineHash(size_t seed, size_t value) {
+            return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+        }
+
+        size_t HashDouble(double value) {
+            std::uint64_t bits = 0;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return std::hash<std::uint64_t>{}(bits);
+        }
+
+        size_t HashPosition(Position pos) {
+            return PositionHasher{}(pos);
+        }
+
+        /// Хеш инструкции без учёта операндов-подвыражений. Диапазоны сравниваются
+        /// по значению, а не по индексу: одинаковые диапазоны могут иметь разные индексы
+        size_t HashInstruction(const Instruction& instruction, const std::vector<Range>& ranges) {
+            size_t hash = static_cast<size_t>(instruction.code);
+            switch (instruction.code) {
+                case OpCode::PushNumber:
+                    return CombineHash(hash, HashDouble(instruction.operand.number));
+                case OpCode::LoadCell:
+                    return CombineHash(hash, HashPosition(instruction.operand.cell));
+                case OpCode::AccumulateRange: {
+                    const Range& range = ranges[instruction.operand.range];
+                    return CombineHash(CombineHash(hash, HashPosition(range.from)), HashPosition(range.to));
+                }
+                case OpCode::BeginAggregate:
+                case OpCode::EndAggregate:
+                    return CombineHash(hash, static_cast<size_t>(instruction.operand.function));
+                default:
+                    return hash;
+            }
+        }
+
+        bool IsSameInstruction(const Instruction& lhs, const Instruction& rhs, const std::vector<Range>& ranges) {
+            if (lhs.code != rhs.code) {
+                return false;
+            }
+            switch (lhs.code) {
+                case OpCode::PushNumber:
+                    // Сравнение по битам отличает 0 от -0
+                    return std::memcmp(&lhs.operand.number, &rhs.operand.number, sizeof(double)) == 0;
+                case OpCode::LoadCell:
+                    return lhs.operand.cell == rhs.operand.cell;
+                case OpCode::AccumulateRange:
+                    return ranges[lhs.operand.range] == ranges[rhs.operand.range];
+                case OpCode::BeginAggregate:
+                case OpCode::EndAggregate:
+                    return lhs.operand.function == rhs.operand.function;
+                default:
+                    return true;
+            }
+        }
+
+        /// Находит все подвыражения, значения которых имеет смысл переиспользовать:
+        /// всё, кроме отдельных чисел
+        std::vector<Subtree> FindSubtrees(const std::vector<Instruction>& program, const std::vector<Range>& ranges) {
+            std::vector<Subtree> subtrees;
+            std::vector<Subtree> operands;
+            /// Начало и накопленный хеш открытых агрегатных функций
+            std::vector<Subtree> aggregates;
+            for (size_t i = 0; i < program.size(); ++i) {
+                const auto& instruction = program[i];
+                const size_t hash = HashInstruction(instruction, ranges);
+                switch (instruction.code) {
+                    case OpCode::PushNumber:
+                        operands.push_back({i, i, hash});
+                        continue;
+
+                    case OpCode::LoadCell:
+                        operands.push_back({i, i, hash});
+                        break;
+
+                    case OpCode::BeginAggregate:
+                        aggregates.push_back({i, i, hash});
+                        continue;
+
+                    case OpCode::AccumulateRange:
+                        aggregates.back().hash = CombineHash(aggregates.back().hash, hash);
+                        continue;
+
+                    case OpCode::AccumulateValue:
+                        aggregates.back().hash = CombineHash(CombineHash(aggregates.back().hash, operands.back().hash), hash);
+                        operands.pop_back();
+                        continue;
+
+                    case OpCode::EndAggregate: {
+                        Subtree aggregate = aggregates.back();
+                        aggregates.pop_back();
+                        aggregate.end = i;
+                        aggregate.hash = CombineHash(aggregate.hash, hash);
+                        operands.push_back(aggregate);
+                        break;
+                    }
+
+                    default: {
+                        const int arity = GetArity(instruction.code);
+                        Subtree subtree{operands[operands.size() - arity].start, i, hash};
+                        for (size_t operand = operands.size() - arity; operand < operands.size(); ++operand) {
+                            subtree.hash = CombineHash(subtree.hash, operands[operand].hash);
+                        }
+                        operands.resize(operands.size() - arity);
+                        operands.push_back(subtree);
+                        break;
+                    }
+                }
+                subtrees.push_back(operands.back());
+            }
+            return subtrees;
+        }
+
+        bool IsSameSubtree(const std::vector<Instruction>& program, const std::vector<Range>& ranges,
+                           const Subtree& lhs, const Subtree& rhs) {
+            if (lhs.hash != rhs.hash || lhs.GetSize() != rhs.GetSize()) {
+                return false;
+            }
+            for (size_t i = 0; i < lhs.GetSize(); ++i) {
+                if (!IsSameInstruction(program[lhs.start + i], program[rhs.start + i], ranges)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /// Повторяющееся подвыражение, которое не свернулось в константу, содержит
+        /// ссылку на ячейку или диапазон. Если ссылки не повторяются, искать общие
+        /// подвыражения не нужно: так отсеивается большинство формул
+        bool HasRepeatedReferences(const std::vector<Instruction>& program, const std::vector<Range>& ranges) {
+            constexpr size_t QUADRATIC_LIMIT = 64;
+            size_t reference_count = 0;
+            for (size_t i = 0; i < program.size(); ++i) {
+                const OpCode code = program[i].code;
+                if (code != OpCode::LoadCell && code != OpCode::AccumulateRange) {
+                    continue;
+                }
+                if (++reference_count > QUADRATIC_LIMIT) {
+                    return true;
+                }
+                for (size_t j = 0; j < i; ++j) {
+                    if (program[j].code == code && IsSameInstruction(program[i], program[j], ranges)) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        /// Заменяет повторные вхождения подвыражений чтением локальных ячеек.
+        /// Возвращает количество использованных ячеек
+        size_t EliminateCommonSubexpressions(std::vector<Instruction>& program, const std::vector<Range>& ranges) {
+            std::vector<Subtree> subtrees = FindSubtrees(program, ranges);
+            // Сначала рассматриваются длинные подвыражения: если повторяется
+            // подвыражение целиком, его части отдельно переиспользовать не нужно.
+            // Кандидаты в одинаковые подвыражения (равные размер и хеш) оказываются
+            // рядом, а внутри группы идут в порядке выполнения
+            std::sort(subtrees.begin(), subtrees.end(), [](const Subtree& lhs, const Subtree& rhs) {
+                if (lhs.GetSize() != rhs.GetSize()) {
+                    return lhs.GetSize() > rhs.GetSize();
+                }
+                return std::tie(lhs.hash, lhs.end) < std::tie(rhs.hash, rhs.end);
+            });
+            auto same_group = [](const Subtree& lhs, const Subtree& rhs) {
+                return lhs.GetSize() == rhs.GetSize() && lhs.hash == rhs.hash;
+            };
+            // У большинства формул повторов нет, и на этом оптимизация заканчивается
+            if (std::adjacent_find(subtrees.begin(), subtrees.end(), same_group) == subtrees.end()) {
+                return 0;
+            }
+
+            constexpr size_t NO_LOCAL = static_cast<size_t>(-1);
+            /// Для последней инструкции первого вхождения — ячейка, куда сохранить значение
+            std::vector<size_t> store_local(program.size(), NO_LOCAL);
+            /// Для первой инструкции повторного вхождения — его конец и ячейка для чтения
+            std::vector<std::pair<size_t, size_t>> load_local(program.size(), {0, NO_LOCAL});
+            /// Инструкции, которые входят в заменённые вхождения и не выполняются
+            std::vector<bool> replaced(program.size(), false);
+            /// Первые вхождения подвыражений текущей группы и назначенные им ячейки
+            std::vector<std::pair<Subtree, size_t>> first_occurrences;
+            size_t local_count = 0;
+
+            for (size_t i = 0; i < subtrees.size(); ++i) {
+                const Subtree& subtree = subtrees[i];
+                if (i == 0 || !same_group(subtrees[i - 1], subtree)) {
+                    first_occurrences.clear();
+                }
+                if (replaced[subtree.end]) {
+                    continue;
+                }
+
+                auto first = std::find_if(first_occurrences.begin(), first_occurrences.end(), [&](const auto& candidate) {
+                    return IsSameSubtree(program, ranges, candidate.first, subtree);
+                });
+                if (first == first_occurrences.end()) {
+                    first_occurrences.emplace_back(subtree, NO_LOCAL);
+                    continue;
+                }
+
+                if (first->second == NO_LOCAL) {
+                    first->second = local_count++;
+                    store_local[first->first.end] = first->second;
+                }
+                load_local[subtree.start] = {subtree.end, first->second};
+                std::fill(replaced.begin() + static_cast<std::ptrdiff_t>(subtree.start),
+                          replaced.begin() + static_cast<std::ptrdiff_t>(subtree.end) + 1, true);
+            }
+
+            if (local_count == 0) {
+                return 0;
+            }
+
+            std::vector<Instruction> result;
+            result.reserve(program.size() + local_count);
+            for (size_t i = 0; i < program.size(); ++i) {
+                Instruction local;
+                if (load_local[i].second != NO_LOCAL) {
+                    local.code = OpCode::LoadLocal;
+                    local.operand.local = static_cast<std::uint32_t>(load_local[i].second);
+                    result.push_back(local);
+                    i = load_local[i].first;
+                    continue;
+                }
+
+                result.push_back(program[i]);
+                if (store_local[i] != NO_LOCAL) {
+                    local.code = OpCode::StoreLocal;
+                    local.operand.local = static_cast<std::uint32_t>(store_local[i]);
+                    result.push_back(local);
+                }
+            }
+            program = std::move(result);
+            return local_count;
+        }
+
+    }//end namespace
+
+    std::optional<OptimizedProgram> OptimizeProgram(const std::vector<Instruction>& program,
+                                                    const std::vector<Range>& ranges) {
+        // Большинство формул оптимизировать нечего, и это выясняется без выделения памяти
+        const bool foldable = HasFoldableConstants(program);
+        const bool repeated = HasRepeatedReferences(program, ranges);
+        if (!foldable && !repeated) {
+            return std::nullopt;
+        }
+
+        OptimizedProgram optimized;
+        bool changed = false;
+        if (foldable) {
+            changed = FoldConstants(program, optimized.program);
+        } else {
+            optimized.program = program;
+        }
+        if (repeated) {
+            optimized.local_count = EliminateCommonSubexpressions(optimized.program, ranges);
+        }
+        if (!changed && optimized.local_count == 0) {
+            return std::nullopt;
+        }
+        return optimized;
+    }
+
+}//end namespace ASTImpl
@@ -0,0 +1,418 @@
+#include "FormulaAST.h"
+
+#include <cassert>
+#include <charconv>
+
+// Разбор формулы рекурсивным спуском без промежуточных потоков и дерева разбора.
+// Реализует ту же грамматику, что и Formula.g4, и ведёт себя при ошибках так же,
+// как парсер ANTLR: синтаксическая ошибка приводит к ParsingError, неверная
+// позиция ячейки — к FormulaException.
+
+namespace ASTImpl {
+    namespace {
+
+        enum class TokenType {
+            Number,
+            Cell,
+            Function,
+            Add,
+            Sub,
+            Mul,
+            Div,
+            LeftParen,
+            RightParen,
+            Colon,
+            Comma,
+            End,
+        };
+
+        struct Token {
+            TokenType type = TokenType::End;
+            std::string_view text;
+        };
+
+        class Lexer {
+        public:
+            explicit Lexer(std::string_view input) : input_(input) {}
+
+            Token Next() {
+                SkipWhitespace();
+                if (pos_ == input_.size()) {
+                    return {TokenType::End, {}};
+                }
+
+                const size_t start = pos_;
+                const char c = input_[pos_];
+                switch (c) {
+                    case '+':
+                        return Single(TokenType::Add);
+                    case '-':
+                        return Single(TokenType::Sub);
+                    case '*':
+                        return Single(TokenType::Mul);
+                    case '/':
+                        return Single(TokenType::Div);
+                    case '(':
+                        return Single(TokenType::LeftParen);
+                    case ')':
+                        return Single(TokenType::RightParen);
+                    case ':':
+                        return Single(TokenType::Colon);
+                    case ',':
+                        return Single(TokenType::Comma);
+                    default:
+                        break;
+                }
+
+                if (IsDigit(c) || c == '.') {
+                    return LexNumber(start);
+                }
+
+                if (IsUpper(c)) {
+                    // CELL: [A-Z]+[0-9]+ или имя функции
+                    while (pos_ < input_.size() && IsUpper(input_[pos_])) {
+                        ++pos_;
+                    }
+                    if (SkipDigits() == 0) {
+                        auto name = input_.substr(start, pos_ - start);
+                        if (!FindAggregateFunction(name)) {
+                            throw ParsingError("Error when lexing: " + std::string(input_.substr(start, pos_ - start + 1)));
+                        }
+                        return {TokenType::Function, name};
+                    }
+                    return {TokenType::Cell, input_.substr(start, pos_ - start)};
+                }
+
+                throw ParsingError("Error when lexing: " + std::string(1, c));
+            }
+
+        private:
+            std::string_view input_;
+            size_t pos_ = 0;
+
+            static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+            static bool IsUpper(char c) { return c >= 'A' && c <= 'Z'; }
+
+            Token Single(TokenType type) {
+                return {type, input_.substr(pos_++, 1)};
+            }
+
+            void SkipWhitespace() {
+                while (pos_ < input_.size() &&
+                       (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+                    ++pos_;
+                }
+            }
+
+            size_t SkipDigits() {
+                const size_t start = pos_;
+                while (pos_ < input_.size() && IsDigit(input_[pos_])) {
+                    ++pos_;
+                }
+                return pos_ - start;
+            }
+
+            /// NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            /// Как и лексер ANTLR, выбирает самый длинный подходящий префикс
+            Token LexNumber(size_t start) {
+                const size_t int_digits = SkipDigits();
+
+                if (pos_ < input_.size() && input_[pos_] == '.') {
+                    const size_t dot = pos_++;
+                    if (SkipDigits() == 0) {
+                        if (int_digits == 0) {
+                            throw ParsingError("Error when lexing: .");
+                        }
+                        pos_ = dot;
+                        return {TokenType::Number, input_.substr(start, pos_ - start)};
+                    }
+                }
+
+                // EXPONENT: [eE] [-+]? UINT, принимается только целиком
+                if (pos_ < input_.size() && (input_[pos_] == 'e' || input_[pos_] == 'E')) {
+                    const size_t exponent = pos_++;
+                    if (pos_ < input_.size() && (input_[pos_] == '+' || input_[pos_] == '-')) {
+                        ++pos_;
+                    }
+                    if (SkipDigits() == 0) {
+                        pos_ = exponent;
+                    }
+                }
+
+                return {TokenType::Number, input_.substr(start, pos_ - start)};
+            }
+        };
+
+        /// Буферы, в которые разбирается формула. Переиспользуются между
+        /// разборами: готовая формула копирует их в свой блок памяти
+        struct ParserBuffers {
+            std::vector<Instruction> program;
+            std::vector<Position> cells;
+            std::vector<Range> ranges;
+        };
+
+        class Parser {
+        public:
+            Parser(std::string_view input, ParserBuffers& buffers)
+                    : lexer_(input)
+                    , program_(buffers.program)
+                    , cells_(buffers.cells)
+                    , ranges_(buffers.ranges) {
+                program_.clear();
+                cells_.clear();
+                ranges_.clear();
+                Advance();
+            }
+
+            FormulaAST Parse() {
+                ParseExpr(PREC_ADDITIVE);
+                if (current_.type != TokenType::End) {
+                    throw ParsingError("Error when parsing: " + std::string(current_.text));
+                }
+                assert(depth_ == 1);
+
+                return FormulaAST(program_, cells_, ranges_);
+            }
+
+        private:
+            /// Приоритеты бинарных операций, как в альтернативах правила expr
+            enum BinaryPrecedence {
+                PREC_ADDITIVE = 1,
+                PREC_MULTIPLICATIVE = 2,
+            };
+
+            Lexer lexer_;
+            Token current_;
+            std::vector<Instruction>& program_;
+            std::vector<Position>& cells_;
+            std::vector<Range>& ranges_;
+            /// Количество готовых подвыражений, ещё не ставших операндами
+            size_t depth_ = 0;
+
+            void Advance() {
+                current_ = lexer_.Next();
+            }
+
+            void Emit(OpCode code) {
+                Instruction instruction;
+                instruction.code = code;
+                program_.push_back(instruction);
+            }
+
+            void Expect(TokenType type, const char* what) {
+                if (current_.type != type) {
+                    throw ParsingError(std::string("Error when parsing: missing ") + what);
+                }
+                Advance();
+            }
+
+            static int GetBinaryPrecedence(TokenType type) {
+                switch (type) {
+                    case TokenType::Add:
+                    case TokenType::Sub:
+                        return PREC_ADDITIVE;
+                    case TokenType::Mul:
+                    case TokenType::Div:
+                        return PREC_MULTIPLICATIVE;
+                    default:
+                        return 0;
+                }
+            }
+
+            static OpCode GetBinaryOpCode(TokenType type) {
+                switch (type) {
+                    case TokenType::Add:
+                        return OpCode::Add;
+                    case TokenType::Sub:
+                        return OpCode::Subtract;
+                    case TokenType::Mul:
+                        return OpCode::Multiply;
+                    default:
+                        assert(type == TokenType::Div);
+                        return OpCode::Divide;
+                }
+            }
+
+            /// Бинарные операции левоассоциативны, поэтому правый операнд
+            /// разбирается с приоритетом на единицу выше
+            void ParseExpr(int min_precedence) {
+                ParseUnary();
+                ParseExprTail(min_precedence);
+            }
+
+            /// Продолжение выражения, первый операнд которого уже разобран
+            void ParseExprTail(int min_precedence) {
+                for (int precedence = GetBinaryPrecedence(current_.type);
+                     precedence != 0 && precedence >= min_precedence;
+                     precedence = GetBinaryPrecedence(current_.type)) {
+                    const TokenType type = current_.type;
+                    Advance();
+                    ParseExpr(precedence + 1);
+                    Emit(GetBinaryOpCode(type));
+                    --depth_;
+                }
+            }
+
+            /// Унарные операции связывают сильнее бинарных: -1*2 == (-1)*2
+            void ParseUnary() {
+                if (current_.type == TokenType::Add || current_.type == TokenType::Sub) {
+                    const TokenType type = current_.type;
+                    Advance();
+                    ParseUnary();
+                    Emit(type == TokenType::Sub ? OpCode::Negate : OpCode::UnaryPlus);
+                    return;
+                }
+                ParsePrimary();
+            }
+
+            void ParsePrimary() {
+                switch (current_.type) {
+                    case TokenType::LeftParen:
+                        Advance();
+                        ParseExpr(PREC_ADDITIVE);
+                        Expect(TokenType::RightParen, "')'");
+                        break;
+
+                    case TokenType::Function:
+                        ParseFunction();
+                        break;
+
+                    case TokenType::Number:
+                        EmitNumber(current_.text);
+                        Advance();
+                        break;
+
+                    case TokenType::Cell:
+                        EmitCell(current_.text);
+                        Advance();
+                        break;
+
+                    default:
+                        throw ParsingError("Error when parsing: " + std::string(current_.text));
+                }
+            }
+
+            /// FUNCTION '(' argument (',' argument)* ')'
+            void ParseFunction() {
+                Instruction instruction;
+                instruction.operand.function = *FindAggregateFunction(current_.text);
+                Advance();
+                Expect(TokenType::LeftParen, "'('");
+
+                instruction.code = OpCode::BeginAggregate;
+                program_.push_back(instruction);
+
+                ParseArgument();
+                while (current_.type == TokenType::Comma) {
+                    Advance();
+                    ParseArgument();
+                }
+                Expect(TokenType::RightParen, "')'");
+
+                instruction.code = OpCode::EndAggregate;
+                program_.push_back(instruction);
+                ++depth_;
+            }
+
+            /// argument: CELL ':' CELL | expr
+            /// Отличить диапазон от выражения, начинающегося с ячейки, можно
+            /// только по следующему за ячейкой токену
+            void ParseArgument() {
+                if (current_.type == TokenType::Cell) {
+                    const Token cell = current_;
+                    Advance();
+                    if (current_.type == TokenType::Colon) {
+                        Advance();
+                        if (current_.type != TokenType::Cell) {
+                            throw ParsingError("Error when parsing: " + std::string(current_.text));
+                        }
+                        EmitRange(cell.text, current_.text);
+                        Advance();
+                        return;
+                    }
+                    EmitCell(cell.text);
+                    ParseExprTail(PREC_ADDITIVE);
+                } else {
+                    ParseExpr(PREC_ADDITIVE);
+                }
+
+                Emit(OpCode::AccumulateValue);
+                --depth_;
+            }
+
+            void EmitRange(std::string_view from_text, std::string_view to_text) {
+                auto from = Position::FromString(from_text);
+                auto to = Position::FromString(to_text);
+                if (!from.IsValid() || !to.IsValid()) {
+                    throw FormulaException("Invalid range: " + std::string(from_text) + ':' + std::string(to_text));
+                }
+
+                ranges_.push_back(Range::FromCorners(from, to));
+
+                Instruction instruction;
+                instruction.code = OpCode::AccumulateRange;
+                instruction.operand.range = static_cast<std::uint32_t>(ranges_.size() - 1);
+                program_.push_back(instruction);
+            }
+
+            void EmitNumber(std::string_view text) {
+                double value = 0;
+                auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (ec != std::errc() || ptr != text.data() + text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
+
+                Instruction instruction;
+                instruction.code = OpCode::PushNumber;
+                instruction.operand.number = value;
+                program_.push_back(instruction);
+                ++depth_;
+            }
+
+            void EmitCell(std::string_view text) {
+                auto value = Position::FromString(text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(text));
+                }
+
+                cells_.push_back(value);
+
+                Instruction instruction;
+                instruction.code = OpCode::LoadCell;
+                instruction.operand.cell = value;
+                program_.push_back(instruction);
+                ++depth_;
+            }
+        };
+
+    }//end namespace
+}//end namespace ASTImpl
+
+FormulaAST ParseFormulaASTNative(std::string_view in_str) {
+    thread_local ASTImpl::ParserBuffers buffers;
+    return ASTImpl::Parser(in_str, buffers).Parse();
+}
+
+std::string NormalizeFormulaText(std::string_view in_str, Position anchor) {
+    using ASTImpl::TokenType;
+
+    ASTImpl::Lexer lexer(in_str);
+    std::string result;
+    result.reserve(in_str.size() + 8);
+    for (auto token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+        if (!result.empty()) {
+            result += ' ';
+        }
+        const Position pos = token.type == TokenType::Cell ? Position::FromString(token.text) : Position::NONE;
+        if (!pos.IsValid()) {
+            // Неверная ссылка остаётся как есть: такая формула всё равно не разберётся
+            result += token.text;
+            continue;
+        }
+        result += 'R';
+        result += std::to_string(pos.row - anchor.row);
+        result += 'C';
+        result += std::to_string(pos.col - anchor.col);
+    }
+    return result;
+}
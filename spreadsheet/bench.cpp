@@ -0,0 +1,1042 @@
+#include "common.h"
+#include "csv.h"
+#include "formula.h"
+#include "sheet.h"
+#include "small_object_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Бенчмарки таблицы. Запускаются отдельно от тестов:
+//   spreadsheet_bench [--json] [--filter=подстрока] [--repetitions=N]
+// Размеры данных и начальные значения генераторов фиксированы, поэтому
+// результаты разных версий можно сравнивать между собой. С --json результаты
+// печатаются в машиночитаемом виде
+
+namespace {
+
+    /// Учёт памяти, выделенной через operator new. Перед каждым блоком
+    /// хранится его размер, чтобы при освобождении уменьшить счётчик
+    std::atomic<size_t> live_bytes{0};
+    /// Количество вызовов operator new
+    std::atomic<size_t> allocation_count{0};
+    constexpr size_t ALLOCATION_HEADER = alignof(std::max_align_t);
+
+    void* CountedAllocate(size_t size) {
+        auto* block = static_cast<unsigned char*>(std::malloc(size + ALLOCATION_HEADER));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        *reinterpret_cast<size_t*>(block) = size;
+        live_bytes += size;
+        ++allocation_count;
+        return block + ALLOCATION_HEADER;
+    }
+
+    void CountedFree(void* ptr) noexcept {
+        if (!ptr) {
+            return;
+        }
+        auto* block = static_cast<unsigned char*>(ptr) - ALLOCATION_HEADER;
+        live_bytes -= *reinterpret_cast<size_t*>(block);
+        std::free(block);
+    }
+
+}  // namespace
+
+void* operator new(size_t size) {
+    return CountedAllocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    CountedFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    CountedFree(ptr);
+}
+
+namespace {
+
+    /// Результат одного запуска бенчмарка
+    struct Sample {
+        double seconds = 0;    /// время измеряемой части
+        size_t items = 0;      /// количество обработанных элементов
+        std::map<std::string, double> counters;    /// прочие показатели
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::function<Sample()> run;
+    };
+
+    /// Сводка по повторам: запуск с медианным временем
+    struct Result {
+        std::string name;
+        size_t repetitions = 0;
+        Sample median;
+    };
+
+    class Stopwatch {
+    public:
+        Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+        [[nodiscard]] double GetSeconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    /// Линейный конгруэнтный генератор: одинаковая последовательность на всех платформах
+    class Random {
+    public:
+        explicit Random(unsigned seed) : state_(seed) {}
+
+        int Next(int bound) {
+            state_ = state_ * 1103515245u + 12345u;
+            return static_cast<int>((state_ >> 16) % static_cast<unsigned>(bound));
+        }
+
+    private:
+        unsigned state_;
+    };
+
+    std::string CellName(int row, int col = 0) {
+        return Position{row, col}.ToString();
+    }
+
+    /// Не даёт компилятору выбросить вычисление результата
+    volatile double sink = 0;
+
+    void Consume(const CellInterface::Value& value) {
+        if (const double* number = std::get_if<double>(&value)) {
+            sink = sink + *number;
+        }
+    }
+
+    // --- Разбор формул ---
+
+    std::vector<std::string> MakeFormulaCorpus(size_t size) {
+        Random random(42);
+        std::vector<std::string> corpus;
+        corpus.reserve(size);
+        for (size_t i = 0; i < size; ++i) {
+            const std::string a = CellName(random.Next(1000), random.Next(50));
+            const std::string b = CellName(random.Next(1000), random.Next(50));
+            switch (random.Next(4)) {
+                case 0:
+                    corpus.push_back(a + "+" + b + "*2");
+                    break;
+                case 1:
+                    corpus.push_back("(" + a + "-1.5e2)/(" + b + "+" + std::to_string(i) + ")");
+                    break;
+                case 2:
+                    corpus.push_back("SUM(" + a + ":" + b + ")+MAX(" + a + ", 3)");
+                    break;
+                default:
+                    corpus.push_back("-(" + a + ")*(" + b + "-" + a + ")+" + std::to_string(i % 97));
+                    break;
+            }
+        }
+        return corpus;
+    }
+
+    Sample BenchParseFormula() {
+        static const auto corpus = MakeFormulaCorpus(20000);
+
+        const size_t allocations = allocation_count;
+        Stopwatch stopwatch;
+        size_t cells = 0;
+        for (const auto& expression : corpus) {
+            cells += ParseFormula(expression)->GetReferencedCells().size();
+        }
+        Sample sample{stopwatch.GetSeconds(), corpus.size(), {}};
+        sample.counters["allocs_per_formula"] =
+                static_cast<double>(allocation_count - allocations) / static_cast<double>(sample.items);
+        sink = sink + static_cast<double>(cells);
+        return sample;
+    }
+
+    // --- Загрузка и пересчёт ---
+
+    constexpr int LOAD_ROWS = 1000;
+    constexpr int LOAD_COLS = 50;
+
+    /// Столбцы чередуются: числа, текст, формулы со ссылками на числовой столбец
+    std::string MakeLoadText(int row, int col) {
+        switch (col % 3) {
+            case 0:
+                return std::to_string(row * LOAD_COLS + col);
+            case 1:
+                return "text " + std::to_string(row);
+            default:
+                return "=" + CellName(row, col - 2) + "*2+" + CellName(row / 2, col - 2);
+        }
+    }
+
+    void LoadSheet(Sheet& sheet) {
+        for (int row = 0; row < LOAD_ROWS; ++row) {
+            for (int col = 0; col < LOAD_COLS; ++col) {
+                sheet.SetCell({row, col}, MakeLoadText(row, col));
+            }
+        }
+    }
+
+    Sample BenchBulkLoad() {
+        Sheet sheet;
+        Stopwatch stopwatch;
+        LoadSheet(sheet);
+        return {stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+    }
+
+    Sample BenchLoadCells() {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(static_cast<size_t>(LOAD_ROWS) * LOAD_COLS);
+        for (int row = 0; row < LOAD_ROWS; ++row) {
+            for (int col = 0; col < LOAD_COLS; ++col) {
+                cells.emplace_back(Position{row, col}, MakeLoadText(row, col));
+            }
+        }
+
+        Sheet sheet;
+        Stopwatch stopwatch;
+        sheet.LoadCells(cells);
+        return {stopwatch.GetSeconds(), cells.size(), {}};
+    }
+
+    /// Небольшие пакеты в загруженный лист: упорядочиваются только формулы
+    /// пакета и зависящие от них, а не все формулы листа
+    Sample BenchCommitSmallBatch() {
+        constexpr int batches = 100;
+        constexpr int batch_size = 10;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        Stopwatch stopwatch;
+        for (int batch = 0; batch < batches; ++batch) {
+            sheet.BeginBatch();
+            for (int i = 0; i < batch_size; ++i) {
+                const int row = (batch * batch_size + i) % LOAD_ROWS;
+                sheet.SetCell({row, LOAD_COLS}, "=" + CellName(row, 2) + "+" + std::to_string(batch));
+            }
+            sheet.CommitBatch(1);
+        }
+        return {stopwatch.GetSeconds(), static_cast<size_t>(batches), {}};
+    }
+
+    /// Изменение начала цепочки и чтение её конца пересчитывает всю цепочку
+    Sample BenchDeepChainRecalc() {
+        constexpr int length = 2000;
+        constexpr int edits = 20;
+
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "0");
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell({row, 0}, "=" + CellName(row - 1) + "+1");
+        }
+        const CellInterface* last = sheet.GetCell({length - 1, 0});
+        Consume(last->GetValue());
+
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({0, 0}, std::to_string(edit));
+            Consume(last->GetValue());
+        }
+        return {stopwatch.GetSeconds(), static_cast<size_t>(length) * edits, {}};
+    }
+
+    /// Двоичное дерево формул, листья которого зависят от A1. После изменения A1
+    /// потоки одновременно читают все формулы дерева в разном порядке: каждая
+    /// формула вычисляется одним потоком, остальные ждут её значения
+    Sample BenchConcurrentTreeRecalc() {
+        constexpr int size = 1 << 13;
+        constexpr int edits = 10;
+        const size_t threads_count = std::max(2u, std::thread::hardware_concurrency());
+
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "0");
+        for (int node = 1; node < size; ++node) {
+            const int left = 2 * node;
+            if (left + 1 < size) {
+                sheet.SetCell({node, 1}, "=" + CellName(left, 1) + "+" + CellName(left + 1, 1));
+            } else {
+                sheet.SetCell({node, 1}, "=A1+" + std::to_string(node));
+            }
+        }
+        Consume(sheet.GetCell({1, 1})->GetValue());
+
+        const Sheet& reader = sheet;
+        std::atomic<size_t> numbers = 0;
+        size_t recomputed = 0;
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({0, 0}, std::to_string(edit + 1));
+            std::vector<std::thread> threads;
+            for (size_t thread = 0; thread < threads_count; ++thread) {
+                threads.emplace_back([&reader, &numbers, thread] {
+                    // Потоки начинают с разных ячеек и идут с разным шагом
+                    const size_t step = 2 * thread + 1;
+                    size_t count = 0;
+                    for (size_t i = 0; i + 1 < static_cast<size_t>(size); ++i) {
+                        const int node = static_cast<int>(1 + (i * step + thread * 7919) % (size - 1));
+                        const auto value = reader.GetCell({node, 1})->GetNumericValue();
+                        count += std::holds_alternative<double>(value);
+                    }
+                    numbers += count;
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            recomputed += sheet.GetRecalcStats().recomputed;
+        }
+
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(size - 1) * edits, {}};
+        sample.counters["threads"] = static_cast<double>(threads_count);
+        sample.counters["recomputed_per_formula"] = static_cast<double>(recomputed) / sample.items;
+        sample.counters["numbers_per_formula"] = static_cast<double>(numbers) / sample.items / threads_count;
+        return sample;
+    }
+
+    // --- Протягивание формулы вниз ---
+
+    constexpr int FILL_ROWS = 16000;
+
+    std::string MakeFillText(int row) {
+        return "=" + CellName(row, 0) + "*2+SUM(" + CellName(row, 1) + ":" + CellName(row + 1, 1) + ")";
+    }
+
+    /// Каждая ячейка устанавливается отдельно
+    Sample BenchFillSetCell() {
+        Sheet sheet;
+        Stopwatch stopwatch;
+        for (int row = 0; row < FILL_ROWS; ++row) {
+            sheet.SetCell({row, 2}, MakeFillText(row));
+        }
+        return {stopwatch.GetSeconds(), static_cast<size_t>(FILL_ROWS), {}};
+    }
+
+    /// Тексты загружаются пакетом
+    Sample BenchFillLoadCells() {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(FILL_ROWS);
+        for (int row = 0; row < FILL_ROWS; ++row) {
+            cells.emplace_back(Position{row, 2}, MakeFillText(row));
+        }
+
+        Sheet sheet;
+        Stopwatch stopwatch;
+        sheet.LoadCells(std::move(cells));
+        return {stopwatch.GetSeconds(), static_cast<size_t>(FILL_ROWS), {}};
+    }
+
+    /// Первая формула копируется в остальные ячейки без разбора текста
+    Sample BenchFillRange() {
+        Sheet sheet;
+        const size_t allocations = allocation_count;
+        Stopwatch stopwatch;
+        sheet.SetCell({0, 2}, MakeFillText(0));
+        sheet.FillRange({{0, 2}, {0, 2}}, {{1, 2}, {FILL_ROWS - 1, 2}});
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(FILL_ROWS), {}};
+        sample.counters["allocations_per_cell"] = static_cast<double>(allocation_count - allocations) / FILL_ROWS;
+        sample.counters["programs"] = static_cast<double>(sheet.GetFormulaCache().GetStats().programs);
+        return sample;
+    }
+
+    /// Копирование одной формулы на лист, где формул уже много: стоимость
+    /// зависит от копии и зависящих от неё формул, а не от размера листа
+    Sample BenchCopyCellLargeSheet() {
+        constexpr int copies = 200;
+
+        Sheet sheet;
+        sheet.SetCell({0, 2}, MakeFillText(0));
+        sheet.FillRange({{0, 2}, {0, 2}}, {{1, 2}, {FILL_ROWS - 1, 2}});
+        Stopwatch stopwatch;
+        for (int copy = 0; copy < copies; ++copy) {
+            sheet.CopyRange({{copy, 2}, {copy, 2}}, {copy, 3});
+        }
+        return {stopwatch.GetSeconds(), static_cast<size_t>(copies), {}};
+    }
+
+    /// Изменение ячейки, от которой зависят width формул, и чтение всех формул
+    Sample BenchWideFanOutRecalc() {
+        constexpr int width = 10000;
+        constexpr int edits = 20;
+
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 0; row < width; ++row) {
+            sheet.SetCell({row, 1}, "=A1*" + std::to_string(row));
+        }
+
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({0, 0}, std::to_string(edit));
+            for (int row = 0; row < width; ++row) {
+                Consume(sheet.GetCell({row, 1})->GetValue());
+            }
+        }
+        return {stopwatch.GetSeconds(), static_cast<size_t>(width) * edits, {}};
+    }
+
+    Sample BenchRecalculateAll() {
+        Sheet sheet;
+        LoadSheet(sheet);
+
+        const size_t allocations = allocation_count;
+        Stopwatch stopwatch;
+        sheet.RecalculateAll();
+        Sample sample{stopwatch.GetSeconds(), sheet.GetRecalcStats().recomputed, {}};
+        sample.counters["allocs_per_cell"] =
+                static_cast<double>(allocation_count - allocations) / static_cast<double>(sample.items);
+        return sample;
+    }
+
+    /// Формулы над диапазонами числовых ячеек: каждое вычисление читает
+    /// значения range_size ячеек. Тексты чисел длинные, чтобы их копирование
+    /// требовало выделения памяти
+    Sample BenchRangeOperands() {
+        constexpr int rows = 2000;
+        constexpr int range_size = 100;
+
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row) + ".50000000000000000");
+        }
+        for (int row = 0; row + range_size <= rows; ++row) {
+            sheet.SetCell({row, 1}, "=SUM(" + CellName(row) + ":" + CellName(row + range_size - 1) + ")+"
+                                    + CellName(row) + "*" + CellName(row + 1));
+        }
+
+        const size_t allocations = allocation_count;
+        Stopwatch stopwatch;
+        sheet.RecalculateAll(1);
+        Sample sample{stopwatch.GetSeconds(), sheet.GetRecalcStats().recomputed, {}};
+        sample.counters["allocs_per_cell"] =
+                static_cast<double>(allocation_count - allocations) / static_cast<double>(sample.items);
+        return sample;
+    }
+
+    /// Лист, на котором большинство формул вычисляется в ошибку: деление на ноль,
+    /// нечисловой текст и формулы, ссылающиеся на ячейки с ошибками
+    Sample BenchErrorHeavy() {
+        constexpr int rows = 5000;
+
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, row % 2 == 0 ? "=1/0" : "text");
+            sheet.SetCell({row, 1}, "=" + CellName(row) + "+1");
+            sheet.SetCell({row, 2}, "=SUM(" + CellName(row, 1) + ":" + CellName(std::min(row + 9, rows - 1), 1) + ")");
+        }
+
+        Stopwatch stopwatch;
+        sheet.RecalculateAll(1);
+        return {stopwatch.GetSeconds(), sheet.GetRecalcStats().recomputed, {}};
+    }
+
+    // --- Печать ---
+
+    Sample BenchPrintValues() {
+        Sheet sheet;
+        LoadSheet(sheet);
+        // Значения формул вычисляются заранее, измеряется только печать
+        std::ostringstream warmup;
+        sheet.PrintValues(warmup);
+
+        std::ostringstream output;
+        Stopwatch stopwatch;
+        sheet.PrintValues(output);
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+        sample.counters["bytes"] = static_cast<double>(output.str().size());
+        return sample;
+    }
+
+    /// Потребитель, который держит копию значений листа, после каждого изменения
+    /// числа забирает журнал изменений вместо печати и сравнения всего листа
+    Sample BenchTakeChanges() {
+        constexpr int edits = 2000;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        std::ostringstream warmup;
+        sheet.PrintValues(warmup);
+        sheet.SetChangeTracking(true);
+
+        size_t changes = 0;
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({edit % LOAD_ROWS, 3 * (edit % (LOAD_COLS / 3))}, std::to_string(edit));
+            const SheetDelta delta = sheet.TakeChanges();
+            changes += delta.value_changed.size();
+        }
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(edits), {}};
+        sample.counters["changes_per_edit"] = static_cast<double>(changes) / edits;
+        sample.counters["sheet_cells"] = static_cast<double>(LOAD_ROWS) * LOAD_COLS;
+        return sample;
+    }
+
+    /// Вставка и удаление строки: сдвигаются строки ниже row и переписываются
+    /// формулы, которые ссылаются на них
+    Sample InsertDeleteRows(int row) {
+        constexpr int edits = 20;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        std::ostringstream warmup;
+        sheet.PrintValues(warmup);
+
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.InsertRows(row);
+            sheet.DeleteRows(row);
+        }
+        Sample sample{stopwatch.GetSeconds(), 2 * static_cast<size_t>(edits), {}};
+        sample.counters["moved_rows"] = LOAD_ROWS - row;
+        return sample;
+    }
+
+    Sample BenchInsertDeleteRowsBottom() {
+        return InsertDeleteRows(LOAD_ROWS - 10);
+    }
+
+    Sample BenchInsertDeleteRowsTop() {
+        return InsertDeleteRows(0);
+    }
+
+    /// Вставка и удаление строки у нижнего края листа, над которым много формул
+    /// с диапазонами: диапазоны, которые не задевает сдвиг, не перебираются
+    Sample BenchInsertDeleteRowsRanges() {
+        constexpr int edits = 20;
+        constexpr int range_cols = 20;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        for (int row = 0; row < LOAD_ROWS; ++row) {
+            for (int col = LOAD_COLS; col < LOAD_COLS + range_cols; ++col) {
+                sheet.SetCell({row, col}, "=SUM(" + CellName(row / 2, 0) + ":" + CellName(row / 2 + 5, 2) + ")");
+            }
+        }
+
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.InsertRows(LOAD_ROWS);
+            sheet.DeleteRows(LOAD_ROWS);
+        }
+        Sample sample{stopwatch.GetSeconds(), 2 * static_cast<size_t>(edits), {}};
+        sample.counters["ranges"] = static_cast<double>(sheet.GetDependencies().GetRangeEntryCount());
+        return sample;
+    }
+
+    /// Размер печатной области после каждого изменения ячейки на краю листа
+    Sample BenchPrintableSize() {
+        constexpr int edits = 2000;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        Stopwatch stopwatch;
+        int sum = 0;
+        for (int edit = 0; edit < edits; ++edit) {
+            const Position pos{LOAD_ROWS + edit % 10, LOAD_COLS};
+            if (edit % 2 == 0) {
+                sheet.SetCell(pos, "edge");
+            } else {
+                sheet.ClearCell(pos);
+            }
+            sum += sheet.GetPrintableSize().rows;
+        }
+        Sample sample{stopwatch.GetSeconds(), edits, {}};
+        sink = sink + sum;
+        return sample;
+    }
+
+    // --- Версии листа ---
+
+    /// Публикация после изменения одной ячейки: заново строится только её блок
+    /// и блоки зависящих от неё формул
+    Sample BenchPublish() {
+        constexpr int edits = 100;
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        Stopwatch first_stopwatch;
+        sheet.Publish();
+        const double first_seconds = first_stopwatch.GetSeconds();
+
+        Stopwatch stopwatch;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({edit % LOAD_ROWS, LOAD_COLS}, std::to_string(edit));
+            sheet.Publish();
+        }
+        Sample sample{stopwatch.GetSeconds(), edits, {}};
+        sample.counters["first_publish_ms"] = first_seconds * 1000;
+        return sample;
+    }
+
+    /// Читатели обходят опубликованные версии, пока писатель меняет лист и публикует
+    Sample BenchConcurrentReads() {
+        constexpr int passes = 10;
+        const size_t readers = std::max(2u, std::thread::hardware_concurrency());
+
+        Sheet sheet;
+        LoadSheet(sheet);
+        sheet.Publish();
+
+        std::atomic<size_t> active = readers;
+        std::atomic<size_t> numbers = 0;
+        std::vector<std::thread> threads;
+        Stopwatch stopwatch;
+        for (size_t reader = 0; reader < readers; ++reader) {
+            threads.emplace_back([&] {
+                size_t count = 0;
+                for (int pass = 0; pass < passes; ++pass) {
+                    const auto version = sheet.GetPublishedVersion();
+                    for (int row = 0; row < LOAD_ROWS; ++row) {
+                        for (int col = 0; col < LOAD_COLS; ++col) {
+                            const auto value = version->GetCell({row, col})->GetNumericValue();
+                            count += std::holds_alternative<double>(value);
+                        }
+                    }
+                }
+                numbers += count;
+                --active;
+            });
+        }
+        size_t publishes = 0;
+        while (active > 0) {
+            sheet.SetCell({static_cast<int>(publishes % LOAD_ROWS), 0}, std::to_string(publishes));
+            sheet.Publish();
+            ++publishes;
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        Sample sample{stopwatch.GetSeconds(), readers * passes * LOAD_ROWS * LOAD_COLS, {}};
+        sample.counters["readers"] = static_cast<double>(readers);
+        sample.counters["publishes"] = static_cast<double>(publishes);
+        sink = sink + static_cast<double>(numbers);
+        return sample;
+    }
+
+    // --- Обмен файлами ---
+
+    Sample BenchExportCsv() {
+        Sheet sheet;
+        LoadSheet(sheet);
+        std::ostringstream warmup;
+        sheet.PrintValues(warmup);
+
+        std::ostringstream output;
+        Stopwatch stopwatch;
+        sheet.PrintTexts(output, CsvFormat::Csv());
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+        sample.counters["bytes"] = static_cast<double>(output.str().size());
+        return sample;
+    }
+
+    Sample BenchImportCsv() {
+        static const std::string csv = [] {
+            Sheet sheet;
+            LoadSheet(sheet);
+            std::ostringstream output;
+            sheet.PrintTexts(output, CsvFormat::Csv());
+            return output.str();
+        }();
+
+        Sheet sheet;
+        std::istringstream input(csv);
+        Stopwatch stopwatch;
+        ImportCsv(input, sheet);
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+        sample.counters["bytes"] = static_cast<double>(csv.size());
+        return sample;
+    }
+
+    /// Снимок листа с вычисленными значениями, чтобы загрузка не требовала пересчёта
+    const std::string& GetSnapshot() {
+        static const std::string snapshot = [] {
+            Sheet sheet;
+            LoadSheet(sheet);
+            std::ostringstream warmup;
+            sheet.PrintValues(warmup);
+            std::ostringstream output;
+            sheet.SaveSnapshot(output);
+            return output.str();
+        }();
+        return snapshot;
+    }
+
+    Sample BenchSaveSnapshot() {
+        Sheet sheet;
+        LoadSheet(sheet);
+        std::ostringstream warmup;
+        sheet.PrintValues(warmup);
+
+        std::ostringstream output;
+        Stopwatch stopwatch;
+        sheet.SaveSnapshot(output);
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+        sample.counters["bytes"] = static_cast<double>(output.str().size());
+        return sample;
+    }
+
+    Sample BenchLoadSnapshot() {
+        const std::string& snapshot = GetSnapshot();
+
+        Stopwatch stopwatch;
+        auto sheet = Sheet::LoadSnapshot(snapshot);
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(LOAD_ROWS) * LOAD_COLS, {}};
+        sample.counters["bytes"] = static_cast<double>(snapshot.size());
+        return sample;
+    }
+
+    // --- Позиции ---
+
+    std::vector<Position> MakePositions(size_t size) {
+        Random random(7);
+        std::vector<Position> positions;
+        positions.reserve(size);
+        for (size_t i = 0; i < size; ++i) {
+            positions.push_back({random.Next(Position::MAX_ROWS), random.Next(Position::MAX_COLS)});
+        }
+        return positions;
+    }
+
+    Sample BenchPositionToString() {
+        static const auto positions = MakePositions(200000);
+
+        Stopwatch stopwatch;
+        size_t length = 0;
+        for (Position pos : positions) {
+            length += pos.ToString().size();
+        }
+        Sample sample{stopwatch.GetSeconds(), positions.size(), {}};
+        sink = sink + static_cast<double>(length);
+        return sample;
+    }
+
+    Sample BenchPositionFromString() {
+        static const auto names = [] {
+            std::vector<std::string> result;
+            for (Position pos : MakePositions(200000)) {
+                result.push_back(pos.ToString());
+            }
+            return result;
+        }();
+
+        Stopwatch stopwatch;
+        int sum = 0;
+        for (const auto& name : names) {
+            sum += Position::FromString(name).row;
+        }
+        Sample sample{stopwatch.GetSeconds(), names.size(), {}};
+        sink = sink + sum;
+        return sample;
+    }
+
+    /// Запись имён в буфер на стеке, без строк
+    Sample BenchPositionToChars() {
+        static const auto positions = MakePositions(200000);
+
+        Stopwatch stopwatch;
+        size_t length = 0;
+        char buffer[Position::MAX_STRING_LENGTH];
+        for (Position pos : positions) {
+            length += pos.ToChars(buffer) - buffer;
+        }
+        Sample sample{stopwatch.GetSeconds(), positions.size(), {}};
+        sink = sink + static_cast<double>(length);
+        return sample;
+    }
+
+    Sample BenchPositionFromStrings() {
+        static const auto names = [] {
+            std::vector<std::string> result;
+            for (Position pos : MakePositions(200000)) {
+                result.push_back(pos.ToString());
+            }
+            return result;
+        }();
+        static const std::vector<std::string_view> views(names.begin(), names.end());
+
+        Stopwatch stopwatch;
+        const auto positions = Position::FromStrings(views);
+        Sample sample{stopwatch.GetSeconds(), positions.size(), {}};
+        sink = sink + positions.back().row;
+        return sample;
+    }
+
+    // --- Память ---
+
+    /// Занятая память: куски пула считаются только в той части, что отдана объектам,
+    /// иначе лист, занявший места, освобождённые прошлым бенчмарком, выглядел бы бесплатным
+    size_t GetUsedBytes() {
+        const auto pool = SmallObjectPool::GetStats();
+        return live_bytes - pool.reserved_bytes + pool.used_bytes;
+    }
+
+    /// Память листа в пересчёте на ячейку, заполненную make_text
+    Sample MeasureMemoryPerCell(const std::function<std::string(int, int)>& make_text) {
+        constexpr int rows = 1000;
+        constexpr int cols = 100;
+
+        const size_t before = GetUsedBytes();
+        Stopwatch stopwatch;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell({row, col}, make_text(row, col));
+            }
+        }
+
+        Sample sample{stopwatch.GetSeconds(), static_cast<size_t>(rows) * cols, {}};
+        sample.counters["bytes_per_cell"] = static_cast<double>(GetUsedBytes() - before) / sample.items;
+        sample.counters["programs"] = static_cast<double>(sheet.GetFormulaCache().GetStats().programs);
+        return sample;
+    }
+
+    Sample BenchMemoryNumbers() {
+        return MeasureMemoryPerCell([](int row, int col) {
+            return std::to_string(row * 100 + col);
+        });
+    }
+
+    Sample BenchMemoryText() {
+        return MeasureMemoryPerCell([](int row, int) {
+            return "text " + std::to_string(row);
+        });
+    }
+
+    Sample BenchMemoryFormulas() {
+        return MeasureMemoryPerCell([](int row, int col) {
+            return col == 0 ? std::to_string(row) : "=" + CellName(row, col - 1) + "+1";
+        });
+    }
+
+    /// Столбцы формул, скопированных вниз: у каждого столбца одна общая программа
+    Sample BenchMemoryCopiedFormulas() {
+        return MeasureMemoryPerCell([](int row, int col) {
+            if (col < 2) {
+                return std::to_string(row + col);
+            }
+            const std::string left = CellName(row, col - 2);
+            const std::string right = CellName(row, col - 1);
+            return "=" + left + "*" + right + "+SUM(" + left + ":" + right + ")/MAX(" + left + ",1)";
+        });
+    }
+
+    // --- Проверка циклических зависимостей ---
+
+    /// Цепочка A2=A1+1, A3=A2+1, ..., заполняемая снизу вверх: у каждой
+    /// новой формулы уже есть все зависящие от неё ячейки
+    void LoadChainBackward(Sheet& sheet, int length) {
+        for (int row = length - 1; row >= 1; --row) {
+            sheet.SetCell({row, 0}, "=" + CellName(row - 1) + "+1");
+        }
+        sheet.SetCell({0, 0}, "1");
+    }
+
+    /// Двоичное дерево: ячейка i ссылается на ячейки 2i и 2i+1, заполняется от корня
+    void LoadBinaryTree(Sheet& sheet, int size) {
+        for (int node = 1; node < size; ++node) {
+            const int left = 2 * node;
+            const int right = left + 1;
+            if (right < size) {
+                sheet.SetCell({node, 0}, "=" + CellName(left) + "+" + CellName(right));
+            } else {
+                sheet.SetCell({node, 0}, std::to_string(node));
+            }
+        }
+    }
+
+    /// Одна ячейка, на которую ссылаются width формул, многократно меняет формулу
+    void EditFanOutRoot(Sheet& sheet, int width, int edits) {
+        for (int row = 0; row < width; ++row) {
+            sheet.SetCell({row, 1}, "=A1*2");
+        }
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({0, 0}, "=" + CellName(edit % 100, 2) + "+1");
+        }
+    }
+
+    std::function<Sample()> MakeCycleBenchmark(CycleDetection mode, size_t items,
+                                               std::function<void(Sheet&)> load) {
+        return [mode, items, load = std::move(load)] {
+            Sheet sheet;
+            sheet.SetCycleDetection(mode);
+            Stopwatch stopwatch;
+            load(sheet);
+            return Sample{stopwatch.GetSeconds(), items, {}};
+        };
+    }
+
+    std::vector<Benchmark> MakeBenchmarks() {
+        std::vector<Benchmark> benchmarks = {
+                {"parse/formula", BenchParseFormula},
+                {"sheet/bulk_load", BenchBulkLoad},
+                {"sheet/load_cells", BenchLoadCells},
+                {"sheet/commit_small_batch", BenchCommitSmallBatch},
+                {"fill/set_cell", BenchFillSetCell},
+                {"fill/load_cells", BenchFillLoadCells},
+                {"fill/fill_range", BenchFillRange},
+                {"fill/copy_cell_large_sheet", BenchCopyCellLargeSheet},
+                {"recalc/deep_chain", BenchDeepChainRecalc},
+                {"recalc/wide_fan_out", BenchWideFanOutRecalc},
+                {"recalc/concurrent_tree", BenchConcurrentTreeRecalc},
+                {"recalc/recalculate_all", BenchRecalculateAll},
+                {"recalc/range_operands", BenchRangeOperands},
+                {"recalc/error_heavy", BenchErrorHeavy},
+                {"print/values", BenchPrintValues},
+                {"structure/insert_delete_rows_bottom", BenchInsertDeleteRowsBottom},
+                {"structure/insert_delete_rows_top", BenchInsertDeleteRowsTop},
+                {"structure/insert_delete_rows_ranges", BenchInsertDeleteRowsRanges},
+                {"print/printable_size", BenchPrintableSize},
+                {"print/take_changes", BenchTakeChanges},
+                {"version/publish", BenchPublish},
+                {"version/concurrent_reads", BenchConcurrentReads},
+                {"io/export_csv", BenchExportCsv},
+                {"io/import_csv", BenchImportCsv},
+                {"io/save_snapshot", BenchSaveSnapshot},
+                {"io/load_snapshot", BenchLoadSnapshot},
+                {"position/to_string", BenchPositionToString},
+                {"position/from_string", BenchPositionFromString},
+                {"position/to_chars", BenchPositionToChars},
+                {"position/from_strings", BenchPositionFromStrings},
+                {"memory/numbers", BenchMemoryNumbers},
+                {"memory/text", BenchMemoryText},
+                {"memory/formulas", BenchMemoryFormulas},
+                {"memory/copied_formulas", BenchMemoryCopiedFormulas},
+        };
+
+        const std::pair<CycleDetection, std::string> modes[] = {
+                {CycleDetection::Incremental, "incremental"},
+                {CycleDetection::FullSearch, "full_search"},
+        };
+        for (const auto& [mode, mode_name] : modes) {
+            benchmarks.push_back({"cycle/chain_backward/" + mode_name, MakeCycleBenchmark(mode, 2000, [](Sheet& sheet) {
+                LoadChainBackward(sheet, 2000);
+            })});
+            benchmarks.push_back({"cycle/binary_tree/" + mode_name, MakeCycleBenchmark(mode, 16382, [](Sheet& sheet) {
+                LoadBinaryTree(sheet, 16383);
+            })});
+            benchmarks.push_back({"cycle/fan_out/" + mode_name, MakeCycleBenchmark(mode, 200, [](Sheet& sheet) {
+                EditFanOutRoot(sheet, 5000, 200);
+            })});
+        }
+
+        benchmarks.push_back({"cycle/chain_backward/load_cells", [] {
+            std::vector<std::pair<Position, std::string>> cells;
+            for (int row = 1999; row >= 1; --row) {
+                cells.emplace_back(Position{row, 0}, "=" + CellName(row - 1) + "+1");
+            }
+            cells.emplace_back(Position{0, 0}, "1");
+
+            Sheet sheet;
+            Stopwatch stopwatch;
+            sheet.LoadCells(cells);
+            return Sample{stopwatch.GetSeconds(), cells.size(), {}};
+        }});
+
+        return benchmarks;
+    }
+
+    Result Run(const Benchmark& benchmark, size_t repetitions) {
+        std::vector<Sample> samples;
+        for (size_t i = 0; i < repetitions; ++i) {
+            samples.push_back(benchmark.run());
+        }
+        std::sort(samples.begin(), samples.end(), [](const Sample& lhs, const Sample& rhs) {
+            return lhs.seconds < rhs.seconds;
+        });
+        return {benchmark.name, repetitions, samples[samples.size() / 2]};
+    }
+
+    double GetItemsPerSecond(const Sample& sample) {
+        return sample.seconds > 0 ? static_cast<double>(sample.items) / sample.seconds : 0;
+    }
+
+    void PrintTable(const std::vector<Result>& results, std::ostream& out) {
+        out << std::left << std::setw(34) << "benchmark"
+            << std::right << std::setw(12) << "ms"
+            << std::setw(16) << "items/s" << "  counters" << '\n';
+        for (const auto& result : results) {
+            out << std::left << std::setw(34) << result.name << std::right << std::fixed
+                << std::setprecision(3) << std::setw(12) << result.median.seconds * 1000
+                << std::setprecision(0) << std::setw(16) << GetItemsPerSecond(result.median);
+            for (const auto& [name, value] : result.median.counters) {
+                out << "  " << name << '=' << std::setprecision(1) << value;
+            }
+            out << '\n';
+        }
+    }
+
+    void PrintJson(const std::vector<Result>& results, std::ostream& out) {
+        out << "{\n  \"benchmarks\": [";
+        bool first = true;
+        for (const auto& result : results) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+
+            out << "    {\"name\": \"" << result.name << '"'
+                << ", \"repetitions\": " << result.repetitions
+                << std::setprecision(9)
+                << ", \"seconds\": " << result.median.seconds
+                << ", \"items\": " << result.median.items
+                << ", \"items_per_second\": " << GetItemsPerSecond(result.median);
+            for (const auto& [name, value] : result.median.counters) {
+                out << ", \"" << name << "\": " << value;
+            }
+            out << '}';
+        }
+        out << "\n  ]\n}\n";
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    std::string filter;
+    size_t repetitions = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg.substr(0, 9) == "--filter=") {
+            filter = arg.substr(9);
+        } else if (arg.substr(0, 14) == "--repetitions=") {
+            repetitions = static_cast<size_t>(std::max(1, std::atoi(argv[i] + 14)));
+        } else {
+            std::cerr << "usage: spreadsheet_bench [--json] [--filter=substring] [--repetitions=N]" << '\n';
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (const auto& benchmark : MakeBenchmarks()) {
+        if (benchmark.name.find(filter) != std::string::npos) {
+            results.push_back(Run(benchmark, repetitions));
+        }
+    }
+
+    if (json) {
+        PrintJson(results, std::cout);
+    } else {
+        PrintTable(results, std::cout);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/// Запись и чтение значений тривиальных типов в двоичном виде. Порядок байтов
+/// платформы сохраняется как есть: формат, использующий эти функции, должен
+/// проверять его при чтении
+namespace binary_io {
+
+    template <typename T>
+    void Write(std::string& out, T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    inline void WriteString(std::string& out, std::string_view text) {
+        Write(out, static_cast<std::uint32_t>(text.size()));
+        out.append(text.data(), text.size());
+    }
+
+    /// Читает значение из начала in и сдвигает in за него
+    template <typename T>
+    T Read(std::string_view& in) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (in.size() < sizeof(T)) {
+            throw BinaryFormatException("unexpected end of data");
+        }
+        T value;
+        std::memcpy(&value, in.data(), sizeof(T));
+        in.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    /// Возвращает строку, указывающую на данные in
+    inline std::string_view ReadString(std::string_view& in) {
+        const auto size = Read<std::uint32_t>(in);
+        if (in.size() < size) {
+            throw BinaryFormatException("unexpected end of data");
+        }
+        std::string_view text = in.substr(0, size);
+        in.remove_prefix(size);
+        return text;
+    }
+
+}  // namespace binary_io
@@ -1,170 +1,471 @@
-#include "cell.h"
-#include "sheet.h"
-
-#include <iostream>
-#include <string>
-
-
-Cell::Cell(Sheet& sheet) : impl_(std::make_unique<EmptyImpl>()),
-                           sheet_(sheet)
-                           {}
-
-void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> temp_impl = CreateImplFromText(std::move(text));
-
-    if (HasCircularDependency(temp_impl.get())) {
-        throw CircularDependencyException("circular dependency detected");
-    }
-
-    UpdateDependencies(std::move(temp_impl));
-}
-
-std::unique_ptr<Cell::Impl> Cell::CreateImplFromText(std::string text) {
-    if (text.empty()) {
-        return std::make_unique<EmptyImpl>();
-    } else if (text.at(0) == FORMULA_SIGN && text.size() >= 2 ) {
-        return std::make_unique<FormulaImpl>(text.substr(1), sheet_);
-    } else {
-        return std::make_unique<TextImpl>(std::move(text));
-    }
-}
-
-bool Cell::HasCircularDependency(Impl* temp_impl) {
-    // Коллекция для хранения ссылок на ячейки, которые используются в формуле текущей ячейки
-    std::set<const Cell*> ref_collection;
-
-    // Коллекция для хранения ячеек, которые нужно проверить на наличие циклической зависимости
-    std::vector<const Cell*> to_enter_collection;
-
-    // Заполняем ref_collection ссылками на ячейки, которые используются в формуле текущей ячейки
-    for (const auto& position : temp_impl->GetReferencedCells()) {
-        ref_collection.insert(sheet_.GetCellNotInterface(position));
-    }
-
-    // Начинаем проверку на циклические зависимости с текущей ячейки
-    to_enter_collection.push_back(this);
-
-    while (!to_enter_collection.empty()) {
-        // Берем текущую ячейку для проверки
-        const Cell* ongoing = to_enter_collection.back();
-        to_enter_collection.pop_back();
-
-        // Проверяем, если текущая ячейка уже есть в ref_collection, то это означает циклическую зависимость
-        if (ref_collection.find(ongoing) != ref_collection.end()) {
-            return true; // Circular dependency detected
-        }
-
-        // Иначе, добавляем в to_enter_collection ячейки, от которых зависит текущая ячейка
-        for (const Cell* dependent : ongoing->dependent_cells_) {
-            // Но добавляем только если их нет еще в ref_collection, чтобы избежать повторной проверки
-            if (ref_collection.find(dependent) == ref_collection.end()) {
-                to_enter_collection.push_back(dependent);
-            }
-        }
-    }
-    // Если циклических зависимостей не обнаружено, возвращаем false
-    return false; // No circular dependency
-}
-
-void Cell::UpdateDependencies(std::unique_ptr<Impl> new_impl) {
-    // Шаг 1: Обновляем зависимости в ячейках, которые ссылались на текущую ячейку
-    for (Cell* referenced : referenced_cells_) {
-        referenced->dependent_cells_.erase(this); // Удаляем текущую ячейку из dependent_cells_ ячеек, которые на нее ссылались
-    }
-    referenced_cells_.clear(); // Очищаем текущий список зависимых ячеек
-
-    // Шаг 2: Обновляем список зависимых ячеек текущей ячейки на основе новой формулы
-    for (const auto& position : new_impl->GetReferencedCells()) {
-        Cell* referenced = sheet_.GetCellNotInterface(position);
-
-        // Если ячейки с такими координатами нет, то создаем пустую ячейку
-        if (!referenced) {
-            sheet_.SetCell(position, "");
-            referenced = sheet_.GetCellNotInterface(position);
-        }
-
-        // Проверяем, чтобы текущая ячейка не добавлялась в свой же список зависимых ячеек
-        if (referenced != this) {
-            referenced_cells_.emplace(referenced); // Добавляем найденную ячейку в список зависимых
-            referenced->dependent_cells_.emplace(this); // Добавляем текущую ячейку в список ячеек, которые на нее ссылаются
-        }
-    }
-
-    // Шаг 3: Обновляем формулу текущей ячейки на новую формулу
-    impl_ = std::move(new_impl);
-}
-
-void Cell::Clear() {
-    impl_ = std::make_unique<EmptyImpl>();
-}
-
-Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
-}
-
-std::string Cell::GetText() const {
-    return impl_->GetText();
-}
-
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
-}
-
-bool Cell::IsReferenced() const {
-    return !dependent_cells_.empty();
-}
-
-std::vector<Position> Cell::Impl::GetReferencedCells() const {
-    return {};
-}
-
-Cell::Value Cell::EmptyImpl::GetValue() const {
-    return {};
-}
-std::string Cell::EmptyImpl::GetText() const {
-    return {};
-}
-
-Cell::TextImpl::TextImpl(std::string text) : text_(std::move(text)) {}
-
-Cell::Value Cell::TextImpl::GetValue() const {
-    if (text_.empty()) {
-        throw FormulaException("it is empty impl, not text");
-
-    } else if (text_.at(0) == ESCAPE_SIGN) {
-        return text_.substr(1);
-
-    } else {
-        return text_;
-    }
-}
-
-std::string Cell::TextImpl::GetText() const {
-    return text_;
-}
-
-Cell::FormulaImpl::FormulaImpl(std::string text, SheetInterface& sheet) :
-    formula_ptr_(ParseFormula(std::move(text))),
-    sheet_(sheet) {}
-
-Cell::Value Cell::FormulaImpl::GetValue() const {
-    if (!cache_) {
-        cache_ = formula_ptr_->Evaluate(sheet_);
-    }
-
-    return std::visit([](auto& val){
-        return Value(val);
-        }, *cache_);
-}
-
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_ptr_->GetExpression();
-}
-
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_ptr_->GetReferencedCells();
-}
-
-void Cell::FormulaImpl::InvalidateCache() {
-    cache_.reset();
-}
\ No newline at end of file
+#include "cell.h"
+#include "binary_io.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+
+
+Cell::Cell(Sheet& sheet, Position pos) : impl_(std::make_unique<EmptyImpl>()),
+                                         sheet_(sheet),
+                                         pos_(pos)
+                                         {}
+
+void Cell::Set(std::string text) {
+    std::unique_ptr<Impl> temp_impl = CreateImplFromText(std::move(text), pos_, sheet_);
+
+    if (HasCircularDependency(temp_impl.get())) {
+        throw CircularDependencyException("circular dependency detected");
+    }
+
+    UpdateDependencies(std::move(temp_impl));
+}
+
+std::unique_ptr<Cell::Impl> Cell::CreateImplFromText(std::string text, Position pos, Sheet& sheet) {
+    if (text.empty()) {
+        return std::make_unique<EmptyImpl>();
+    } else if (text.at(0) == FORMULA_SIGN && text.size() >= 2 ) {
+        return std::make_unique<FormulaImpl>(ParseFormula(text.substr(1), pos, sheet.GetFormulaCache()), sheet);
+    } else {
+        return std::make_unique<TextImpl>(std::move(text));
+    }
+}
+
+std::unique_ptr<Cell::Impl> Cell::DeserializeImpl(std::string_view& data, Sheet& sheet) {
+    switch (static_cast<CellType>(binary_io::Read<std::uint8_t>(data))) {
+        case CellType::EMPTY:
+            return std::make_unique<EmptyImpl>();
+
+        case CellType::TEXT: {
+            auto text = binary_io::ReadString(data);
+            if (text.empty()) {
+                throw BinaryFormatException("empty text cell");
+            }
+            return std::make_unique<TextImpl>(std::string(text));
+        }
+
+        case CellType::FORMULA: {
+            auto formula = DeserializeFormula(data);
+            std::optional<FormulaInterface::Value> cache;
+            switch (binary_io::Read<std::uint8_t>(data)) {
+                case 0:
+                    break;
+                case 1:
+                    cache = binary_io::Read<double>(data);
+                    break;
+                case 2: {
+                    const auto category = binary_io::Read<std::uint8_t>(data);
+                    if (category > static_cast<std::uint8_t>(FormulaError::Category::Div0)) {
+                        throw BinaryFormatException("unidentified formula error");
+                    }
+                    cache = FormulaError(static_cast<FormulaError::Category>(category));
+                    break;
+                }
+                default:
+                    throw BinaryFormatException("unidentified cached value");
+            }
+            return std::make_unique<FormulaImpl>(std::move(formula), sheet, std::move(cache));
+        }
+
+        default:
+            throw BinaryFormatException("unidentified cell type");
+    }
+}
+
+bool Cell::HasCircularDependency(Impl* temp_impl) {
+    // Ячейки и диапазоны, которые используются в новой формуле текущей ячейки
+    std::vector<Position> ref_cells = temp_impl->GetReferencedCells();
+    std::vector<Range> ref_ranges = temp_impl->GetReferencedRanges();
+    std::sort(ref_cells.begin(), ref_cells.end());
+
+    // Формула, ссылающаяся сама на себя
+    if (IsReferencedBy(pos_, ref_cells, ref_ranges)) {
+        return true;
+    }
+
+    if (sheet_.GetCycleDetection() == CycleDetection::FullSearch) {
+        return HasCircularDependencyFullSearch(ref_cells, ref_ranges);
+    }
+    if (temp_impl->GetType() != CellType::FORMULA) {
+        return false;
+    }
+    return !UpdateFormulaOrder(ref_cells, ref_ranges);
+}
+
+bool Cell::HasCircularDependencyFullSearch(const std::vector<Position>& ref_cells,
+                                           const std::vector<Range>& ref_ranges) const {
+    if (ref_cells.empty() && ref_ranges.empty()) {
+        return false;
+    }
+
+    // Позиции, которые нужно проверить на наличие циклической зависимости
+    std::vector<Position> to_enter_collection{pos_};
+
+    // Позиции, которые уже были проверены
+    std::set<Position> visited;
+
+    const DependencyIndex& dependencies = sheet_.GetDependencies();
+    while (!to_enter_collection.empty()) {
+        // Берем текущую позицию для проверки
+        const Position ongoing = to_enter_collection.back();
+        to_enter_collection.pop_back();
+
+        // Если новая формула ссылается на текущую позицию, то это циклическая зависимость
+        if (IsReferencedBy(ongoing, ref_cells, ref_ranges)) {
+            return true; // Circular dependency detected
+        }
+
+        // Каждую позицию проверяем только один раз
+        if (!visited.insert(ongoing).second) {
+            continue;
+        }
+
+        // Иначе, добавляем в to_enter_collection формулы, которые зависят от текущей позиции
+        dependencies.ForEachDependent(ongoing, [&to_enter_collection](Position dependent) {
+            to_enter_collection.push_back(dependent);
+        });
+    }
+    // Если циклических зависимостей не обнаружено, возвращаем false
+    return false; // No circular dependency
+}
+
+bool Cell::UpdateFormulaOrder(const std::vector<Position>& ref_cells, const std::vector<Range>& ref_ranges) {
+    TopologicalOrder& order = sheet_.GetFormulaOrder();
+    const DependencyIndex& dependencies = sheet_.GetDependencies();
+
+    // Цикл может пройти только через формулы: у остальных ячеек нет ссылок
+    std::vector<Position> referenced_formulas;
+    for (Position position : ref_cells) {
+        const Cell* referenced = sheet_.GetCellNotInterface(position);
+        if (referenced && referenced->IsFormula()) {
+            referenced_formulas.push_back(position);
+        }
+    }
+    for (const Range& range : ref_ranges) {
+        sheet_.ForEachCellInRange(range, [&referenced_formulas](Position position, const Cell& referenced) {
+            if (referenced.IsFormula()) {
+                referenced_formulas.push_back(position);
+            }
+        });
+    }
+
+    const bool inserted = !order.Contains(pos_);
+    if (inserted) {
+        // На новую формулу никто не ссылается — её место в конце порядка, и новые
+        // ссылки с ним согласованы. Иначе она ставится в начало, перед зависимыми
+        if (!dependencies.HasDependents(pos_)) {
+            order.Append(pos_);
+            return true;
+        }
+        order.Prepend(pos_);
+    }
+
+    auto for_each_dependent = [&dependencies](Position position, const auto& func) {
+        dependencies.ForEachDependent(position, func);
+    };
+    for (Position referenced : referenced_formulas) {
+        if (!order.AddEdge(referenced, pos_, for_each_dependent)) {
+            if (inserted) {
+                order.Erase(pos_);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Cell::IsReferencedBy(Position pos, const std::vector<Position>& ref_cells, const std::vector<Range>& ref_ranges) {
+    return std::binary_search(ref_cells.begin(), ref_cells.end(), pos)
+        || std::any_of(ref_ranges.begin(), ref_ranges.end(), [pos](const Range& range) {
+               return range.Contains(pos);
+           });
+}
+
+std::unique_ptr<Cell::Impl> Cell::UpdateDependencies(std::unique_ptr<Impl> new_impl) {
+    DependencyIndex& dependencies = sheet_.GetDependencies();
+
+    // Шаг 1: Удаляем из индекса ссылки старой формулы
+    dependencies.Remove(pos_, impl_->GetReferencedCells(), impl_->GetReferencedRanges());
+
+    // Шаг 2: Добавляем ссылки новой формулы. Диапазон занимает в индексе одну запись
+    // независимо от размера, а пустые ячейки создаются только для ссылок на отдельные
+    // ячейки, чтобы GetCell возвращал их так же, как раньше
+    std::vector<Position> new_cells = new_impl->GetReferencedCells();
+    for (const auto& position : new_cells) {
+        sheet_.GetOrCreateCell(position);
+    }
+    dependencies.Add(pos_, new_cells, new_impl->GetReferencedRanges());
+
+    // Шаг 3: Ячейка без формулы не участвует в топологическом порядке
+    if (new_impl->GetType() != CellType::FORMULA) {
+        sheet_.GetFormulaOrder().Erase(pos_);
+    }
+
+    // Шаг 4: Пустая ячейка не входит в печатную область листа
+    const bool was_empty = impl_->GetType() == CellType::EMPTY;
+    const bool is_empty = new_impl->GetType() == CellType::EMPTY;
+    if (was_empty && !is_empty) {
+        sheet_.GetOccupancy().Add(pos_);
+    } else if (!was_empty && is_empty) {
+        sheet_.GetOccupancy().Remove(pos_);
+    }
+
+    // Шаг 5: Запоминаем прежнее содержимое для журнала изменений
+    if (sheet_.GetChangeLog().IsEnabled()) {
+        RecordInChangeLog();
+    }
+
+    // Шаг 6: Обновляем формулу текущей ячейки на новую формулу
+    std::swap(impl_, new_impl);
+    sheet_.MarkChanged(pos_);
+    return new_impl;
+}
+
+void Cell::RecordInChangeLog() const {
+    sheet_.GetChangeLog().RecordEdit(pos_, impl_->GetText(),
+                                     impl_->IsCacheValid() ? std::optional(impl_->GetValue()) : std::nullopt);
+}
+
+void Cell::Clear() {
+    // Очищенная ячейка больше ни на что не ссылается
+    UpdateDependencies(std::make_unique<EmptyImpl>());
+}
+
+size_t Cell::InvalidateDependentCaches() {
+    size_t invalidated = 0;
+    const DependencyIndex& dependencies = sheet_.GetDependencies();
+    std::vector<Position> to_enter_collection;
+    dependencies.ForEachDependent(pos_, [&to_enter_collection](Position dependent) {
+        to_enter_collection.push_back(dependent);
+    });
+
+    while (!to_enter_collection.empty()) {
+        Cell* ongoing = sheet_.GetCellNotInterface(to_enter_collection.back());
+        to_enter_collection.pop_back();
+
+        // Если кэш уже сброшен, то сброшены и кэши всех зависящих от ячейки формул:
+        // вычислить их без вычисления этой ячейки было невозможно
+        if (!ongoing->impl_->IsCacheValid()) {
+            continue;
+        }
+
+        if (sheet_.GetChangeLog().IsEnabled()) {
+            sheet_.GetChangeLog().RecordInvalidation(ongoing->pos_, ongoing->impl_->GetValue());
+        }
+        ongoing->impl_->InvalidateCache();
+        sheet_.MarkChanged(ongoing->pos_);
+        ++invalidated;
+
+        dependencies.ForEachDependent(ongoing->pos_, [&to_enter_collection](Position dependent) {
+            to_enter_collection.push_back(dependent);
+        });
+    }
+
+    return invalidated;
+}
+
+bool Cell::IsFormula() const {
+    return impl_->GetType() == CellType::FORMULA;
+}
+
+void Cell::InvalidateCache() {
+    impl_->InvalidateCache();
+}
+
+void Cell::Recalculate() {
+    impl_->Recalculate();
+}
+
+Cell::Value Cell::GetValue() const {
+    return impl_->GetValue();
+}
+
+Cell::NumericValue Cell::GetNumericValue() const {
+    return impl_->GetNumericValue();
+}
+
+Cell::NumericValue Cell::GetRangeValue() const {
+    NumericValue value = impl_->GetNumericValue();
+    // У текстовой ячейки ошибка означает только то, что текст не является числом
+    if (std::holds_alternative<FormulaError>(value) && impl_->GetType() == CellType::TEXT) {
+        return std::monostate{};
+    }
+    return value;
+}
+
+std::string Cell::GetText() const {
+    return impl_->GetText();
+}
+
+std::vector<Position> Cell::GetReferencedCells() const {
+    return impl_->GetReferencedCells();
+}
+
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
+bool Cell::IsReferenced() const {
+    return sheet_.GetDependencies().HasCellDependents(pos_);
+}
+
+std::vector<Position> Cell::Impl::GetReferencedCells() const {
+    return {};
+}
+
+Cell::Value Cell::EmptyImpl::GetValue() const {
+    return {};
+}
+std::string Cell::EmptyImpl::GetText() const {
+    return {};
+}
+
+void Cell::EmptyImpl::Serialize(std::string& out) const {
+    binary_io::Write(out, static_cast<std::uint8_t>(CellType::EMPTY));
+}
+
+namespace {
+    /// Формулы читают текстовые ячейки как числа при каждом вычислении, поэтому
+    /// текст разбирается один раз, когда он устанавливается
+    Cell::NumericValue ParseTextOperand(std::string_view text) {
+        if (!text.empty() && text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        if (text.empty()) {
+            return std::monostate{};
+        }
+        if (auto number = ParseNumber(text)) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+}//end namespace
+
+Cell::TextImpl::TextImpl(std::string text) : text_(std::move(text)),
+                                             numeric_value_(ParseTextOperand(text_)) {}
+
+Cell::Value Cell::TextImpl::GetValue() const {
+    if (text_.empty()) {
+        throw FormulaException("it is empty impl, not text");
+
+    } else if (text_.at(0) == ESCAPE_SIGN) {
+        return text_.substr(1);
+
+    } else {
+        return text_;
+    }
+}
+
+std::string Cell::TextImpl::GetText() const {
+    return text_;
+}
+
+void Cell::TextImpl::Serialize(std::string& out) const {
+    binary_io::Write(out, static_cast<std::uint8_t>(CellType::TEXT));
+    binary_io::WriteString(out, text_);
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet,
+                               std::optional<FormulaInterface::Value> cache) :
+    cache_state_(cache ? CLEAN : DIRTY),
+    cache_(cache.value_or(0.0)),
+    formula_ptr_(std::move(formula)),
+    sheet_(sheet) {}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet) :
+    cache_state_(DIRTY),
+    cache_(0.0),
+    formula_ptr_(std::move(formula)),
+    sheet_(sheet) {}
+
+const FormulaInterface::Value& Cell::FormulaImpl::GetCache() const {
+    std::uint8_t state = cache_state_.load(std::memory_order_acquire);
+    if (state == CLEAN) {
+        return cache_;
+    }
+
+    if (state == DIRTY && cache_state_.compare_exchange_strong(state, COMPUTING, std::memory_order_acquire)) {
+        sheet_.CountRecomputed();
+        try {
+            cache_ = formula_ptr_->Evaluate(sheet_);
+        } catch (...) {
+            cache_state_.store(DIRTY, std::memory_order_release);
+            throw;
+        }
+        cache_state_.store(CLEAN, std::memory_order_release);
+        return cache_;
+    }
+
+    // Значение вычисляет другой поток: ждём его результата, а не вычисляем повторно.
+    // Если вычисление прервалось исключением, пробуем вычислить сами
+    while ((state = cache_state_.load(std::memory_order_acquire)) == COMPUTING) {
+        std::this_thread::yield();
+    }
+    return state == CLEAN ? cache_ : GetCache();
+}
+
+Cell::Value Cell::FormulaImpl::GetValue() const {
+    return std::visit([](auto& val){
+        return Value(val);
+        }, GetCache());
+}
+
+Cell::NumericValue Cell::FormulaImpl::GetNumericValue() const {
+    const auto& cache = GetCache();
+    if (const double* number = std::get_if<double>(&cache)) {
+        return *number;
+    }
+    return std::get<FormulaError>(cache);
+}
+
+std::string Cell::FormulaImpl::GetText() const {
+    return FORMULA_SIGN + formula_ptr_->GetExpression();
+}
+
+std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
+    return formula_ptr_->GetReferencedCells();
+}
+
+std::vector<Range> Cell::FormulaImpl::GetReferencedRanges() const {
+    return formula_ptr_->GetReferencedRanges();
+}
+
+void Cell::FormulaImpl::Recalculate() {
+    cache_ = formula_ptr_->Evaluate(sheet_);
+    cache_state_.store(CLEAN, std::memory_order_release);
+}
+
+void Cell::FormulaImpl::InvalidateCache() {
+    cache_state_.store(DIRTY, std::memory_order_release);
+}
+
+std::unique_ptr<Cell::Impl> Cell::FormulaImpl::Shift(const SheetShift& shift) const {
+    auto formula = formula_ptr_->Shift(shift);
+    if (!formula) {
+        return nullptr;
+    }
+    return std::make_unique<FormulaImpl>(std::move(formula), sheet_);
+}
+
+std::unique_ptr<Cell::Impl> Cell::FormulaImpl::Copy(Position offset) const {
+    return std::make_unique<FormulaImpl>(formula_ptr_->Translate(offset), sheet_);
+}
+
+void Cell::FormulaImpl::Serialize(std::string& out) const {
+    binary_io::Write(out, static_cast<std::uint8_t>(CellType::FORMULA));
+    formula_ptr_->Serialize(out);
+
+    // Кэш сохраняется, чтобы после загрузки не пересчитывать весь лист
+    if (!IsCacheValid()) {
+        binary_io::Write(out, std::uint8_t{0});
+    } else if (std::holds_alternative<double>(cache_)) {
+        binary_io::Write(out, std::uint8_t{1});
+        binary_io::Write(out, std::get<double>(cache_));
+    } else {
+        binary_io::Write(out, std::uint8_t{2});
+        binary_io::Write(out, static_cast<std::uint8_t>(std::get<FormulaError>(cache_).GetCategory()));
+    }
+}
@@ -1,97 +1,188 @@
-#pragma once
-
-#include "common.h"
-#include "formula.h"
-
-#include <functional>
-#include <unordered_set>
-#include <stack>
-#include <set>
-
-class Sheet;
-
-enum class CellType
-{
-    EMPTY,    // default type on cell creation
-    TEXT,
-    FORMULA
-};
-
-class Cell : public CellInterface {
-    class Impl;
-public:
-    explicit Cell(Sheet& sheet);
-    ~Cell() override = default;
-
-    void Set(std::string text);
-    void Clear();
-
-    [[nodiscard]] Value GetValue() const override;
-    [[nodiscard]] std::string GetText() const override;
-    [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
-    [[nodiscard]] bool IsReferenced() const;
-
-private:
-    /// Поля класса
-    std::unique_ptr<Impl> impl_;
-    Sheet& sheet_;
-
-    std::set<Cell*> dependent_cells_;
-    std::set<Cell*> referenced_cells_;
-
-    /// Вспомогательные методы
-    std::unique_ptr<Impl> CreateImplFromText(std::string text);
-    bool HasCircularDependency(Impl* temp_impl);
-    void UpdateDependencies(std::unique_ptr<Impl> new_impl);
-
-    /// Вспомогательные классы
-    class Impl {
-    public:
-        [[maybe_unused]] [[nodiscard]] virtual CellType GetType() const = 0;
-        [[nodiscard]] virtual Value GetValue() const = 0;
-        [[nodiscard]] virtual std::string GetText() const = 0;
-        [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
-
-        virtual void InvalidateCache() = 0;
-
-        virtual ~Impl() = default;
-    };
-
-    class EmptyImpl : public Impl {
-    public:
-        [[nodiscard]] CellType GetType() const override { return CellType::EMPTY; }
-        [[nodiscard]] Value GetValue() const override;
-        [[nodiscard]] std::string GetText() const override;
-        [[nodiscard]] std::vector<Position> GetReferencedCells() const override { return {}; }
-        void InvalidateCache() override {}    /// поддержка интерфейса
-    };
-
-    class TextImpl : public Impl {
-    public:
-        explicit TextImpl(std::string text);
-        [[nodiscard]] CellType GetType() const override { return CellType::TEXT; }
-        [[nodiscard]] Value GetValue() const override;
-        [[nodiscard]] std::string GetText() const override;
-        [[nodiscard]] std::vector<Position> GetReferencedCells() const override { return {}; }
-        void InvalidateCache() override {}    /// поддержка интерфейса
-    private:
-        std::string text_;
-    };
-
-    class FormulaImpl : public Impl {
-    public:
-
-        explicit FormulaImpl(std::string text, SheetInterface& sheet);
-        [[nodiscard]] CellType GetType() const override { return CellType::FORMULA; }
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-
-        void InvalidateCache() override;
-
-    private:
-        mutable std::optional<FormulaInterface::Value> cache_;
-        std::unique_ptr<FormulaInterface> formula_ptr_;
-        SheetInterface& sheet_;
-    };
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "small_object_pool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+class Sheet;
+
+enum class CellType
+{
+    EMPTY,    // default type on cell creation
+    TEXT,
+    FORMULA
+};
+
+class Cell : public CellInterface {
+    class Impl;
+    /// Пакетная загрузка листа разбирает тексты и связывает зависимости сама
+    friend class Sheet;
+public:
+    Cell(Sheet& sheet, Position pos);
+    ~Cell() override = default;
+
+    void Set(std::string text);
+    void Clear();
+
+    [[nodiscard]] Value GetValue() const override;
+    [[nodiscard]] NumericValue GetNumericValue() const override;
+    [[nodiscard]] NumericValue GetRangeValue() const override;
+    [[nodiscard]] std::string GetText() const override;
+    [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
+    [[nodiscard]] std::vector<Range> GetReferencedRanges() const;
+    /// Есть ли формулы, ссылающиеся на ячейку как на отдельную ячейку.
+    /// Такая ячейка хранится на листе и после очистки
+    [[nodiscard]] bool IsReferenced() const;
+    [[nodiscard]] Position GetPosition() const { return pos_; }
+
+    /// Сбрасывает кэш всех ячеек, транзитивно зависящих от текущей.
+    /// Обход останавливается на ячейках, кэш которых уже сброшен.
+    /// Возвращает количество ячеек, кэш которых был сброшен.
+    size_t InvalidateDependentCaches();
+
+    [[nodiscard]] bool IsFormula() const;
+    /// Сбрасывает кэш значения самой ячейки
+    void InvalidateCache();
+    /// Вычисляет формулу и сохраняет значение в кэше. Ячейки, на которые
+    /// ссылается формула, должны быть уже вычислены
+    void Recalculate();
+
+private:
+    /// Поля класса
+    std::unique_ptr<Impl> impl_;
+    Sheet& sheet_;
+    Position pos_;
+
+    /// Вспомогательные методы
+    /// Формулы разбираются через кэш общих программ листа, pos — позиция ячейки
+    static std::unique_ptr<Impl> CreateImplFromText(std::string text, Position pos, Sheet& sheet);
+    /// Читает содержимое, записанное Impl::Serialize, из начала data и сдвигает data за него
+    static std::unique_ptr<Impl> DeserializeImpl(std::string_view& data, Sheet& sheet);
+    /// Проверяет, замкнёт ли новая формула цикл. В режиме CycleDetection::Incremental
+    /// заодно ставит ячейку в топологический порядок формул с новыми ссылками
+    bool HasCircularDependency(Impl* temp_impl);
+    /// Полный обход ячеек, зависящих от текущей
+    bool HasCircularDependencyFullSearch(const std::vector<Position>& ref_cells, const std::vector<Range>& ref_ranges) const;
+    bool UpdateFormulaOrder(const std::vector<Position>& ref_cells, const std::vector<Range>& ref_ranges);
+    /// ref_cells должны быть отсортированы
+    static bool IsReferencedBy(Position pos, const std::vector<Position>& ref_cells, const std::vector<Range>& ref_ranges);
+    /// Устанавливает новое содержимое без проверки циклов и возвращает старое
+    std::unique_ptr<Impl> UpdateDependencies(std::unique_ptr<Impl> new_impl);
+    /// Запоминает в журнале изменений листа текст и известное значение ячейки
+    void RecordInChangeLog() const;
+
+    /// Вспомогательные классы
+    class Impl {
+    public:
+        [[maybe_unused]] [[nodiscard]] virtual CellType GetType() const = 0;
+        [[nodiscard]] virtual Value GetValue() const = 0;
+        [[nodiscard]] virtual NumericValue GetNumericValue() const = 0;
+        [[nodiscard]] virtual std::string GetText() const = 0;
+        [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+        [[nodiscard]] virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+        virtual void InvalidateCache() = 0;
+        [[nodiscard]] virtual bool IsCacheValid() const = 0;
+        virtual void Recalculate() = 0;
+        /// Дописывает в out содержимое в двоичном виде вместе с кэшем значения
+        virtual void Serialize(std::string& out) const = 0;
+        /// Содержимое со ссылками, изменёнными вставкой или удалением строк
+        /// (столбцов), или nullptr, если ссылки не меняются
+        [[nodiscard]] virtual std::unique_ptr<Impl> Shift(const SheetShift&) const { return nullptr; }
+        /// Содержимое для ячейки, сдвинутой на offset, без разбора текста
+        [[nodiscard]] virtual std::unique_ptr<Impl> Copy(Position offset) const = 0;
+
+        /// Содержимое есть у каждой ячейки, поэтому оно выделяется из общего пула
+        static void* operator new(size_t size) { return SmallObjectPool::Allocate(size); }
+        static void operator delete(void* ptr, size_t size) { SmallObjectPool::Deallocate(ptr, size); }
+
+        virtual ~Impl() = default;
+    };
+
+    class EmptyImpl : public Impl {
+    public:
+        [[nodiscard]] CellType GetType() const override { return CellType::EMPTY; }
+        [[nodiscard]] Value GetValue() const override;
+        [[nodiscard]] NumericValue GetNumericValue() const override { return std::monostate{}; }
+        [[nodiscard]] std::string GetText() const override;
+        [[nodiscard]] std::vector<Position> GetReferencedCells() const override { return {}; }
+        [[nodiscard]] std::vector<Range> GetReferencedRanges() const override { return {}; }
+        void InvalidateCache() override {}    /// поддержка интерфейса
+        [[nodiscard]] bool IsCacheValid() const override { return true; }
+        void Recalculate() override {}    /// поддержка интерфейса
+        void Serialize(std::string& out) const override;
+        [[nodiscard]] std::unique_ptr<Impl> Copy(Position) const override { return std::make_unique<EmptyImpl>(); }
+    };
+
+    class TextImpl : public Impl {
+    public:
+        explicit TextImpl(std::string text);
+        [[nodiscard]] CellType GetType() const override { return CellType::TEXT; }
+        [[nodiscard]] Value GetValue() const override;
+        [[nodiscard]] NumericValue GetNumericValue() const override { return numeric_value_; }
+        [[nodiscard]] std::string GetText() const override;
+        [[nodiscard]] std::vector<Position> GetReferencedCells() const override { return {}; }
+        [[nodiscard]] std::vector<Range> GetReferencedRanges() const override { return {}; }
+        void InvalidateCache() override {}    /// поддержка интерфейса
+        [[nodiscard]] bool IsCacheValid() const override { return true; }
+        void Recalculate() override {}    /// поддержка интерфейса
+        void Serialize(std::string& out) const override;
+        [[nodiscard]] std::unique_ptr<Impl> Copy(Position) const override { return std::make_unique<TextImpl>(*this); }
+    private:
+        std::string text_;
+        /// Значение текста как операнда формулы, вычисляется один раз при установке
+        NumericValue numeric_value_;
+    };
+
+    class FormulaImpl : public Impl {
+    public:
+
+        /// Уже разобранная формула: из кэша общих программ листа или из снимка
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet,
+                    std::optional<FormulaInterface::Value> cache);
+        /// Формула, значение которой ещё не вычислялось
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet);
+        [[nodiscard]] CellType GetType() const override { return CellType::FORMULA; }
+        Value GetValue() const override;
+        [[nodiscard]] NumericValue GetNumericValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        std::vector<Range> GetReferencedRanges() const override;
+
+        void InvalidateCache() override;
+        [[nodiscard]] bool IsCacheValid() const override {
+            return cache_state_.load(std::memory_order_acquire) == CLEAN;
+        }
+        void Recalculate() override;
+        void Serialize(std::string& out) const override;
+        [[nodiscard]] std::unique_ptr<Impl> Shift(const SheetShift& shift) const override;
+        [[nodiscard]] std::unique_ptr<Impl> Copy(Position offset) const override;
+
+    private:
+        /// Состояние кэша значения. Значение вычисляет один поток — тот, что
+        /// перевёл состояние из DIRTY в COMPUTING; остальные потоки, которым
+        /// нужно это значение, ждут перехода в CLEAN и читают готовый результат
+        enum CacheState : std::uint8_t {
+            DIRTY,
+            COMPUTING,
+            CLEAN,
+        };
+
+        mutable std::atomic<std::uint8_t> cache_state_;
+        /// Действителен, когда состояние CLEAN
+        mutable FormulaInterface::Value cache_;
+        std::unique_ptr<FormulaInterface> formula_ptr_;
+        Sheet& sheet_;
+
+        /// Возвращает значение из кэша, при необходимости вычисляя его.
+        /// Можно вызывать из нескольких потоков, пока лист не меняется
+        const FormulaInterface::Value& GetCache() const;
+    };
 };
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "cell_storage.h"
+#include "sheet.h"
+
+Cell* CellStorage::Get(Position pos) {
+    return const_cast<Cell*>(static_cast<const CellStorage*>(this)->Get(pos));
+}
+
+const Cell* CellStorage::Get(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    if (!tile) {
+        return nullptr;
+    }
+
+    const Group* group = tile->groups[GetGroupIndex(pos)].get();
+    const size_t index = GetIndexInGroup(pos);
+    return group && group->Has(index) ? &group->At(index) : nullptr;
+}
+
+Cell* CellStorage::GetOrCreate(Position pos) {
+    const auto tile_row = static_cast<size_t>(pos.row / TILE_SIZE);
+    const auto tile_col = static_cast<size_t>(pos.col / TILE_SIZE);
+
+    if (tile_row >= tiles_.size()) {
+        tiles_.resize(tile_row + 1);
+    }
+    auto& row = tiles_[tile_row];
+    if (tile_col >= row.size()) {
+        row.resize(tile_col + 1);
+    }
+
+    auto& tile = row[tile_col];
+    if (!tile) {
+        tile = std::make_unique<Tile>();
+        ++tile_count_;
+    }
+
+    auto& group = tile->groups[GetGroupIndex(pos)];
+    if (!group) {
+        group = std::make_unique<Group>();
+        ++group_count_;
+    }
+
+    const size_t index = GetIndexInGroup(pos);
+    if (!group->Has(index)) {
+        group->Emplace(index, sheet_, pos);
+        ++tile->count;
+        ++cell_count_;
+        sheet_.MarkChanged(pos);
+    }
+    return &group->At(index);
+}
+
+void CellStorage::Erase(Position pos) {
+    const auto tile_row = static_cast<size_t>(pos.row / TILE_SIZE);
+    const auto tile_col = static_cast<size_t>(pos.col / TILE_SIZE);
+    if (!FindTile(pos)) {
+        return;
+    }
+
+    auto& tile = tiles_[tile_row][tile_col];
+    auto& group = tile->groups[GetGroupIndex(pos)];
+    const size_t index = GetIndexInGroup(pos);
+    if (!group || !group->Has(index)) {
+        return;
+    }
+
+    group->Erase(index);
+    --cell_count_;
+    sheet_.MarkChanged(pos);
+    if (group->Empty()) {
+        group.reset();
+        --group_count_;
+    }
+    if (--tile->count == 0) {
+        tile.reset();
+        --tile_count_;
+    }
+}
+
+const CellStorage::Tile* CellStorage::FindTile(Position pos) const {
+    const auto tile_row = static_cast<size_t>(pos.row / TILE_SIZE);
+    const auto tile_col = static_cast<size_t>(pos.col / TILE_SIZE);
+
+    if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+        return nullptr;
+    }
+    return tiles_[tile_row][tile_col].get();
+}
+
+CellStorage::Group::~Group() {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        if (Has(i)) {
+            At(i).~Cell();
+        }
+    }
+}
+
+Cell& CellStorage::Group::Emplace(size_t index, Sheet& sheet, Position pos) {
+    Cell* cell = new (slots_[index].data) Cell(sheet, pos);
+    occupied_ |= std::uint64_t{1} << index;
+    return *cell;
+}
+
+void CellStorage::Group::Erase(size_t index) {
+    At(index).~Cell();
+    occupied_ &= ~(std::uint64_t{1} << index);
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+class Sheet;
+
+/// Хранилище ячеек листа. Лист разбит на блоки TILE_SIZE x TILE_SIZE, блок
+/// выделяется при появлении в нём первой ячейки и освобождается вместе с последней.
+/// Внутри блока ячейки хранятся группами GROUP_SIZE x GROUP_SIZE, которые тоже
+/// выделяются по мере заполнения, так что одиночная ячейка не занимает место
+/// целого блока. Ячейки не перемещаются, пока существуют, поэтому указатели
+/// на них остаются действительными
+class CellStorage {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int GROUP_SIZE = 8;
+
+    explicit CellStorage(Sheet& sheet) : sheet_(sheet) {}
+
+    [[nodiscard]] Cell* Get(Position pos);
+    [[nodiscard]] const Cell* Get(Position pos) const;
+    Cell* GetOrCreate(Position pos);
+    void Erase(Position pos);
+
+    /// Обходит все ячейки блок за блоком, внутри блока — группа за группой,
+    /// внутри группы — по строкам
+    template <typename Func>
+    void ForEach(Func&& func);
+    template <typename Func>
+    void ForEach(Func&& func) const;
+    /// Обходит ячейки диапазона, пропуская невыделенные блоки и группы
+    template <typename Func>
+    void ForEachInRange(const Range& range, Func&& func) const;
+
+    [[nodiscard]] size_t GetCellCount() const { return cell_count_; }
+    [[nodiscard]] size_t GetTileCount() const { return tile_count_; }
+    [[nodiscard]] size_t GetGroupCount() const { return group_count_; }
+
+private:
+    static constexpr int GROUPS_PER_SIDE = TILE_SIZE / GROUP_SIZE;
+    static_assert(GROUP_SIZE * GROUP_SIZE == 64, "занятость группы хранится в 64-битной маске");
+
+    /// Группа ячеек: место под ячейки и маска занятых мест
+    class Group {
+    public:
+        Group() = default;
+        Group(const Group&) = delete;
+        Group& operator=(const Group&) = delete;
+        ~Group();
+
+        [[nodiscard]] bool Has(size_t index) const { return occupied_ >> index & 1; }
+        [[nodiscard]] bool Empty() const { return occupied_ == 0; }
+        Cell& At(size_t index) { return *std::launder(reinterpret_cast<Cell*>(slots_[index].data)); }
+        [[nodiscard]] const Cell& At(size_t index) const {
+            return *std::launder(reinterpret_cast<const Cell*>(slots_[index].data));
+        }
+
+        Cell& Emplace(size_t index, Sheet& sheet, Position pos);
+        void Erase(size_t index);
+
+    private:
+        struct Slot {
+            alignas(Cell) unsigned char data[sizeof(Cell)];
+        };
+
+        std::uint64_t occupied_ = 0;
+        std::array<Slot, GROUP_SIZE * GROUP_SIZE> slots_;
+    };
+
+    struct Tile {
+        std::array<std::unique_ptr<Group>, GROUPS_PER_SIDE * GROUPS_PER_SIDE> groups;
+        size_t count = 0;
+    };
+
+    Sheet& sheet_;
+    /// Каталог блоков [строка блока][столбец блока], растёт по мере необходимости
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+    size_t cell_count_ = 0;
+    size_t tile_count_ = 0;
+    size_t group_count_ = 0;
+
+    [[nodiscard]] const Tile* FindTile(Position pos) const;
+
+    static size_t GetGroupIndex(Position pos) {
+        return static_cast<size_t>(pos.row % TILE_SIZE / GROUP_SIZE) * GROUPS_PER_SIDE + pos.col % TILE_SIZE / GROUP_SIZE;
+    }
+    static size_t GetIndexInGroup(Position pos) {
+        return static_cast<size_t>(pos.row % GROUP_SIZE) * GROUP_SIZE + pos.col % GROUP_SIZE;
+    }
+};
+
+template <typename Func>
+void CellStorage::ForEach(Func&& func) {
+    for (size_t tile_row = 0; tile_row < tiles_.size(); ++tile_row) {
+        for (size_t tile_col = 0; tile_col < tiles_[tile_row].size(); ++tile_col) {
+            auto& tile = tiles_[tile_row][tile_col];
+            if (!tile) {
+                continue;
+            }
+            for (size_t g = 0; g < tile->groups.size(); ++g) {
+                Group* group = tile->groups[g].get();
+                if (!group) {
+                    continue;
+                }
+                const size_t top = tile_row * TILE_SIZE + g / GROUPS_PER_SIDE * GROUP_SIZE;
+                const size_t left = tile_col * TILE_SIZE + g % GROUPS_PER_SIDE * GROUP_SIZE;
+                for (size_t i = 0; i < GROUP_SIZE * GROUP_SIZE; ++i) {
+                    if (group->Has(i)) {
+                        Position pos{static_cast<int>(top + i / GROUP_SIZE), static_cast<int>(left + i % GROUP_SIZE)};
+                        func(pos, group->At(i));
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <typename Func>
+void CellStorage::ForEach(Func&& func) const {
+    const_cast<CellStorage*>(this)->ForEach([&func](Position pos, const Cell& cell) {
+        func(pos, cell);
+    });
+}
+
+template <typename Func>
+void CellStorage::ForEachInRange(const Range& range, Func&& func) const {
+    const auto first_tile_row = static_cast<size_t>(range.from.row / TILE_SIZE);
+    const auto last_tile_row = std::min(static_cast<size_t>(range.to.row / TILE_SIZE) + 1, tiles_.size());
+    for (size_t tile_row = first_tile_row; tile_row < last_tile_row; ++tile_row) {
+        const auto& row = tiles_[tile_row];
+        const auto first_tile_col = static_cast<size_t>(range.from.col / TILE_SIZE);
+        const auto last_tile_col = std::min(static_cast<size_t>(range.to.col / TILE_SIZE) + 1, row.size());
+        for (size_t tile_col = first_tile_col; tile_col < last_tile_col; ++tile_col) {
+            const Tile* tile = row[tile_col].get();
+            if (!tile) {
+                continue;
+            }
+
+            const int tile_top = static_cast<int>(tile_row) * TILE_SIZE;
+            const int tile_left = static_cast<int>(tile_col) * TILE_SIZE;
+            const int row_begin = std::max(range.from.row, tile_top);
+            const int row_end = std::min(range.to.row, tile_top + TILE_SIZE - 1);
+            const int col_begin = std::max(range.from.col, tile_left);
+            const int col_end = std::min(range.to.col, tile_left + TILE_SIZE - 1);
+            // Внутри блока ячейки обходятся по строкам, как и без групп
+            for (int r = row_begin; r <= row_end; ++r) {
+                for (int group_left = col_begin - col_begin % GROUP_SIZE; group_left <= col_end; group_left += GROUP_SIZE) {
+                    const Group* group = tile->groups[GetGroupIndex({r, group_left})].get();
+                    if (!group) {
+                        continue;
+                    }
+                    const int group_end = std::min(col_end, group_left + GROUP_SIZE - 1);
+                    for (int c = std::max(col_begin, group_left); c <= group_end; ++c) {
+                        const size_t index = GetIndexInGroup({r, c});
+                        if (group->Has(index)) {
+                            func(Position{r, c}, group->At(index));
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
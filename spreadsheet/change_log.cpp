@@ -0,0 +1,50 @@
+#include "change_log.h"
+
+#include <algorithm>
+
+void ChangeLog::SetEnabled(bool enabled) {
+    enabled_ = enabled;
+    if (!enabled_) {
+        records_.clear();
+    }
+}
+
+void ChangeLog::RecordEdit(Position pos, std::string old_text, std::optional<CellInterface::Value> old_value) {
+    auto [it, inserted] = records_.try_emplace(pos);
+    Record& record = it->second;
+    if (inserted) {
+        record.old_value = std::move(old_value);
+    }
+    // Если до правки сбрасывался только кэш, текст с тех пор не менялся
+    if (!record.old_text) {
+        record.old_text = std::move(old_text);
+    }
+}
+
+void ChangeLog::RecordInvalidation(Position pos, CellInterface::Value old_value) {
+    auto [it, inserted] = records_.try_emplace(pos);
+    if (inserted) {
+        it->second.old_value = std::move(old_value);
+    }
+}
+
+SheetDelta ChangeLog::Take(const SheetInterface& sheet) {
+    SheetDelta delta;
+    for (const auto& [pos, record] : records_) {
+        // Отсутствующая ячейка выглядит так же, как пустая
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (record.old_text && *record.old_text != (cell ? cell->GetText() : std::string())) {
+            delta.text_changed.push_back(pos);
+        }
+
+        const CellInterface::Value value = cell ? cell->GetValue() : CellInterface::Value{};
+        if (!record.old_value || !(*record.old_value == value)) {
+            delta.value_changed.push_back(pos);
+        }
+    }
+    records_.clear();
+
+    std::sort(delta.text_changed.begin(), delta.text_changed.end());
+    std::sort(delta.value_changed.begin(), delta.value_changed.end());
+    return delta;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Изменения листа: позиции по возрастанию, без повторов
+struct SheetDelta {
+    std::vector<Position> text_changed;     /// текст ячейки стал другим (в том числе очищенной)
+    std::vector<Position> value_changed;    /// вычисленное значение ячейки стало другим
+
+    [[nodiscard]] bool Empty() const { return text_changed.empty() && value_changed.empty(); }
+};
+
+/// Журнал изменений для потребителей, которые держат копию значений листа.
+/// Для каждой затронутой позиции запоминается состояние до первого изменения:
+/// текст, если его меняли, и значение, если оно было известно. Изменения
+/// отбираются сравнением с текущим состоянием, поэтому правка, вернувшая
+/// ячейку к прежнему виду, в журнал не попадает. Работа пропорциональна
+/// количеству затронутых ячеек, а не размеру листа
+class ChangeLog {
+public:
+    void SetEnabled(bool enabled);
+    [[nodiscard]] bool IsEnabled() const { return enabled_; }
+
+    /// Текст ячейки меняется. old_value — значение до изменения, nullopt,
+    /// если оно не вычислялось
+    void RecordEdit(Position pos, std::string old_text, std::optional<CellInterface::Value> old_value);
+    /// Сбрасывается кэш формулы, значение которой было old_value
+    void RecordInvalidation(Position pos, CellInterface::Value old_value);
+
+    /// Сравнивает запомненное с текущим состоянием листа, возвращает отличия
+    /// и очищает журнал. Значения формул при этом вычисляются
+    SheetDelta Take(const SheetInterface& sheet);
+
+    [[nodiscard]] bool HasRecords() const { return !records_.empty(); }
+
+private:
+    struct Record {
+        /// Текст до изменения; nullopt, если текст ячейки не менялся
+        std::optional<std::string> old_text;
+        /// Значение до изменения; nullopt, если оно неизвестно
+        std::optional<CellInterface::Value> old_value;
+    };
+
+    bool enabled_ = false;
+    std::unordered_map<Position, Record, PositionHasher> records_;
+};
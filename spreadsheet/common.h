@@ -1,109 +1,222 @@
-#pragma once
-
-#include <iosfwd>
-#include <memory>
-#include <stdexcept>
-#include <string>
-#include <string_view>
-#include <variant>
-#include <vector>
-
-struct Position {
-    int row = 0;
-    int col = 0;
-
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
-
-    [[nodiscard]] bool IsValid() const;
-    [[nodiscard]] std::string ToString() const;
-
-    static Position FromString(std::string_view str);
-
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
-    static const Position NONE;
-};
-
-struct Size {
-    int rows = 0;
-    int cols = 0;
-
-    bool operator==(Size rhs) const;
-};
-
-class FormulaError : std::exception {
-public:
-    enum class Category {
-        Ref,
-        Value,
-        Div0,
-    };
-
-    FormulaError(Category category) { category_ = category; }
-    [[nodiscard]] Category GetCategory() const { return category_; }
-    bool operator==(const FormulaError& rhs) const{ return category_ == rhs.category_; }
-
-    [[nodiscard]] std::string_view ToString() const {
-        switch (category_) {
-            case Category::Ref:
-                return "#REF!";
-            case Category::Value:
-                return "#VALUE!";
-            case Category::Div0:
-                return "#DIV/0!";
-            default:
-                return {};
-        }
-    }
-
-private:
-    Category category_;
-};
-
-std::ostream& operator<<(std::ostream& output, const FormulaError& fe);
-
-class InvalidPositionException : public std::out_of_range {
-public:
-    using std::out_of_range::out_of_range;
-};
-
-class FormulaException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-class CircularDependencyException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-class CellInterface {
-public:
-
-    using Value = std::variant<std::string, double, FormulaError>;
-
-    virtual ~CellInterface() = default;
-    [[nodiscard]] virtual Value GetValue() const = 0;
-    [[nodiscard]] virtual std::string GetText() const = 0;
-    [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-inline constexpr char FORMULA_SIGN = '=';
-inline constexpr char ESCAPE_SIGN = '\'';
-
-class SheetInterface {
-public:
-
-    virtual ~SheetInterface() = default;
-
-    virtual void SetCell(Position pos, std::string text) = 0;
-    [[nodiscard]] virtual const CellInterface* GetCell(Position pos) const = 0;
-    virtual CellInterface* GetCell(Position pos) = 0;
-    virtual void ClearCell(Position pos) = 0;
-    [[nodiscard]] virtual Size GetPrintableSize() const = 0;
-    virtual void PrintValues(std::ostream& output) const = 0;
-    virtual void PrintTexts(std::ostream& output) const = 0;
-};
-
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+struct Position {
+    int row = 0;
+    int col = 0;
+
+    bool operator==(Position rhs) const;
+    bool operator<(Position rhs) const;
+
+    [[nodiscard]] bool IsValid() const;
+    [[nodiscard]] std::string ToString() const;
+    /// Записывает имя позиции (например, "AB12") в буфер из MAX_STRING_LENGTH
+    /// символов без выделения памяти и возвращает указатель за последним
+    /// записанным символом. Для недействительной позиции ничего не пишет
+    char* ToChars(char* first) const;
+
+    static Position FromString(std::string_view str);
+
+    /// Пакетные варианты FromString и ToString: разбор списка имён и запись
+    /// имён позиций в конец out через separator
+    static std::vector<Position> FromStrings(const std::vector<std::string_view>& names);
+    static void AppendStrings(std::string& out, const std::vector<Position>& positions, char separator);
+
+    /// Упакованный 32-битный ключ действительной позиции: строка в старших
+    /// битах, столбец в младших. Ключи упорядочены так же, как позиции
+    [[nodiscard]] std::uint32_t Pack() const {
+        return static_cast<std::uint32_t>(row) << COL_BITS | static_cast<std::uint32_t>(col);
+    }
+    static Position Unpack(std::uint32_t key) {
+        return {static_cast<int>(key >> COL_BITS), static_cast<int>(key & (MAX_COLS - 1))};
+    }
+
+    static const int MAX_ROWS = 16384;
+    static const int MAX_COLS = 16384;
+    static const int COL_BITS = 14;
+    /// Длина самого длинного имени позиции, XFD16384
+    static const int MAX_STRING_LENGTH = 8;
+    static const Position NONE;
+};
+
+static_assert(Position::MAX_COLS == 1 << Position::COL_BITS);
+
+namespace std {
+    template <>
+    struct hash<Position> {
+        size_t operator()(Position pos) const noexcept {
+            return pos.Pack();
+        }
+    };
+}//end namespace std
+
+/// Хеш позиции для неупорядоченных контейнеров
+struct PositionHasher {
+    size_t operator()(Position pos) const {
+        return std::hash<Position>{}(pos);
+    }
+};
+
+struct Size {
+    int rows = 0;
+    int cols = 0;
+
+    bool operator==(Size rhs) const;
+};
+
+/// Прямоугольный диапазон ячеек, включающий обе угловые ячейки
+struct Range {
+    Position from;    /// левая верхняя ячейка
+    Position to;      /// правая нижняя ячейка
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    [[nodiscard]] bool IsValid() const;
+    [[nodiscard]] bool Contains(Position pos) const;
+    [[nodiscard]] Size GetSize() const;
+    [[nodiscard]] std::string ToString() const;
+
+    /// Диапазон по двум любым противоположным углам
+    static Range FromCorners(Position first, Position second);
+};
+
+/// Вставка или удаление строк либо столбцов листа: при count > 0 перед строкой
+/// (столбцом) first вставляется count строк (столбцов), при count < 0 удаляются
+/// -count строк (столбцов), начиная с first
+struct SheetShift {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    Axis axis = Axis::Rows;
+    int first = 0;
+    int count = 0;
+
+    /// Положение ячейки после изменения. Удалённая ячейка или ячейка,
+    /// вытесненная за границу листа, превращается в Position::NONE (#REF!)
+    [[nodiscard]] Position Apply(Position pos) const;
+    /// Диапазон после изменения: вставка внутри диапазона расширяет его,
+    /// удаление части строк (столбцов) сужает. Если не осталось ни одной
+    /// строки (столбца), возвращается диапазон из Position::NONE (#REF!)
+    [[nodiscard]] Range Apply(Range range) const;
+
+    /// Сдвигается или удаляется ли ячейка (задевается ли диапазон)
+    [[nodiscard]] bool Affects(Position pos) const;
+    [[nodiscard]] bool Affects(Range range) const;
+};
+
+class FormulaError : std::exception {
+public:
+    enum class Category {
+        Ref,
+        Value,
+        Div0,
+    };
+
+    FormulaError(Category category) { category_ = category; }
+    [[nodiscard]] Category GetCategory() const { return category_; }
+    bool operator==(const FormulaError& rhs) const{ return category_ == rhs.category_; }
+
+    [[nodiscard]] std::string_view ToString() const {
+        switch (category_) {
+            case Category::Ref:
+                return "#REF!";
+            case Category::Value:
+                return "#VALUE!";
+            case Category::Div0:
+                return "#DIV/0!";
+            default:
+                return {};
+        }
+    }
+
+private:
+    Category category_;
+};
+
+std::ostream& operator<<(std::ostream& output, const FormulaError& fe);
+
+class InvalidPositionException : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+class FormulaException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/// Повреждённые или несовместимые двоичные данные: снимок листа или формула
+class BinaryFormatException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CircularDependencyException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+
+    CircularDependencyException(const std::string& what, std::vector<Position> cells)
+        : std::runtime_error(what), cells_(std::move(cells)) {}
+
+    /// Все ячейки, лежащие на циклах. Заполняется при пакетной загрузке
+    [[nodiscard]] const std::vector<Position>& GetCells() const { return cells_; }
+
+private:
+    std::vector<Position> cells_;
+};
+
+class CellInterface {
+public:
+
+    using Value = std::variant<std::string, double, FormulaError>;
+
+    virtual ~CellInterface() = default;
+    [[nodiscard]] virtual Value GetValue() const = 0;
+    [[nodiscard]] virtual std::string GetText() const = 0;
+    [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    /// Значение ячейки как операнд формулы: std::monostate для пустой ячейки
+    /// и пустого текста, число либо ошибка (#VALUE! для текста, не являющегося
+    /// числом). В отличие от GetValue() не копирует текст ячейки
+    using NumericValue = std::variant<std::monostate, double, FormulaError>;
+    [[nodiscard]] virtual NumericValue GetNumericValue() const;
+    /// Значение ячейки внутри диапазона агрегатной функции: как GetNumericValue(),
+    /// но текст, не являющийся числом, пропускается так же, как пустая ячейка
+    [[nodiscard]] virtual NumericValue GetRangeValue() const;
+};
+
+inline constexpr char FORMULA_SIGN = '=';
+inline constexpr char ESCAPE_SIGN = '\'';
+
+/// Число, которым целиком является текст. Как и std::stod, допускает пробелы
+/// в начале и знак '+'. Для остального текста возвращает nullopt
+std::optional<double> ParseNumber(std::string_view text);
+
+class SheetInterface {
+public:
+
+    virtual ~SheetInterface() = default;
+
+    virtual void SetCell(Position pos, std::string text) = 0;
+    [[nodiscard]] virtual const CellInterface* GetCell(Position pos) const = 0;
+    virtual CellInterface* GetCell(Position pos) = 0;
+    virtual void ClearCell(Position pos) = 0;
+    [[nodiscard]] virtual Size GetPrintableSize() const = 0;
+    virtual void PrintValues(std::ostream& output) const = 0;
+    virtual void PrintTexts(std::ostream& output) const = 0;
+};
+
 std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
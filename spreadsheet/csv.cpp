@@ -0,0 +1,174 @@
+#include "csv.h"
+
+#include "sheet.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+CsvReader::CsvReader(std::istream& input, CsvFormat format, size_t chunk_size)
+    : input_(input),
+      format_(format),
+      buffer_(std::max<size_t>(chunk_size, 1)) {}
+
+const char* CsvReader::FindRecordEnd(const char* begin, const char* end, bool eof) const {
+    bool in_quotes = false;
+    for (const char* it = begin; it != end; ++it) {
+        if (format_.quote != '\0' && *it == format_.quote) {
+            in_quotes = !in_quotes;
+        } else if (*it == '\n' && !in_quotes) {
+            return it;
+        }
+    }
+    return eof ? end : nullptr;
+}
+
+std::string_view CsvReader::Unquote(std::string_view field) {
+    if (field.size() < 2 || field.front() != format_.quote || field.back() != format_.quote) {
+        return field;
+    }
+
+    field = field.substr(1, field.size() - 2);
+    if (field.find(format_.quote) == std::string_view::npos) {
+        return field;
+    }
+
+    unescaped_.clear();
+    for (size_t i = 0; i < field.size(); ++i) {
+        unescaped_.push_back(field[i]);
+        if (field[i] == format_.quote && i + 1 < field.size() && field[i + 1] == format_.quote) {
+            ++i;
+        }
+    }
+    return unescaped_;
+}
+
+CsvWriter::CsvWriter(std::ostream& output, CsvFormat format)
+    : output_(output),
+      format_(format),
+      precision_(static_cast<int>(output.precision())) {
+    buffer_.reserve(BUFFER_SIZE);
+
+    const auto flags = output.flags();
+    if ((flags & (std::ios::showpoint | std::ios::showpos | std::ios::uppercase)) || precision_ < 0 ||
+        output.getloc() != std::locale::classic()) {
+        return;
+    }
+    const auto float_field = flags & std::ios::floatfield;
+    if (float_field == std::ios::fmtflags{}) {
+        number_format_ = std::chars_format::general;
+    } else if (float_field == std::ios::fixed) {
+        number_format_ = std::chars_format::fixed;
+    } else if (float_field == std::ios::scientific) {
+        number_format_ = std::chars_format::scientific;
+    }
+}
+
+CsvWriter::~CsvWriter() {
+    Flush();
+}
+
+void CsvWriter::WriteText(std::string_view text) {
+    BeginField();
+    if (!NeedsQuotes(text)) {
+        Append(text);
+        return;
+    }
+
+    buffer_.push_back(format_.quote);
+    for (char c : text) {
+        if (c == format_.quote) {
+            buffer_.push_back(c);
+        }
+        buffer_.push_back(c);
+    }
+    buffer_.push_back(format_.quote);
+}
+
+void CsvWriter::WriteNumber(double number) {
+    BeginField();
+    if (number_format_) {
+        // to_chars с точностью работает как printf, так же, как operator<<
+        char digits[128];
+        auto [ptr, error] = std::to_chars(digits, digits + sizeof(digits), number, *number_format_, precision_);
+        if (error == std::errc{}) {
+            Append(std::string_view(digits, static_cast<size_t>(ptr - digits)));
+            return;
+        }
+    }
+
+    // Редкие форматы и числа, не поместившиеся в буфер
+    if (!number_stream_) {
+        number_stream_ = std::make_unique<std::ostringstream>();
+        number_stream_->copyfmt(output_);
+        number_stream_->width(0);
+    }
+    number_stream_->str({});
+    *number_stream_ << number;
+    Append(number_stream_->str());
+}
+
+void CsvWriter::WriteValue(const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value)) {
+        WriteNumber(*number);
+    } else if (const auto* text = std::get_if<std::string>(&value)) {
+        WriteText(*text);
+    } else {
+        WriteText(std::get<FormulaError>(value).ToString());
+    }
+}
+
+void CsvWriter::WriteEmpty() {
+    BeginField();
+}
+
+void CsvWriter::EndRecord() {
+    buffer_.push_back('\n');
+    record_started_ = false;
+    if (buffer_.size() >= BUFFER_SIZE) {
+        Flush();
+    }
+}
+
+void CsvWriter::Flush() {
+    output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+}
+
+void CsvWriter::BeginField() {
+    if (record_started_) {
+        buffer_.push_back(format_.delimiter);
+    }
+    record_started_ = true;
+}
+
+void CsvWriter::Append(std::string_view text) {
+    buffer_.append(text.data(), text.size());
+}
+
+bool CsvWriter::NeedsQuotes(std::string_view text) const {
+    if (format_.quote == '\0') {
+        return false;
+    }
+    for (char c : text) {
+        if (c == format_.delimiter || c == format_.quote || c == '\n' || c == '\r') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ImportCsv(std::istream& input, Sheet& sheet, CsvFormat format, size_t threads) {
+    sheet.LoadCells([&input, format](const Sheet::CellConsumer& add) {
+        CsvReader reader(input, format);
+        reader.ForEachField(add);
+    }, threads);
+}
+
+void ImportCsvFile(const std::string& path, Sheet& sheet, CsvFormat format, size_t threads) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    ImportCsv(input, sheet, format, threads);
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <charconv>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Sheet;
+
+/// Формат файла с разделителями. В CSV поля, содержащие разделитель, кавычку
+/// или перевод строки, заключаются в кавычки, а кавычки внутри удваиваются.
+/// В TSV кавычки не используются, как и при печати листа
+struct CsvFormat {
+    char delimiter = ',';
+    char quote = '"';    /// '\0' — без кавычек
+
+    static CsvFormat Csv() { return {',', '"'}; }
+    static CsvFormat Tsv() { return {'\t', '\0'}; }
+};
+
+/// Потоковое чтение файла с разделителями. Вход читается блоками в общий буфер,
+/// поля передаются как string_view на этот буфер и действительны только до
+/// возврата из обработчика. Память выделяется лишь под буфер и под поля в
+/// кавычках, содержащие удвоенные кавычки
+class CsvReader {
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+    explicit CsvReader(std::istream& input, CsvFormat format = CsvFormat::Csv(),
+                       size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    /// Вызывает func(Position, std::string_view) для каждого непустого поля.
+    /// Номер строки поля — номер записи, номер столбца — номер поля в записи
+    template <typename Func>
+    void ForEachField(Func&& func);
+
+private:
+    std::istream& input_;
+    CsvFormat format_;
+    std::vector<char> buffer_;
+    /// Поле в кавычках без удвоенных кавычек
+    std::string unescaped_;
+    int row_ = 0;
+
+    /// Конец записи, начинающейся с begin, или nullptr, если запись не поместилась в буфер
+    const char* FindRecordEnd(const char* begin, const char* end, bool eof) const;
+    template <typename Func>
+    void ParseRecord(const char* begin, const char* end, Func& func);
+    std::string_view Unquote(std::string_view field);
+};
+
+/// Буферизованная запись файла с разделителями. Числа форматируются так же,
+/// как operator<< потока output: с его точностью и флагами на момент создания
+/// записи. Обычные форматы пишутся через std::to_chars, остальные (showpos,
+/// uppercase, нестандартная локаль и т.п.) — через поток с теми же настройками
+class CsvWriter {
+public:
+    explicit CsvWriter(std::ostream& output, CsvFormat format = CsvFormat::Csv());
+    CsvWriter(const CsvWriter&) = delete;
+    CsvWriter& operator=(const CsvWriter&) = delete;
+    ~CsvWriter();
+
+    void WriteText(std::string_view text);
+    void WriteNumber(double number);
+    void WriteValue(const CellInterface::Value& value);
+    /// Пропускает поле: пишет только разделитель
+    void WriteEmpty();
+    void EndRecord();
+    void Flush();
+
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    std::ostream& output_;
+    CsvFormat format_;
+    std::string buffer_;
+    bool record_started_ = false;
+    /// Формат чисел для std::to_chars; nullopt — числа пишутся через number_stream_
+    std::optional<std::chars_format> number_format_;
+    int precision_ = 6;
+    std::unique_ptr<std::ostringstream> number_stream_;
+
+    void BeginField();
+    void Append(std::string_view text);
+    [[nodiscard]] bool NeedsQuotes(std::string_view text) const;
+};
+
+/// Загружает файл с разделителями в лист одним пакетом (потоковый
+/// Sheet::LoadCells): поля разбираются порциями по мере чтения, при ошибке
+/// в любой ячейке лист не меняется
+void ImportCsv(std::istream& input, Sheet& sheet, CsvFormat format = CsvFormat::Csv(), size_t threads = 0);
+void ImportCsvFile(const std::string& path, Sheet& sheet, CsvFormat format = CsvFormat::Csv(), size_t threads = 0);
+
+template <typename Func>
+void CsvReader::ForEachField(Func&& func) {
+    size_t filled = 0;
+    bool eof = false;
+    while (!eof || filled > 0) {
+        if (!eof) {
+            input_.read(buffer_.data() + filled, static_cast<std::streamsize>(buffer_.size() - filled));
+            filled += static_cast<size_t>(input_.gcount());
+            eof = !input_;
+        }
+
+        const char* begin = buffer_.data();
+        const char* end = begin + filled;
+        while (begin != end) {
+            const char* record_end = FindRecordEnd(begin, end, eof);
+            if (!record_end) {
+                break;
+            }
+            ParseRecord(begin, record_end, func);
+            begin = record_end == end ? end : record_end + 1;
+        }
+
+        // Недочитанная запись переносится в начало буфера. Если она занимает
+        // весь буфер, буфер увеличивается
+        const size_t rest = static_cast<size_t>(end - begin);
+        if (rest > 0 && begin == buffer_.data()) {
+            buffer_.resize(buffer_.size() * 2);
+        } else if (rest > 0) {
+            std::copy(begin, end, buffer_.data());
+        }
+        filled = rest;
+    }
+}
+
+template <typename Func>
+void CsvReader::ParseRecord(const char* begin, const char* end, Func& func) {
+    if (end != begin && *(end - 1) == '\r') {
+        --end;
+    }
+
+    int col = 0;
+    const char* field_begin = begin;
+    bool in_quotes = false;
+    for (const char* it = begin;; ++it) {
+        if (it == end || (*it == format_.delimiter && !in_quotes)) {
+            std::string_view field(field_begin, static_cast<size_t>(it - field_begin));
+            if (!field.empty()) {
+                func(Position{row_, col}, format_.quote != '\0' ? Unquote(field) : field);
+            }
+            if (it == end) {
+                break;
+            }
+            ++col;
+            field_begin = it + 1;
+        } else if (format_.quote != '\0' && *it == format_.quote) {
+            in_quotes = !in_quotes;
+        }
+    }
+    ++row_;
+}
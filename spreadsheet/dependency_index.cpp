@@ -0,0 +1,143 @@
+#include "dependency_index.h"
+
+#include <algorithm>
+
+void DependencyIndex::Add(Position dependent, const std::vector<Position>& cells, const std::vector<Range>& ranges) {
+    for (Position cell : cells) {
+        cell_dependents_[cell].push_back(dependent);
+    }
+    for (const Range& range : ranges) {
+        AddRange(dependent, range);
+    }
+}
+
+void DependencyIndex::Remove(Position dependent, const std::vector<Position>& cells, const std::vector<Range>& ranges) {
+    for (Position cell : cells) {
+        auto it = cell_dependents_.find(cell);
+        if (it == cell_dependents_.end()) {
+            continue;
+        }
+
+        auto& dependents = it->second;
+        auto found = std::find(dependents.begin(), dependents.end(), dependent);
+        if (found != dependents.end()) {
+            *found = dependents.back();
+            dependents.pop_back();
+        }
+        if (dependents.empty()) {
+            cell_dependents_.erase(it);
+        }
+    }
+    for (const Range& range : ranges) {
+        RemoveRange(dependent, range);
+    }
+}
+
+std::vector<Position> DependencyIndex::GetDependents(Position referenced) const {
+    std::vector<Position> dependents;
+    ForEachDependent(referenced, [&dependents](Position dependent) {
+        dependents.push_back(dependent);
+    });
+    return dependents;
+}
+
+bool DependencyIndex::HasDependents(Position referenced) const {
+    bool found = false;
+    ForEachDependent(referenced, [&found](Position) {
+        found = true;
+    });
+    return found;
+}
+
+bool DependencyIndex::HasCellDependents(Position referenced) const {
+    return cell_dependents_.count(referenced) > 0;
+}
+
+void DependencyIndex::AddRange(Position dependent, const Range& range) {
+    if (nodes_.empty()) {
+        nodes_.resize(2 * LEAVES);
+        subtree_used_.resize(2 * LEAVES);
+        col_entries_.resize(Position::MAX_COLS);
+    }
+
+    std::uint32_t index;
+    if (!free_entries_.empty()) {
+        index = free_entries_.back();
+        free_entries_.pop_back();
+    } else {
+        index = static_cast<std::uint32_t>(entries_.size());
+        entries_.emplace_back();
+    }
+
+    RangeEntry& entry = entries_[index];
+    entry.range = range;
+    entry.dependent = dependent;
+    entry.alive = true;
+
+    auto& col_entries = col_entries_[static_cast<size_t>(range.to.col)];
+    entry.col_slot = static_cast<std::uint32_t>(col_entries.size());
+    col_entries.push_back(index);
+
+    const NodeItem item{index, entry.generation};
+    ForEachCanonicalNode(range, [this, item](size_t node) {
+        nodes_[node].push_back(item);
+        ++node_items_;
+        for (size_t up = node; up >= 1 && !subtree_used_[up]; up /= 2) {
+            subtree_used_[up] = true;
+        }
+    });
+}
+
+void DependencyIndex::RemoveRange(Position dependent, const Range& range) {
+    // Запись ищется в самой верхней канонической вершине диапазона: там
+    // обычно меньше всего записей. Ссылки из остальных вершин устаревают
+    size_t top_node = 0;
+    size_t node_count = 0;
+    ForEachCanonicalNode(range, [&top_node, &node_count](size_t node) {
+        if (top_node == 0 || node < top_node) {
+            top_node = node;
+        }
+        ++node_count;
+    });
+    if (nodes_.empty() || top_node == 0) {
+        return;
+    }
+
+    for (const NodeItem& item : nodes_[top_node]) {
+        RangeEntry& entry = entries_[item.entry];
+        if (entry.alive && entry.generation == item.generation &&
+            entry.dependent == dependent && entry.range == range) {
+            entry.alive = false;
+            ++entry.generation;
+            free_entries_.push_back(item.entry);
+
+            auto& col_entries = col_entries_[static_cast<size_t>(range.to.col)];
+            entries_[col_entries.back()].col_slot = entry.col_slot;
+            col_entries[entry.col_slot] = col_entries.back();
+            col_entries.pop_back();
+
+            stale_items_ += node_count;
+            if (stale_items_ >= MIN_STALE_ITEMS_TO_COMPACT && stale_items_ * 2 > node_items_) {
+                Compact();
+            }
+            return;
+        }
+    }
+}
+
+void DependencyIndex::Compact() {
+    for (auto& items : nodes_) {
+        items.erase(std::remove_if(items.begin(), items.end(), [this](NodeItem item) {
+            return !IsCurrent(item);
+        }), items.end());
+        if (items.capacity() > 2 * items.size()) {
+            items.shrink_to_fit();
+        }
+    }
+    for (size_t node = nodes_.size() - 1; node >= 1; --node) {
+        subtree_used_[node] = !nodes_[node].empty() ||
+                              (node < LEAVES && (subtree_used_[2 * node] || subtree_used_[2 * node + 1]));
+    }
+    node_items_ -= stale_items_;
+    stale_items_ = 0;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/// Индекс зависимостей листа: для каждой формулы хранит ссылки на ячейки и
+/// диапазоны, от которых она зависит, и отвечает на вопрос «какие формулы
+/// зависят от ячейки X».
+///
+/// Ссылки на отдельные ячейки хранятся в хеш-таблице по позиции. Диапазоны
+/// хранятся по одной записи на диапазон в дереве отрезков по строкам: запись
+/// попадает в O(log MAX_ROWS) канонических вершин, покрывающих её строки, а
+/// поиск проходит от листа строки к корню и проверяет столбцы записей на пути.
+/// Поэтому ссылка на диапазон любого размера стоит одну запись. Для вставки и
+/// удаления столбцов записи дополнительно разложены по последнему столбцу.
+///
+/// Запросы только читают индекс. Удалённая запись остаётся в вершинах дерева,
+/// пока устаревших ссылок не станет больше, чем действующих, — тогда все
+/// вершины вычищаются разом
+class DependencyIndex {
+public:
+    void Add(Position dependent, const std::vector<Position>& cells, const std::vector<Range>& ranges);
+    void Remove(Position dependent, const std::vector<Position>& cells, const std::vector<Range>& ranges);
+
+    /// Вызывает func(Position) для каждой формулы, зависящей от ячейки referenced.
+    /// Формула, ссылающаяся на ячейку несколько раз, может быть передана несколько раз
+    template <typename Func>
+    void ForEachDependent(Position referenced, Func&& func) const;
+
+    /// Вызывает func(Position) для каждой формулы, ссылающейся на ячейку
+    /// referenced как на отдельную ячейку, а не через диапазон
+    template <typename Func>
+    void ForEachCellDependent(Position referenced, Func&& func) const;
+    /// Вызывает func(Position dependent, const Range&) для каждой ссылки на
+    /// диапазон, который задевает сдвиг. Остальные диапазоны не перебираются
+    template <typename Func>
+    void ForEachRangeReference(const SheetShift& shift, Func&& func) const;
+
+    [[nodiscard]] std::vector<Position> GetDependents(Position referenced) const;
+    [[nodiscard]] bool HasDependents(Position referenced) const;
+    /// Есть ли ссылки на ячейку как на отдельную ячейку, а не через диапазон
+    [[nodiscard]] bool HasCellDependents(Position referenced) const;
+
+    [[nodiscard]] size_t GetRangeEntryCount() const { return entries_.size() - free_entries_.size(); }
+    /// Ссылки вершин дерева на записи, в том числе устаревшие
+    [[nodiscard]] size_t GetNodeItemCount() const { return node_items_; }
+
+private:
+    struct RangeEntry {
+        Range range;
+        Position dependent;
+        std::uint32_t generation = 0;
+        /// Место записи в списке её последнего столбца
+        std::uint32_t col_slot = 0;
+        bool alive = false;
+    };
+
+    /// Ссылка вершины дерева на запись. Запись могла быть удалена и занята
+    /// заново, такие ссылки распознаются по поколению и пропускаются при поиске
+    struct NodeItem {
+        std::uint32_t entry;
+        std::uint32_t generation;
+    };
+
+    static constexpr size_t LEAVES = Position::MAX_ROWS;
+    /// Меньше устаревших ссылок вычищать не стоит: проход затрагивает все вершины
+    static constexpr size_t MIN_STALE_ITEMS_TO_COMPACT = 4096;
+
+    std::unordered_map<Position, std::vector<Position>, PositionHasher> cell_dependents_;
+
+    std::vector<RangeEntry> entries_;
+    std::vector<std::uint32_t> free_entries_;
+    /// Вершины дерева отрезков, корень — 1, лист строки r — LEAVES + r.
+    /// Выделяются при первой ссылке на диапазон
+    std::vector<std::vector<NodeItem>> nodes_;
+    /// Есть ли ссылки в поддереве вершины: обход по сдвигу пропускает пустые поддеревья
+    std::vector<bool> subtree_used_;
+    /// Действующие записи по последнему столбцу диапазона
+    std::vector<std::vector<std::uint32_t>> col_entries_;
+    /// Ссылок во всех вершинах и из них устаревших
+    size_t node_items_ = 0;
+    size_t stale_items_ = 0;
+
+    void AddRange(Position dependent, const Range& range);
+    void RemoveRange(Position dependent, const Range& range);
+    /// Убирает из вершин ссылки на удалённые записи
+    void Compact();
+    [[nodiscard]] bool IsCurrent(NodeItem item) const {
+        const RangeEntry& entry = entries_[item.entry];
+        return entry.alive && entry.generation == item.generation;
+    }
+
+    template <typename Func>
+    void ForEachCanonicalNode(const Range& range, Func&& func) const;
+    /// Обходит вершины поддерева node, покрывающего строки [low, high], которые
+    /// задевают строки от first и ниже, и передаёт func записи, заканчивающиеся
+    /// не выше first. Запись передаётся из единственной вершины: той, где лежит
+    /// строка max(from.row, first)
+    template <typename Func>
+    void ForEachRangeFromRow(size_t node, int low, int high, int first, Func&& func) const;
+};
+
+template <typename Func>
+void DependencyIndex::ForEachDependent(Position referenced, Func&& func) const {
+    ForEachCellDependent(referenced, func);
+
+    if (nodes_.empty()) {
+        return;
+    }
+
+    for (size_t node = LEAVES + static_cast<size_t>(referenced.row); node >= 1; node /= 2) {
+        for (NodeItem item : nodes_[node]) {
+            if (!IsCurrent(item)) {
+                continue;
+            }
+            const RangeEntry& entry = entries_[item.entry];
+            if (referenced.col >= entry.range.from.col && referenced.col <= entry.range.to.col) {
+                func(entry.dependent);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void DependencyIndex::ForEachCellDependent(Position referenced, Func&& func) const {
+    if (auto it = cell_dependents_.find(referenced); it != cell_dependents_.end()) {
+        for (Position dependent : it->second) {
+            func(dependent);
+        }
+    }
+}
+
+template <typename Func>
+void DependencyIndex::ForEachRangeReference(const SheetShift& shift, Func&& func) const {
+    if (nodes_.empty()) {
+        return;
+    }
+
+    if (shift.axis == SheetShift::Axis::Rows) {
+        ForEachRangeFromRow(1, 0, static_cast<int>(LEAVES) - 1, shift.first, func);
+        return;
+    }
+    for (size_t col = static_cast<size_t>(shift.first); col < col_entries_.size(); ++col) {
+        for (std::uint32_t index : col_entries_[col]) {
+            const RangeEntry& entry = entries_[index];
+            func(entry.dependent, entry.range);
+        }
+    }
+}
+
+template <typename Func>
+void DependencyIndex::ForEachRangeFromRow(size_t node, int low, int high, int first, Func&& func) const {
+    if (high < first || !subtree_used_[node]) {
+        return;
+    }
+
+    for (NodeItem item : nodes_[node]) {
+        if (!IsCurrent(item)) {
+            continue;
+        }
+        const RangeEntry& entry = entries_[item.entry];
+        if (const int row = std::max(entry.range.from.row, first); row >= low && row <= high) {
+            func(entry.dependent, entry.range);
+        }
+    }
+    if (node < LEAVES) {
+        const int middle = low + (high - low) / 2;
+        ForEachRangeFromRow(2 * node, low, middle, first, func);
+        ForEachRangeFromRow(2 * node + 1, middle + 1, high, first, func);
+    }
+}
+
+template <typename Func>
+void DependencyIndex::ForEachCanonicalNode(const Range& range, Func&& func) const {
+    size_t left = LEAVES + static_cast<size_t>(range.from.row);
+    size_t right = LEAVES + static_cast<size_t>(range.to.row) + 1;
+    while (left < right) {
+        if (left & 1) {
+            func(left++);
+        }
+        if (right & 1) {
+            func(--right);
+        }
+        left /= 2;
+        right /= 2;
+    }
+}
@@ -1,96 +1,287 @@
-#include "formula.h"
-
-#include "FormulaAST.h"
-
-#include <algorithm>
-#include <cassert>
-#include <cctype>
-#include <sstream>
-
-using namespace std::literals;
-
-std::ostream& operator<<(std::ostream& output, const FormulaError& fe) {
-    output << fe.ToString();
-    return output;
-}
-
-namespace {
-    class Formula : public FormulaInterface {
-    public:
-
-        explicit Formula(const std::string &expression) try :
-            ast_ (ParseFormulaAST(expression)) {}
-            catch (...) {
-                throw FormulaException("Error when parsing: " + expression);
-            }
-
-        [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override {
-            /// Лямбда-функция для обработки текстовых ячеек
-            auto ProcessTextCell = [](const std::string& text) {
-                if (text.empty()) return 0.0;
-                try {
-                    return std::stod(text);
-                }
-                catch (...) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            };
-
-            /// Лямбда-функция для вычисления значения ячейки
-            auto eval = [&sheet, &ProcessTextCell](const Position pos)->double {
-                if (!pos.IsValid())
-                    throw FormulaError(FormulaError::Category::Ref);
-
-                const auto* cell = sheet.GetCell(pos);
-                if (cell) {
-                    if (std::holds_alternative<double>(cell->GetValue())) {
-                        return std::get<double>(cell->GetValue());
-                    }
-                    else if (std::holds_alternative<std::string>(cell->GetValue())) {
-                        auto str_value = std::get<std::string>(cell->GetValue());
-                        return ProcessTextCell(str_value);
-                    }
-                    else {
-                        throw FormulaError(std::get<FormulaError>(cell->GetValue()));
-                    }
-                } else {
-                    return 0.0;
-                }
-            };
-
-            try {
-                return ast_.Execute(eval);
-            }
-            catch (const FormulaError& fe) {
-                return fe;
-            }
-        }
-
-
-        [[nodiscard]] std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-
-            return out.str();
-        }
-
-        [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
-            std::vector<Position> cells;
-            for (const auto& cell : ast_.GetCells()) {
-                if (!cell.IsValid())
-                    continue;
-
-                cells.push_back(cell);
-            }
-            return cells;
-        }
-
-    private:
-        FormulaAST ast_;
-    };
-
-}//end namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+#include "formula.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+using namespace std::literals;
+
+std::ostream& operator<<(std::ostream& output, const FormulaError& fe) {
+    output << fe.ToString();
+    return output;
+}
+
+namespace {
+    /// Скомпилированная формула, общая для формул, скопированных со сдвигом.
+    /// Ссылки программы записаны для ячейки anchor
+    struct SharedProgram {
+        FormulaAST ast;
+        Position anchor;
+    };
+
+    class Formula : public FormulaInterface {
+    public:
+
+        explicit Formula(const std::string &expression) try :
+            program_(std::make_shared<const SharedProgram>(SharedProgram{ParseFormulaAST(expression), {0, 0}})) {}
+            catch (...) {
+                throw FormulaException("Error when parsing: " + expression);
+            }
+
+        explicit Formula(FormulaAST ast)
+                : program_(std::make_shared<const SharedProgram>(SharedProgram{std::move(ast), {0, 0}})) {}
+
+        /// Формула ячейки anchor, использующая общую программу
+        Formula(std::shared_ptr<const SharedProgram> program, Position anchor)
+                : program_(std::move(program))
+                , offset_{anchor.row - program_->anchor.row, anchor.col - program_->anchor.col} {}
+
+        [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override {
+            /// Значения ячеек читаются через GetNumericValue(): текст ячеек
+            /// не копируется, а значение не запрашивается повторно
+            auto eval = [&sheet, offset = offset_](const Position stored) -> CellInterface::NumericValue {
+                const Position pos = ASTImpl::Translate(stored, offset);
+                if (!pos.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+
+                const auto* cell = sheet.GetCell(pos);
+                if (!cell) {
+                    return std::monostate{};
+                }
+                return cell->GetNumericValue();
+            };
+
+            /// Лямбда-функция для вычисления значений непустых ячеек диапазона.
+            /// Текст, не являющийся числом, в диапазоне пропускается
+            auto eval_range = [&sheet, offset = offset_](const Range& stored,
+                                                         std::vector<double>& values) -> std::optional<FormulaError> {
+                const Range range = ASTImpl::Translate(stored, offset);
+                if (!range.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                for (int row = range.from.row; row <= range.to.row; ++row) {
+                    for (int col = range.from.col; col <= range.to.col; ++col) {
+                        const auto* cell = sheet.GetCell({row, col});
+                        if (!cell) {
+                            continue;
+                        }
+
+                        const auto value = cell->GetRangeValue();
+                        if (const double* number = std::get_if<double>(&value)) {
+                            values.push_back(*number);
+                        } else if (const auto* error = std::get_if<FormulaError>(&value)) {
+                            return *error;
+                        }
+                    }
+                }
+                return std::nullopt;
+            };
+
+            return program_->ast.Execute(eval, eval_range);
+        }
+
+
+        [[nodiscard]] std::string GetExpression() const override {
+            std::ostringstream out;
+            program_->ast.PrintFormula(out, offset_);
+
+            return out.str();
+        }
+
+        /// Сдвиг сохраняет порядок позиций, поэтому сортировка не нарушается
+        [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
+            std::vector<Position> cells;
+            for (const auto& cell : program_->ast.GetCells()) {
+                if (!cell.IsValid())
+                    continue;
+
+                cells.push_back(ASTImpl::Translate(cell, offset_));
+            }
+            return cells;
+        }
+
+        [[nodiscard]] std::vector<Range> GetReferencedRanges() const override {
+            std::vector<Range> ranges;
+            ranges.reserve(program_->ast.GetRanges().size());
+            for (const auto& range : program_->ast.GetRanges()) {
+                if (!range.IsValid())
+                    continue;
+
+                ranges.push_back(ASTImpl::Translate(range, offset_));
+            }
+            std::sort(ranges.begin(), ranges.end());
+            ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+            return ranges;
+        }
+
+        void Serialize(std::string& out) const override {
+            program_->ast.Serialize(out, offset_);
+        }
+
+        [[nodiscard]] std::unique_ptr<FormulaInterface> Shift(const SheetShift& shift) const override {
+            const auto& ast = program_->ast;
+            if (!ast.IsAffectedBy(shift, offset_)) {
+                return nullptr;
+            }
+
+            // Если все ссылки сдвигаются на одно и то же расстояние, программа
+            // остаётся общей, а у формулы меняется только сдвиг
+            const Position delta = shift.axis == SheetShift::Axis::Rows ? Position{shift.count, 0}
+                                                                         : Position{0, shift.count};
+            const Position offset{offset_.row + delta.row, offset_.col + delta.col};
+            const auto cells = ast.GetCells();
+            const auto ranges = ast.GetRanges();
+            const bool uniform = std::all_of(cells.begin(), cells.end(), [&](Position cell) {
+                                     return shift.Apply(ASTImpl::Translate(cell, offset_))
+                                            == ASTImpl::Translate(cell, offset);
+                                 })
+                              && std::all_of(ranges.begin(), ranges.end(), [&](const Range& range) {
+                                     return shift.Apply(ASTImpl::Translate(range, offset_))
+                                            == ASTImpl::Translate(range, offset);
+                                 });
+            if (uniform) {
+                return WithOffset(offset);
+            }
+            return std::make_unique<Formula>(ast.Shift(shift, offset_));
+        }
+
+        [[nodiscard]] std::unique_ptr<FormulaInterface> Translate(Position delta) const override {
+            const auto& ast = program_->ast;
+            const Position offset{offset_.row + delta.row, offset_.col + delta.col};
+            const auto cells = ast.GetCells();
+            const auto ranges = ast.GetRanges();
+            const bool inside = std::all_of(cells.begin(), cells.end(), [offset](Position cell) {
+                                    return !cell.IsValid() || ASTImpl::Translate(cell, offset).IsValid();
+                                })
+                             && std::all_of(ranges.begin(), ranges.end(), [offset](const Range& range) {
+                                    return !range.IsValid() || ASTImpl::Translate(range, offset).IsValid();
+                                });
+            if (inside) {
+                return WithOffset(offset);
+            }
+            return std::make_unique<Formula>(ast.Translate(offset));
+        }
+
+    private:
+        std::shared_ptr<const SharedProgram> program_;
+        /// Сдвиг ячейки формулы относительно ячейки, для которой записана программа
+        Position offset_{0, 0};
+
+        /// Формула с той же общей программой и другим сдвигом
+        [[nodiscard]] std::unique_ptr<FormulaInterface> WithOffset(Position offset) const {
+            const Position anchor{program_->anchor.row + offset.row, program_->anchor.col + offset.col};
+            return std::make_unique<Formula>(program_, anchor);
+        }
+    };
+
+}//end namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> DeserializeFormula(std::string_view& data) {
+    return std::make_unique<Formula>(FormulaAST::Deserialize(data));
+}
+
+class FormulaCache::Impl {
+public:
+    std::shared_ptr<const SharedProgram> Find(const std::string& key) {
+        std::lock_guard lock(mutex_);
+        ++stats_.lookups;
+        const auto it = programs_.find(key);
+        if (it == programs_.end()) {
+            return nullptr;
+        }
+        auto program = it->second.lock();
+        if (program) {
+            ++stats_.hits;
+        }
+        return program;
+    }
+
+    /// Возвращает программу, уже добавленную под этим ключом другим потоком, или program
+    std::shared_ptr<const SharedProgram> Insert(std::string key, std::shared_ptr<const SharedProgram> program) {
+        std::lock_guard lock(mutex_);
+        auto [it, inserted] = programs_.try_emplace(std::move(key), program);
+        if (!inserted) {
+            if (auto existing = it->second.lock()) {
+                return existing;
+            }
+            it->second = program;
+        }
+        if (programs_.size() >= purge_threshold_) {
+            PurgeExpired();
+        }
+        return program;
+    }
+
+    Stats GetStats() const {
+        std::lock_guard lock(mutex_);
+        Stats stats = stats_;
+        stats.programs = static_cast<size_t>(std::count_if(programs_.begin(), programs_.end(), [](const auto& entry) {
+            return !entry.second.expired();
+        }));
+        return stats;
+    }
+
+private:
+    static constexpr size_t MIN_PURGE_THRESHOLD = 1024;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const SharedProgram>> programs_;
+    /// Размер, при котором из таблицы удаляются программы, которыми никто не
+    /// пользуется. Растёт вдвое вслед за числом живых программ, чтобы очистка
+    /// в среднем стоила O(1) на вставку
+    size_t purge_threshold_ = MIN_PURGE_THRESHOLD;
+    Stats stats_;
+
+    void PurgeExpired() {
+        for (auto it = programs_.begin(); it != programs_.end();) {
+            if (it->second.expired()) {
+                it = programs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        purge_threshold_ = std::max(MIN_PURGE_THRESHOLD, programs_.size() * 2);
+    }
+};
+
+FormulaCache::FormulaCache() : impl_(std::make_unique<Impl>()) {}
+
+FormulaCache::~FormulaCache() = default;
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    return impl_->GetStats();
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor, FormulaCache& cache) {
+    std::string key;
+    try {
+        key = NormalizeFormulaText(expression, anchor);
+    } catch (const ParsingError&) {
+        // Ошибку в формате ParseFormula даёт обычный разбор
+        return ParseFormula(std::move(expression));
+    }
+
+    if (auto program = cache.impl_->Find(key)) {
+        return std::make_unique<Formula>(std::move(program), anchor);
+    }
+
+    // Разбор идёт без блокировки: формулы пакета разбираются параллельно
+    std::shared_ptr<const SharedProgram> program;
+    try {
+        program = std::make_shared<const SharedProgram>(SharedProgram{ParseFormulaAST(expression), anchor});
+    } catch (...) {
+        throw FormulaException("Error when parsing: " + expression);
+    }
+    program = cache.impl_->Insert(std::move(key), std::move(program));
+    return std::make_unique<Formula>(std::move(program), anchor);
+}
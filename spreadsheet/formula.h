@@ -1,41 +1,100 @@
-#pragma once
-
-#include "common.h"
-
-#include <memory>
-#include <vector>
-
-// Формула, позволяющая вычислять и обновлять арифметическое выражение.
-// Поддерживаемые возможности:
-// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
-// * Значения ячеек в качестве переменных: A1+B2*C3
-// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
-// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
-// ячейка или ячейка с пустым текстом трактуется как число ноль.
-class FormulaInterface {
-public:
-    using Value = std::variant<double, FormulaError>;
-
-    virtual ~FormulaInterface() = default;
-
-    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся
-    // в качестве аргумента.
-    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
-    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
-    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
-    // любая.
-    [[nodiscard]] virtual Value Evaluate(const SheetInterface& sheet) const = 0;
-
-    // Возвращает выражение, которое описывает формулу.
-    // Не содержит пробелов и лишних скобок.
-    [[nodiscard]] virtual std::string GetExpression() const = 0;
-
-    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
-    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-// Парсит переданное выражение и возвращает объект формулы.
-// Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Формула, позволяющая вычислять и обновлять арифметическое выражение.
+// Поддерживаемые возможности:
+// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над диапазонами и выражениями: SUM(A1:B10,C3*2),
+//   AVERAGE, MIN, MAX, COUNT. Пустые ячейки и текст диапазона пропускаются,
+//   текст, представляющий число, учитывается как число
+// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
+// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
+// ячейка или ячейка с пустым текстом трактуется как число ноль.
+class FormulaInterface {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    virtual ~FormulaInterface() = default;
+
+    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся
+    // в качестве аргумента.
+    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
+    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
+    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
+    // любая.
+    [[nodiscard]] virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+
+    // Возвращает выражение, которое описывает формулу.
+    // Не содержит пробелов и лишних скобок.
+    [[nodiscard]] virtual std::string GetExpression() const = 0;
+
+    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
+    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
+    // ячеек.
+    [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны, которые задействованы в вычислении формулы. Ячейки
+    // диапазонов не входят в GetReferencedCells().
+    [[nodiscard]] virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Дописывает в out скомпилированную формулу в двоичном виде. Прочитать её
+    // обратно без повторного разбора можно функцией DeserializeFormula().
+    virtual void Serialize(std::string& out) const = 0;
+
+    // Возвращает формулу со ссылками, изменёнными вставкой или удалением строк
+    // либо столбцов: ссылки на удалённые ячейки становятся #REF!. Если изменение
+    // не затрагивает ссылки формулы, возвращает nullptr.
+    [[nodiscard]] virtual std::unique_ptr<FormulaInterface> Shift(const SheetShift& shift) const = 0;
+
+    // Возвращает копию формулы для ячейки, сдвинутой на offset: все ссылки
+    // сдвигаются вместе с ней, ссылки за пределами листа становятся #REF!.
+    // Копия использует ту же скомпилированную программу, если это возможно.
+    [[nodiscard]] virtual std::unique_ptr<FormulaInterface> Translate(Position offset) const = 0;
+};
+
+// Парсит переданное выражение и возвращает объект формулы.
+// Бросает FormulaException в случае, если формула синтаксически некорректна.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Общие скомпилированные формулы. Формулы, скопированные со сдвигом
+// (=A1*B1 в C1, =A2*B2 в C2, ...), после приведения ссылок к относительному виду
+// совпадают: кэш разбирает такой текст один раз, а ячейки хранят указатель на
+// общую программу и свой сдвиг. Программа живёт, пока на неё ссылается хотя бы
+// одна формула. Потокобезопасен: формулы пакета разбираются параллельно.
+class FormulaCache {
+public:
+    struct Stats {
+        size_t lookups = 0;     // обращений к кэшу
+        size_t hits = 0;        // из них найдено готовых программ
+        size_t programs = 0;    // программ, используемых формулами сейчас
+    };
+
+    FormulaCache();
+    FormulaCache(const FormulaCache&) = delete;
+    FormulaCache& operator=(const FormulaCache&) = delete;
+    ~FormulaCache();
+
+    [[nodiscard]] Stats GetStats() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+
+    friend std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                                          FormulaCache& cache);
+};
+
+// Парсит выражение формулы ячейки anchor, используя общую программу из cache.
+// Ссылки формулы и её текст те же, что у ParseFormula(expression).
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor, FormulaCache& cache);
+
+// Читает формулу, записанную FormulaInterface::Serialize(), из начала data и
+// сдвигает data за неё. Бросает BinaryFormatException, если данные повреждены.
+std::unique_ptr<FormulaInterface> DeserializeFormula(std::string_view& data);
@@ -1,395 +1,1976 @@
-#include <limits>
-#include "common.h"
-#include "formula.h"
-#include "test_runner_p.h"
-
-inline std::ostream& operator<<(std::ostream& output, Position pos) {
-    return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
-}
-
-inline std::ostream& operator<<(std::ostream& output, Size size) {
-    return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-            [&](const auto& x) {
-                output << x;
-            },
-            value);
-    return output;
-}
-
-namespace {
-
-    void TestPositionAndStringConversion() {
-        auto testSingle = [](Position pos, std::string_view str) {
-            ASSERT_EQUAL(pos.ToString(), str);
-            ASSERT_EQUAL(Position::FromString(str), pos);
-        };
-
-        for (int i = 0; i < 25; ++i) {
-            testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
-        }
-
-        testSingle(Position{0, 0}, "A1");
-        testSingle(Position{0, 1}, "B1");
-        testSingle(Position{0, 25}, "Z1");
-        testSingle(Position{0, 26}, "AA1");
-        testSingle(Position{0, 27}, "AB1");
-        testSingle(Position{0, 51}, "AZ1");
-        testSingle(Position{0, 52}, "BA1");
-        testSingle(Position{0, 53}, "BB1");
-        testSingle(Position{0, 77}, "BZ1");
-        testSingle(Position{0, 78}, "CA1");
-        testSingle(Position{0, 701}, "ZZ1");
-        testSingle(Position{0, 702}, "AAA1");
-        testSingle(Position{136, 2}, "C137");
-        testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
-    }
-
-    void TestPositionToStringInvalid() {
-        ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
-        ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
-        ASSERT_EQUAL((Position{1, -3}).ToString(), "");
-    }
-
-    void TestStringToPositionInvalid() {
-        ASSERT(!Position::FromString("").IsValid());
-        ASSERT(!Position::FromString("A").IsValid());
-        ASSERT(!Position::FromString("1").IsValid());
-        ASSERT(!Position::FromString("e2").IsValid());
-        ASSERT(!Position::FromString("A0").IsValid());
-        ASSERT(!Position::FromString("A-1").IsValid());
-        ASSERT(!Position::FromString("A+1").IsValid());
-        ASSERT(!Position::FromString("R2D2").IsValid());
-        ASSERT(!Position::FromString("C3PO").IsValid());
-        ASSERT(!Position::FromString("XFD16385").IsValid());
-        ASSERT(!Position::FromString("XFE16384").IsValid());
-        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-    }
-
-    void TestEmpty() {
-        auto sheet = CreateSheet();
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-    }
-
-    void TestInvalidPosition() {
-        auto sheet = CreateSheet();
-        try {
-            sheet->SetCell(Position{-1, 0}, "");
-        } catch (const InvalidPositionException&) {
-        }
-        try {
-            sheet->GetCell(Position{0, -2});
-        } catch (const InvalidPositionException&) {
-        }
-        try {
-            sheet->ClearCell(Position{Position::MAX_ROWS, 0});
-        } catch (const InvalidPositionException&) {
-        }
-    }
-
-    void TestSetCellPlainText() {
-        auto sheet = CreateSheet();
-
-        auto checkCell = [&](Position pos, std::string text) {
-            sheet->SetCell(pos, text);
-            CellInterface* cell = sheet->GetCell(pos);
-            ASSERT(cell != nullptr);
-            ASSERT_EQUAL(cell->GetText(), text);
-            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-        };
-
-        checkCell("A1"_pos, "Hello");
-        checkCell("A1"_pos, "World");
-        checkCell("B2"_pos, "Purr");
-        checkCell("A3"_pos, "Meow");
-
-        const SheetInterface& constSheet = *sheet;
-        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-        sheet->SetCell("A3"_pos, "'=escaped");
-        CellInterface* cell = sheet->GetCell("A3"_pos);
-        ASSERT_EQUAL(cell->GetText(), "'=escaped");
-        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-    }
-
-    void TestClearCell() {
-        auto sheet = CreateSheet();
-
-        sheet->SetCell("C2"_pos, "Me gusta");
-        sheet->ClearCell("C2"_pos);
-        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-        sheet->ClearCell("A1"_pos);
-        sheet->ClearCell("J10"_pos);
-    }
-
-    void TestFormulaArithmetic() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-        };
-
-        ASSERT_EQUAL(evaluate("1"), 1);
-        ASSERT_EQUAL(evaluate("42"), 42);
-        ASSERT_EQUAL(evaluate("2 + 2"), 4);
-        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-    }
-
-    void TestFormulaReferences() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-        };
-
-        sheet->SetCell("A1"_pos, "1");
-        ASSERT_EQUAL(evaluate("A1"), 1);
-        sheet->SetCell("A2"_pos, "2");
-        ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-        // Тест на нули:
-        sheet->SetCell("B3"_pos, "");
-        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-    }
-
-    void TestFormulaExpressionFormatting() {
-        auto reformat = [](std::string expr) {
-            return ParseFormula(std::move(expr))->GetExpression();
-        };
-
-        ASSERT_EQUAL(reformat("  1  "), "1");
-        ASSERT_EQUAL(reformat("  -1  "), "-1");
-        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-    }
-
-    void TestFormulaReferencedCells() {
-        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-
-        auto a1 = ParseFormula("A1");
-        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
-
-        auto b2c3 = ParseFormula("B2+C3");
-        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
-
-        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
-    }
-
-    void TestErrorValue() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "A1");
-        sheet->SetCell("E4"_pos, "=E2");
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Value));
-
-        sheet->SetCell("E2"_pos, "3D");
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Value));
-    }
-
-    void TestErrorDiv0() {
-        auto sheet = CreateSheet();
-
-        constexpr double max = std::numeric_limits<double>::max();
-
-        sheet->SetCell("A1"_pos, "=1/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        sheet->SetCell("A1"_pos, "=0/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                     CellInterface::Value(FormulaError::Category::Div0));
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '+' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << -max << '-' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '*' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                         CellInterface::Value(FormulaError::Category::Div0));
-        }
-    }
-
-    void TestEmptyCellTreatedAsZero() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
-    }
-
-    void TestFormulaInvalidPosition() {
-        auto sheet = CreateSheet();
-        auto try_formula = [&](const std::string& formula) {
-            try {
-                sheet->SetCell("A1"_pos, formula);
-                ASSERT(false);
-            } catch (const FormulaException&) {
-                // we expect this one
-            }
-        };
-
-        try_formula("=X0");
-        try_formula("=ABCD1");
-        try_formula("=A123456");
-        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
-        try_formula("=XFE16384");
-        try_formula("=R2D2");
-    }
-
-    void TestPrint() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A2"_pos, "meow");
-        sheet->SetCell("B2"_pos, "=35");
-
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-        std::ostringstream texts;
-        sheet->PrintTexts(texts);
-        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-        std::ostringstream values;
-        sheet->PrintValues(values);
-        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-    }
-
-    void TestCellReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "1");
-        sheet->SetCell("A2"_pos, "=A1");
-        sheet->SetCell("B2"_pos, "=A1");
-
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-
-        // Ссылка на пустую ячейку
-        sheet->SetCell("B2"_pos, "=B1");
-        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
-
-        sheet->SetCell("A2"_pos, "");
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-        // Ссылка на ячейку за пределами таблицы
-        sheet->SetCell("B1"_pos, "=C3");
-        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
-    }
-
-    void TestFormulaIncorrect() {
-        auto isIncorrect = [](std::string expression) {
-            try {
-                ParseFormula(std::move(expression));
-            } catch (const FormulaException&) {
-                return true;
-            }
-            return false;
-        };
-
-        ASSERT(isIncorrect("A2B"));
-        ASSERT(isIncorrect("3X"));
-        ASSERT(isIncorrect("A0++"));
-        ASSERT(isIncorrect("((1)"));
-        ASSERT(isIncorrect("2+4-"));
-    }
-
-    void TestCellCircularReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "=E4");
-        sheet->SetCell("E4"_pos, "=X9");
-        sheet->SetCell("X9"_pos, "=M6");
-        sheet->SetCell("M6"_pos, "Ready");
-
-        bool caught = false;
-        try {
-            sheet->SetCell("M6"_pos, "=E2");
-        } catch (const CircularDependencyException&) {
-            caught = true;
-        }
-
-        ASSERT(caught);
-        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-    }
-
-    void TEST10() {
-        auto sheet = CreateSheet();
-
-        sheet->SetCell("C1"_pos, "=123");
-        try {
-            sheet->SetCell("A1"_pos, "=A1");
-            std::exit(1);
-        }
-        catch (CircularDependencyException&){
-            std::cout << "all good" <<std::endl;
-        }
-
-        try {
-            sheet->SetCell("A1"_pos, "=C1+A1");
-            std::exit(1);
-        }
-        catch (CircularDependencyException&){
-            std::cout << "all good" <<std::endl;
-        }
-    }
-}  // namespace
-
-
-int main() {
-    TestRunner tr;
-    RUN_TEST(tr, TestPositionAndStringConversion);
-    RUN_TEST(tr, TestPositionToStringInvalid);
-    RUN_TEST(tr, TestStringToPositionInvalid);
-    RUN_TEST(tr, TestEmpty);
-    RUN_TEST(tr, TestInvalidPosition);
-    RUN_TEST(tr, TestSetCellPlainText);
-    RUN_TEST(tr, TestClearCell);
-    RUN_TEST(tr, TestFormulaArithmetic);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestFormulaExpressionFormatting);
-    RUN_TEST(tr, TestFormulaReferencedCells);
-    RUN_TEST(tr, TestErrorValue);
-    RUN_TEST(tr, TestErrorDiv0);
-    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-    RUN_TEST(tr, TestFormulaInvalidPosition);
-    RUN_TEST(tr, TestPrint);
-    RUN_TEST(tr, TestCellReferences);
-    RUN_TEST(tr, TestFormulaIncorrect);
-    RUN_TEST(tr, TestCellCircularReferences);
-    RUN_TEST(tr, TEST10);
-    return 0;
-}
+#include <atomic>
+#include <limits>
+#include "binary_io.h"
+#include "common.h"
+#include "csv.h"
+#include "formula.h"
+#include "FormulaAST.h"
+#include "sheet.h"
+#include "test_runner_p.h"
+
+#include <thread>
+
+inline std::ostream& operator<<(std::ostream& output, Position pos) {
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+inline Position operator"" _pos(const char* str, std::size_t) {
+    return Position::FromString(str);
+}
+
+inline std::ostream& operator<<(std::ostream& output, Size size) {
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    std::visit(
+            [&](const auto& x) {
+                output << x;
+            },
+            value);
+    return output;
+}
+
+namespace {
+
+    void TestPositionAndStringConversion() {
+        auto testSingle = [](Position pos, std::string_view str) {
+            ASSERT_EQUAL(pos.ToString(), str);
+            ASSERT_EQUAL(Position::FromString(str), pos);
+        };
+
+        for (int i = 0; i < 25; ++i) {
+            testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
+        }
+
+        testSingle(Position{0, 0}, "A1");
+        testSingle(Position{0, 1}, "B1");
+        testSingle(Position{0, 25}, "Z1");
+        testSingle(Position{0, 26}, "AA1");
+        testSingle(Position{0, 27}, "AB1");
+        testSingle(Position{0, 51}, "AZ1");
+        testSingle(Position{0, 52}, "BA1");
+        testSingle(Position{0, 53}, "BB1");
+        testSingle(Position{0, 77}, "BZ1");
+        testSingle(Position{0, 78}, "CA1");
+        testSingle(Position{0, 701}, "ZZ1");
+        testSingle(Position{0, 702}, "AAA1");
+        testSingle(Position{136, 2}, "C137");
+        testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    }
+
+    void TestPositionToStringInvalid() {
+        ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
+        ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
+        ASSERT_EQUAL((Position{1, -3}).ToString(), "");
+    }
+
+    void TestStringToPositionInvalid() {
+        ASSERT(!Position::FromString("").IsValid());
+        ASSERT(!Position::FromString("A").IsValid());
+        ASSERT(!Position::FromString("1").IsValid());
+        ASSERT(!Position::FromString("e2").IsValid());
+        ASSERT(!Position::FromString("A0").IsValid());
+        ASSERT(!Position::FromString("A-1").IsValid());
+        ASSERT(!Position::FromString("A+1").IsValid());
+        ASSERT(!Position::FromString("R2D2").IsValid());
+        ASSERT(!Position::FromString("C3PO").IsValid());
+        ASSERT(!Position::FromString("XFD16385").IsValid());
+        ASSERT(!Position::FromString("XFE16384").IsValid());
+        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+    }
+
+    void TestPositionPackedAndBatch() {
+        // Все столбцы и крайние строки переводятся в имя и обратно
+        Position previous = Position::NONE;
+        for (int row : {0, 9, 99, Position::MAX_ROWS - 1}) {
+            for (int col = 0; col < Position::MAX_COLS; ++col) {
+                const Position pos{row, col};
+                char buffer[Position::MAX_STRING_LENGTH];
+                const std::string_view name(buffer, pos.ToChars(buffer) - buffer);
+                ASSERT_EQUAL(Position::FromString(name), pos);
+
+                ASSERT_EQUAL(Position::Unpack(pos.Pack()), pos);
+                if (previous.IsValid()) {
+                    ASSERT(previous.Pack() < pos.Pack());
+                }
+                previous = pos;
+            }
+        }
+        ASSERT_EQUAL(Position::FromString("A007"), (Position{6, 0}));
+        ASSERT_EQUAL(std::hash<Position>{}("B3"_pos), std::hash<Position>{}(Position{2, 1}));
+
+        ASSERT_EQUAL(Position::FromStrings({"A1", "ZZ10", "A0", "XFD16384"}),
+                     (std::vector<Position>{{0, 0}, {9, 701}, Position{-1, 0}, {16383, 16383}}));
+        std::string names = "cells:";
+        Position::AppendStrings(names, {{0, 0}, {9, 701}, {16383, 16383}}, ' ');
+        ASSERT_EQUAL(names, "cells:A1 ZZ10 XFD16384");
+        ASSERT_EQUAL((Range{{0, 0}, {16383, 16383}}).ToString(), "A1:XFD16384");
+    }
+
+    void TestEmpty() {
+        auto sheet = CreateSheet();
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestInvalidPosition() {
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCell(Position{-1, 0}, "");
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet->GetCell(Position{0, -2});
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet->ClearCell(Position{Position::MAX_ROWS, 0});
+        } catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestSetCellPlainText() {
+        auto sheet = CreateSheet();
+
+        auto checkCell = [&](Position pos, std::string text) {
+            sheet->SetCell(pos, text);
+            CellInterface* cell = sheet->GetCell(pos);
+            ASSERT(cell != nullptr);
+            ASSERT_EQUAL(cell->GetText(), text);
+            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+        };
+
+        checkCell("A1"_pos, "Hello");
+        checkCell("A1"_pos, "World");
+        checkCell("B2"_pos, "Purr");
+        checkCell("A3"_pos, "Meow");
+
+        const SheetInterface& constSheet = *sheet;
+        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+        sheet->SetCell("A3"_pos, "'=escaped");
+        CellInterface* cell = sheet->GetCell("A3"_pos);
+        ASSERT_EQUAL(cell->GetText(), "'=escaped");
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+    }
+
+    void TestClearCell() {
+        auto sheet = CreateSheet();
+
+        sheet->SetCell("C2"_pos, "Me gusta");
+        sheet->ClearCell("C2"_pos);
+        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+        sheet->ClearCell("A1"_pos);
+        sheet->ClearCell("J10"_pos);
+    }
+
+    void TestFormulaArithmetic() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+
+        ASSERT_EQUAL(evaluate("1"), 1);
+        ASSERT_EQUAL(evaluate("42"), 42);
+        ASSERT_EQUAL(evaluate("2 + 2"), 4);
+        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+    }
+
+    void TestFormulaReferences() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(evaluate("A1"), 1);
+        sheet->SetCell("A2"_pos, "2");
+        ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+        // Тест на нули:
+        sheet->SetCell("B3"_pos, "");
+        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+    }
+
+    void TestFormulaExpressionFormatting() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+
+        ASSERT_EQUAL(reformat("  1  "), "1");
+        ASSERT_EQUAL(reformat("  -1  "), "-1");
+        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+    }
+
+    void TestFormulaReferencedCells() {
+        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+
+        auto a1 = ParseFormula("A1");
+        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
+
+        auto b2c3 = ParseFormula("B2+C3");
+        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
+
+        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+    }
+
+    void TestErrorValue() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "A1");
+        sheet->SetCell("E4"_pos, "=E2");
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+
+        sheet->SetCell("E2"_pos, "3D");
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestErrorDiv0() {
+        auto sheet = CreateSheet();
+
+        constexpr double max = std::numeric_limits<double>::max();
+
+        sheet->SetCell("A1"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "=0/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '+' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << -max << '-' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '*' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                         CellInterface::Value(FormulaError::Category::Div0));
+        }
+    }
+
+    void TestEmptyCellTreatedAsZero() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestFormulaInvalidPosition() {
+        auto sheet = CreateSheet();
+        auto try_formula = [&](const std::string& formula) {
+            try {
+                sheet->SetCell("A1"_pos, formula);
+                ASSERT(false);
+            } catch (const FormulaException&) {
+                // we expect this one
+            }
+        };
+
+        try_formula("=X0");
+        try_formula("=ABCD1");
+        try_formula("=A123456");
+        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+        try_formula("=XFD16385");
+        try_formula("=XFE16384");
+        try_formula("=R2D2");
+    }
+
+    void TestPrint() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A2"_pos, "meow");
+        sheet->SetCell("B2"_pos, "=35");
+
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+    }
+
+    void TestCellReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1");
+        sheet->SetCell("B2"_pos, "=A1");
+
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+        // Ссылка на пустую ячейку
+        sheet->SetCell("B2"_pos, "=B1");
+        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+
+        sheet->SetCell("A2"_pos, "");
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+        // Ссылка на ячейку за пределами таблицы
+        sheet->SetCell("B1"_pos, "=C3");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
+    }
+
+    void TestFormulaIncorrect() {
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+
+        ASSERT(isIncorrect("A2B"));
+        ASSERT(isIncorrect("3X"));
+        ASSERT(isIncorrect("A0++"));
+        ASSERT(isIncorrect("((1)"));
+        ASSERT(isIncorrect("2+4-"));
+    }
+
+    void TestCellCircularReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "=E4");
+        sheet->SetCell("E4"_pos, "=X9");
+        sheet->SetCell("X9"_pos, "=M6");
+        sheet->SetCell("M6"_pos, "Ready");
+
+        bool caught = false;
+        try {
+            sheet->SetCell("M6"_pos, "=E2");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+    }
+
+    void TEST10() {
+        auto sheet = CreateSheet();
+
+        sheet->SetCell("C1"_pos, "=123");
+        try {
+            sheet->SetCell("A1"_pos, "=A1");
+            std::exit(1);
+        }
+        catch (CircularDependencyException&){
+            std::cout << "all good" <<std::endl;
+        }
+
+        try {
+            sheet->SetCell("A1"_pos, "=C1+A1");
+            std::exit(1);
+        }
+        catch (CircularDependencyException&){
+            std::cout << "all good" <<std::endl;
+        }
+    }
+
+    void TestCacheInvalidation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B1"_pos, "=A1");
+        sheet.SetCell("C1"_pos, "=10");
+
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetRecalcStats().invalidated, 2u);    // A2 и A3, B1 ещё не вычислялась
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(sheet.GetRecalcStats().recomputed, 2u);
+
+        sheet.ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet.GetRecalcStats().invalidated, 2u);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestNativeFormulaParser() {
+        auto reformat = [](std::string_view expr) {
+            std::ostringstream out;
+            ParseFormulaASTNative(expr).PrintFormula(out);
+            return out.str();
+        };
+        auto isIncorrect = [](std::string_view expr) {
+            try {
+                ParseFormulaASTNative(expr);
+            } catch (const ParsingError&) {
+                return true;
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+
+        ASSERT_EQUAL(reformat(".5+1.25e1"), "0.5+12.5");
+        ASSERT_EQUAL(reformat("-+-A1 * 2"), "-+-A1*2");
+        ASSERT_EQUAL(reformat("-(1+2)*3"), "-(1+2)*3");
+        ASSERT_EQUAL(reformat("1-(2-3)-4"), "1-(2-3)-4");
+        ASSERT_EQUAL(reformat("\t1/(2/3)\r\n"), "1/(2/3)");
+
+        ASSERT(isIncorrect(""));
+        ASSERT(isIncorrect("1."));
+        ASSERT(isIncorrect("."));
+        ASSERT(isIncorrect("1e"));
+        ASSERT(isIncorrect("1 2"));
+        ASSERT(isIncorrect("A"));
+        ASSERT(isIncorrect("a1"));
+        ASSERT(isIncorrect("()"));
+        ASSERT(isIncorrect("1)"));
+        ASSERT(isIncorrect("1e400"));
+        ASSERT(isIncorrect("ZZZZ1"));
+    }
+
+    void TestRecalculateAll() {
+        Sheet sheet;
+        constexpr int rows = 200;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < rows; ++row) {
+            const std::string prev = std::to_string(row);
+            sheet.SetCell(Position{row, 0}, "=A" + prev + "+1");          // цепочка
+            sheet.SetCell(Position{row, 1}, "=A" + prev + "*2");          // веер от цепочки
+            sheet.SetCell(Position{row, 2}, "=B" + std::to_string(row + 1) + "/A1");
+        }
+
+        sheet.RecalculateAll(4);
+        ASSERT_EQUAL(sheet.GetRecalcStats().recomputed, static_cast<size_t>(3 * (rows - 1)));
+
+        for (int row = 1; row < rows; ++row) {
+            ASSERT_EQUAL(sheet.GetCell(Position{row, 0})->GetValue(), CellInterface::Value(row + 1.0));
+            ASSERT_EQUAL(sheet.GetCell(Position{row, 2})->GetValue(), CellInterface::Value(2.0 * row));
+        }
+        // Всё уже вычислено, чтение не пересчитывает ячейки
+        ASSERT_EQUAL(sheet.GetRecalcStats().recomputed, static_cast<size_t>(3 * (rows - 1)));
+
+        sheet.SetCell("A1"_pos, "2");
+        sheet.RecalculateAll(1);
+        ASSERT_EQUAL(sheet.GetCell(Position{rows - 1, 2})->GetValue(), CellInterface::Value(1.0 * rows));
+    }
+
+    void TestCellStorageTiles() {
+        Sheet sheet;
+        CellStorage storage(sheet);
+        constexpr int tile = CellStorage::TILE_SIZE;
+
+        Cell* first = storage.GetOrCreate({0, 0});
+        ASSERT_EQUAL(storage.GetOrCreate({0, 0}), first);
+        storage.GetOrCreate({tile - 1, tile - 1});
+        ASSERT_EQUAL(storage.GetTileCount(), 1u);
+        // Внутри блока выделены только группы, в которых есть ячейки
+        ASSERT_EQUAL(storage.GetGroupCount(), 2u);
+        storage.GetOrCreate({1, CellStorage::GROUP_SIZE - 1});
+        ASSERT_EQUAL(storage.GetGroupCount(), 2u);
+        storage.Erase({1, CellStorage::GROUP_SIZE - 1});
+
+        storage.GetOrCreate({tile, 0});
+        storage.GetOrCreate({Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+        ASSERT_EQUAL(storage.GetTileCount(), 3u);
+        ASSERT_EQUAL(storage.GetCellCount(), 4u);
+        ASSERT(storage.Get({1, 1}) == nullptr);
+        ASSERT(storage.Get({Position::MAX_ROWS - 2, 5}) == nullptr);
+
+        std::vector<Position> visited;
+        storage.ForEach([&visited](Position pos, const Cell&) {
+            visited.push_back(pos);
+        });
+        ASSERT_EQUAL(visited.size(), 4u);
+
+        storage.Erase({tile, 0});
+        storage.Erase({tile, 0});
+        ASSERT_EQUAL(storage.GetTileCount(), 2u);
+        ASSERT_EQUAL(storage.GetGroupCount(), 3u);
+        ASSERT_EQUAL(storage.Get({0, 0}), first);
+
+        storage.Erase({tile - 1, tile - 1});
+        ASSERT_EQUAL(storage.GetGroupCount(), 2u);
+        ASSERT_EQUAL(storage.GetTileCount(), 2u);
+        std::vector<Position> in_range;
+        storage.ForEachInRange({{0, 0}, {tile, tile}}, [&in_range](Position pos, const Cell&) {
+            in_range.push_back(pos);
+        });
+        ASSERT_EQUAL(in_range, (std::vector<Position>{Position{0, 0}}));
+    }
+
+    void TestAggregateFunctions() {
+        auto sheet = CreateSheet();
+        auto value = [&](std::string_view pos) {
+            return sheet->GetCell(Position::FromString(pos))->GetValue();
+        };
+
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "'2");
+        sheet->SetCell("A4"_pos, "=A1*4");
+        sheet->SetCell("B1"_pos, "=SUM(A1:A4)");
+        sheet->SetCell("B2"_pos, "=AVERAGE(A1:A4)");
+        sheet->SetCell("B3"_pos, "=MIN(A4:A1, 10)");
+        sheet->SetCell("B4"_pos, "=MAX(A1:A4)+COUNT(A1:A5, 7, A1)");
+        sheet->SetCell("B5"_pos, "=AVERAGE(C1:C9)");
+        sheet->SetCell("B6"_pos, "=SUM(MIN(A1, 3), -MAX(C1:C2))");
+
+        ASSERT_EQUAL(value("B1"), CellInterface::Value(7.0));
+        ASSERT_EQUAL(value("B2"), CellInterface::Value(7.0 / 3));
+        ASSERT_EQUAL(value("B3"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("B4"), CellInterface::Value(9.0));
+        ASSERT_EQUAL(value("B5"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(value("B6"), CellInterface::Value(1.0));
+
+        ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "=MIN(A1:A4,10)");
+        ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetText(), "=MAX(A1:A4)+COUNT(A1:A5,7,A1)");
+        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+
+        // Изменение ячейки внутри диапазона сбрасывает кэш агрегата
+        sheet->SetCell("A3"_pos, "5");
+        ASSERT_EQUAL(value("B1"), CellInterface::Value(12.0));
+        // Текст в диапазоне пропускается, ошибки формул диапазона передаются дальше
+        sheet->SetCell("A3"_pos, "text");
+        ASSERT_EQUAL(value("B1"), CellInterface::Value(7.0));
+        ASSERT_EQUAL(value("B4"), CellInterface::Value(9.0));
+        sheet->SetCell("C1"_pos, "label");
+        sheet->SetCell("C2"_pos, "'");
+        sheet->SetCell("C3"_pos, "2.5");
+        sheet->SetCell("C4"_pos, "=A3*2");
+        sheet->SetCell("D1"_pos, "=COUNT(C1:C3)");
+        sheet->SetCell("D2"_pos, "=AVERAGE(C1:C3)+MIN(C1:C3)+MAX(C1:C3)");
+        sheet->SetCell("D3"_pos, "=SUM(C1:C4)");
+        sheet->SetCell("D4"_pos, "=SUM(C1:C3, C1)");
+        ASSERT_EQUAL(value("D1"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("D2"), CellInterface::Value(7.5));
+        ASSERT_EQUAL(value("D3"), CellInterface::Value(FormulaError::Category::Value));
+        // Текст, указанный в агрегате отдельной ячейкой, по-прежнему ошибка
+        ASSERT_EQUAL(value("D4"), CellInterface::Value(FormulaError::Category::Value));
+        sheet->ClearCell("C4"_pos);
+        sheet->ClearCell("D3"_pos);
+        sheet->ClearCell("D4"_pos);
+
+        bool caught = false;
+        try {
+            sheet->SetCell("A3"_pos, "=SUM(B1:B2)");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(isIncorrect("SUM()"));
+        ASSERT(isIncorrect("SUM(A1:)"));
+        ASSERT(isIncorrect("SUM(A1:B2+1)"));
+        ASSERT(isIncorrect("A1:B2"));
+        ASSERT(isIncorrect("SUMX(A1)"));
+        ASSERT(isIncorrect("SUM(A1:XFD16385)"));
+        ASSERT(isIncorrect("SUM A1"));
+    }
+
+    void TestRangeDependencyIndex() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=SUM(B1:B16384)+AVERAGE(C10:E20)");
+        sheet.SetCell("A2"_pos, "=C15");
+
+        // Диапазон занимает одну запись индекса и не создаёт пустых ячеек
+        ASSERT_EQUAL(sheet.GetDependencies().GetRangeEntryCount(), 2u);
+        ASSERT(sheet.GetCell("B100"_pos) == nullptr);
+        ASSERT(sheet.GetCell("C15"_pos) != nullptr);
+
+        auto dependents = [&sheet](std::string_view pos) {
+            auto result = sheet.GetDependencies().GetDependents(Position::FromString(pos));
+            std::sort(result.begin(), result.end());
+            return result;
+        };
+        ASSERT_EQUAL(dependents("B16384").size(), 1u);
+        ASSERT_EQUAL(dependents("C15"), (std::vector<Position>{"A1"_pos, "A2"_pos}));
+        ASSERT(dependents("F15").empty());
+        ASSERT(dependents("C21").empty());
+
+        sheet.SetCell("A1"_pos, "=1");
+        ASSERT_EQUAL(sheet.GetDependencies().GetRangeEntryCount(), 0u);
+        ASSERT_EQUAL(dependents("C15"), (std::vector<Position>{"A2"_pos}));
+
+        // Освободившаяся запись используется повторно
+        sheet.SetCell("A3"_pos, "=MAX(A1:A2)");
+        sheet.SetCell("B5"_pos, "=COUNT(A3:A4)");
+        ASSERT_EQUAL(dependents("A1"), (std::vector<Position>{"A3"_pos}));
+        ASSERT_EQUAL(dependents("A3"), (std::vector<Position>{"B5"_pos}));
+        ASSERT_EQUAL(sheet.GetDependencies().GetRangeEntryCount(), 2u);
+
+        // Ячейка только из диапазона удаляется при очистке, формулы пересчитываются
+        sheet.SetCell("B7"_pos, "3");
+        sheet.SetCell("C1"_pos, "=SUM(B6:B10)");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet.ClearCell("B7"_pos);
+        ASSERT(sheet.GetCell("B7"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // Запросы не меняют индекс, а ссылки удалённых диапазонов вычищаются,
+        // даже если по их строкам никто не спрашивает
+        DependencyIndex index;
+        for (int i = 0; i < 20000; ++i) {
+            const Range range{{i % 1000, 0}, {i % 1000 + 7000, 3}};
+            index.Add({i % 7, 9}, {}, {range});
+            index.Remove({i % 7, 9}, {}, {range});
+        }
+        ASSERT_EQUAL(index.GetRangeEntryCount(), 0u);
+        ASSERT(index.GetNodeItemCount() < 2 * 4096);
+        const Range kept{{5, 1}, {9, 1}};
+        index.Add("Z1"_pos, {}, {kept});
+        const size_t items = index.GetNodeItemCount();
+        ASSERT_EQUAL(index.GetDependents("B7"_pos), std::vector<Position>{"Z1"_pos});
+        ASSERT(index.GetDependents("B11"_pos).empty());
+        ASSERT_EQUAL(index.GetNodeItemCount(), items);
+
+        // Сдвиг перебирает каждый задетый диапазон ровно один раз и только их
+        DependencyIndex shifted;
+        std::vector<std::pair<Position, Range>> references;
+        for (int i = 0; i < 300; ++i) {
+            const Position from{i * 37 % 16000, i * 53 % 9000};
+            const Position to{from.row + i * 13 % 400, from.col + i * 29 % 500};
+            references.emplace_back(Position{i, 0}, Range{from, to});
+            shifted.Add(references.back().first, {}, {references.back().second});
+        }
+        for (int i = 0; i < 300; i += 3) {
+            shifted.Remove(references[i].first, {}, {references[i].second});
+        }
+        for (const SheetShift& shift : {SheetShift{SheetShift::Axis::Rows, 0, 1}, SheetShift{SheetShift::Axis::Rows, 5000, -2},
+                                        SheetShift{SheetShift::Axis::Rows, 16383, 1}, SheetShift{SheetShift::Axis::Cols, 4000, 3},
+                                        SheetShift{SheetShift::Axis::Cols, 9300, -1}}) {
+            std::vector<Position> expected;
+            for (int i = 0; i < 300; ++i) {
+                if (i % 3 != 0 && shift.Affects(references[i].second)) {
+                    expected.push_back(references[i].first);
+                }
+            }
+            std::vector<Position> found;
+            shifted.ForEachRangeReference(shift, [&found](Position dependent, const Range&) {
+                found.push_back(dependent);
+            });
+            std::sort(found.begin(), found.end());
+            ASSERT_EQUAL(found, expected);
+        }
+    }
+
+    void TestIncrementalCycleDetection() {
+        Sheet incremental;
+        Sheet full_search;
+        full_search.SetCycleDetection(CycleDetection::FullSearch);
+
+        auto set = [](Sheet& sheet, Position pos, const std::string& text) {
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                return false;
+            }
+            return true;
+        };
+
+        // Оба способа должны одинаково принимать и отвергать случайные изменения
+        unsigned seed = 12345;
+        auto random = [&seed](int bound) {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        const int side = 6;
+        for (int step = 0; step < 2000; ++step) {
+            const Position pos{random(side), random(side)};
+            const Position first{random(side), random(side)};
+            const Position second{random(side), random(side)};
+
+            std::string text;
+            switch (random(4)) {
+                case 0:
+                    text = std::to_string(step);
+                    break;
+                case 1:
+                    text = "=" + first.ToString() + "+1";
+                    break;
+                case 2:
+                    text = "=" + first.ToString() + "-" + second.ToString();
+                    break;
+                default:
+                    text = "=SUM(" + first.ToString() + ":" + second.ToString() + ")";
+                    break;
+            }
+
+            ASSERT_EQUAL(set(incremental, pos, text), set(full_search, pos, text));
+            if (step % 500 == 0) {
+                incremental.ClearCell(pos);
+                full_search.ClearCell(pos);
+            }
+        }
+
+        // Включение инкрементального режима строит порядок по существующим формулам
+        full_search.SetCycleDetection(CycleDetection::Incremental);
+        for (int row = 0; row < side; ++row) {
+            for (int col = 0; col < side; ++col) {
+                const Position pos{row, col};
+                const std::string text = "=A1+" + Position{(row + 1) % side, col}.ToString();
+                ASSERT_EQUAL(set(incremental, pos, text), set(full_search, pos, text));
+            }
+        }
+
+        Sheet chain;
+        chain.SetCell("A3"_pos, "=A2");
+        chain.SetCell("A2"_pos, "=A1");
+        chain.SetCell("A1"_pos, "=B1");
+        ASSERT(!set(chain, "B1"_pos, "=A3"));
+        ASSERT(!set(chain, "B1"_pos, "=SUM(A1:A5)"));
+        ASSERT(set(chain, "B1"_pos, "=C1"));
+        ASSERT(!set(chain, "C1"_pos, "=MAX(A3:B3)"));
+        ASSERT_EQUAL(chain.GetFormulaOrder().GetSize(), 4u);
+    }
+
+    void TestBatchLoad() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("E1"_pos, "=A1*2");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        // Формулы могут ссылаться на ячейки, загружаемые позже, позиция может повторяться
+        sheet.LoadCells({
+                {"B1"_pos, "=C1+D1"},
+                {"C1"_pos, "=SUM(D1:D3)"},
+                {"D1"_pos, "1"},
+                {"D2"_pos, "2"},
+                {"A1"_pos, "7"},
+                {"D1"_pos, "4"},
+        }, 2);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(14.0));
+        ASSERT(sheet.GetCell("D3"_pos) == nullptr);
+
+        // Все ячейки циклов перечисляются сразу, лист остаётся прежним
+        std::vector<Position> cycle_cells;
+        try {
+            sheet.LoadCells({
+                    {"F1"_pos, "=G1"},
+                    {"G1"_pos, "=F1+B1"},
+                    {"H1"_pos, "=SUM(H1:H2)"},
+                    {"D1"_pos, "=B1"},
+                    {"A1"_pos, "=I1"},
+            });
+        } catch (const CircularDependencyException& e) {
+            cycle_cells = e.GetCells();
+        }
+        ASSERT_EQUAL(cycle_cells, (std::vector<Position>{"B1"_pos, "C1"_pos, "D1"_pos,
+                                                          "F1"_pos, "G1"_pos, "H1"_pos}));
+        ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+        ASSERT(sheet.GetCell("I1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "7");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "4");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        bool caught = false;
+        try {
+            sheet.LoadCells({{"A1"_pos, "1"}, {"A2"_pos, "=1+"}});
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "7");
+
+        // Изменения пакета не видны до CommitBatch
+        sheet.BeginBatch();
+        sheet.SetCell("D2"_pos, "20");
+        sheet.ClearCell("E1"_pos);
+        sheet.SetCell("J1"_pos, "=D2");
+        ASSERT(sheet.IsBatchActive());
+        ASSERT(sheet.GetCell("J1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+        caught = false;
+        try {
+            sheet.LoadCells({{"K1"_pos, "=D2+1"}});
+        } catch (const std::logic_error&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        caught = false;
+        try {
+            sheet.LoadCells([](const Sheet::CellConsumer& add) {
+                add("K1"_pos, "=D2+1");
+            });
+        } catch (const std::logic_error&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet.GetCell("K1"_pos) == nullptr);
+        sheet.CommitBatch();
+        ASSERT(!sheet.IsBatchActive());
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("J1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(28.0));
+
+        // После загрузки одиночные изменения снова проверяются на циклы
+        caught = false;
+        try {
+            sheet.SetCell("D1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // Небольшая загрузка в большой лист упорядочивает только загруженные формулы
+        // и зависящие от них, порядок остаётся пригодным для одиночных изменений
+        for (CycleDetection mode : {CycleDetection::Incremental, CycleDetection::FullSearch}) {
+            Sheet chain;
+            chain.SetCycleDetection(mode);
+            chain.SetCell("A1"_pos, "1");
+            for (int row = 1; row < 200; ++row) {
+                chain.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+            }
+            chain.SetCell("B1"_pos, "=A100");
+
+            chain.LoadCells({{"A1"_pos, "=C1"}, {"C1"_pos, "=2"}});
+            ASSERT_EQUAL(chain.GetCell("A200"_pos)->GetValue(), CellInterface::Value(201.0));
+            caught = false;
+            try {
+                chain.SetCell("C1"_pos, "=A150");
+            } catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+
+            cycle_cells.clear();
+            try {
+                chain.LoadCells({{"D1"_pos, "=B1"}, {"C1"_pos, "=D1"}});
+            } catch (const CircularDependencyException& e) {
+                cycle_cells = e.GetCells();
+            }
+            ASSERT_EQUAL(cycle_cells.size(), 103u);
+            ASSERT(chain.GetCell("D1"_pos) == nullptr);
+            ASSERT_EQUAL(chain.GetCell("C1"_pos)->GetText(), "=2");
+            caught = false;
+            try {
+                chain.SetCell("C1"_pos, "=A10");
+            } catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+            chain.SetCell("C1"_pos, "5");
+            ASSERT_EQUAL(chain.GetCell("A200"_pos)->GetValue(), CellInterface::Value(204.0));
+        }
+    }
+
+    void TestCsv() {
+        const std::string csv = "1,text,\"=A1*2\"\r\n"
+                                "\"a,b\",,\"say \"\"hi\"\"\"\n"
+                                "\n"
+                                "\"multi\nline\",'=escaped,=SUM(A1:C1)";
+
+        // Маленький блок проверяет записи, разрезанные границей чтения
+        for (size_t chunk_size : {1u, 3u, 7u, 1024u}) {
+            std::istringstream input(csv);
+            CsvReader reader(input, CsvFormat::Csv(), chunk_size);
+            std::vector<std::pair<Position, std::string>> fields;
+            reader.ForEachField([&fields](Position pos, std::string_view text) {
+                fields.emplace_back(pos, std::string(text));
+            });
+
+            const std::vector<std::pair<Position, std::string>> expected = {
+                    {"A1"_pos, "1"}, {"B1"_pos, "text"}, {"C1"_pos, "=A1*2"},
+                    {"A2"_pos, "a,b"}, {"C2"_pos, "say \"hi\""},
+                    {"A4"_pos, "multi\nline"}, {"B4"_pos, "'=escaped"}, {"C4"_pos, "=SUM(A1:C1)"},
+            };
+            ASSERT_EQUAL(fields.size(), expected.size());
+            for (size_t i = 0; i < expected.size(); ++i) {
+                ASSERT_EQUAL(fields[i].first, expected[i].first);
+                ASSERT_EQUAL(fields[i].second, expected[i].second);
+            }
+        }
+
+        Sheet sheet;
+        std::istringstream input(csv);
+        ImportCsv(input, sheet);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        // Выгруженный CSV загружается в такой же лист
+        std::ostringstream texts;
+        sheet.PrintTexts(texts, CsvFormat::Csv());
+        Sheet copy;
+        std::istringstream copy_input(texts.str());
+        ImportCsv(copy_input, copy);
+        std::ostringstream copy_texts;
+        copy.PrintTexts(copy_texts, CsvFormat::Csv());
+        ASSERT_EQUAL(copy_texts.str(), texts.str());
+
+        std::ostringstream values;
+        sheet.PrintValues(values, CsvFormat::Csv());
+        ASSERT_EQUAL(values.str(), "1,text,2\n\"a,b\",,\"say \"\"hi\"\"\"\n,,\n\"multi\nline\",=escaped,3\n");
+
+        // Числа печатаются так же, как operator<<
+        for (double number : {0.1, 1.0 / 3, -0.5, 1e20, 123456789.0, 1e-7, 0.0, 100.0}) {
+            std::ostringstream expected;
+            expected << number;
+            std::ostringstream output;
+            {
+                CsvWriter writer(output, CsvFormat::Tsv());
+                writer.WriteNumber(number);
+            }
+            ASSERT_EQUAL(output.str(), expected.str());
+        }
+
+        // Точность и флаги потока учитываются, как у operator<<
+        auto with_format = [](std::ostream& stream, int precision, std::ios::fmtflags flags) -> std::ostream& {
+            stream.precision(precision);
+            stream.setf(flags, std::ios::floatfield | std::ios::showpos | std::ios::uppercase);
+            return stream;
+        };
+        for (auto [precision, flags] : std::vector<std::pair<int, std::ios::fmtflags>>{
+                {10, {}}, {0, {}}, {17, {}}, {3, std::ios::fixed}, {40, std::ios::fixed},
+                {2, std::ios::scientific}, {4, std::ios::showpos}, {5, std::ios::uppercase | std::ios::scientific}}) {
+            for (double number : {1.0 / 3, -2.5e-9, 1e300, 100.0}) {
+                std::ostringstream expected;
+                with_format(expected, precision, flags) << number;
+                std::ostringstream output;
+                {
+                    CsvWriter writer(with_format(output, precision, flags), CsvFormat::Tsv());
+                    writer.WriteNumber(number);
+                }
+                ASSERT_EQUAL(output.str(), expected.str());
+            }
+        }
+
+        // Печать листа совпадает с печатью значений через operator<<
+        Sheet numbers;
+        numbers.SetCell("A1"_pos, "=1/3");
+        numbers.SetCell("B1"_pos, "=2/3");
+        std::ostringstream printed;
+        printed.precision(12);
+        numbers.PrintValues(printed);
+        std::ostringstream expected;
+        expected.precision(12);
+        expected << 1.0 / 3 << '\t' << 2.0 / 3 << '\n';
+        ASSERT_EQUAL(printed.str(), expected.str());
+
+        // Файл больше одной порции разбора загружается целиком и атомарно.
+        // B1 ссылается на строку за концом файла, ячейки строки — друг на друга
+        constexpr int cols = 8;
+        const int rows = static_cast<int>(Sheet::LOAD_CHUNK_CELLS / cols) + 100;
+        std::string big;
+        for (int row = 0; row < rows; ++row) {
+            big += std::to_string(row);
+            for (int col = 1; col < cols; ++col) {
+                big += row == 0 && col == 1 ? ",=H" + std::to_string(rows + 1)
+                                            : ",=" + Position{row, col - 1}.ToString();
+            }
+            big += '\n';
+        }
+        Sheet loaded;
+        std::istringstream big_input(big);
+        ImportCsv(big_input, loaded, CsvFormat::Csv(), 2);
+        ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{rows, cols}));
+        ASSERT_EQUAL(loaded.GetCell(Position{rows - 1, cols - 1})->GetValue(), CellInterface::Value(rows - 1.0));
+        ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // Цикл в последней порции отменяет загрузку всего файла
+        Sheet rejected;
+        rejected.SetCell("A1"_pos, "kept");
+        std::istringstream cyclic_input(big + ",,,,,,,=B1\n");
+        bool caught = false;
+        try {
+            ImportCsv(cyclic_input, rejected);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(rejected.GetCell("A1"_pos)->GetText(), "kept");
+        ASSERT_EQUAL(rejected.GetPrintableSize(), (Size{1, 1}));
+    }
+
+    void TestSnapshot() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "'=text");
+        sheet.SetCell("B1"_pos, "=A1*(A1+3)/-B3");
+        sheet.SetCell("B2"_pos, "=SUM(A1,B3:B3,MAX(B1,1),COUNT(D1:D2))");
+        sheet.SetCell("B3"_pos, "=4");
+        sheet.SetCell("C1"_pos, "=1/0");
+        sheet.SetCell("C3"_pos, "=Z9");    // Z9 — пустая ячейка-ссылка
+        for (Position pos : {"B1"_pos, "B2"_pos, "C1"_pos}) {
+            sheet.GetCell(pos)->GetValue();
+        }
+
+        std::ostringstream output;
+        sheet.SaveSnapshot(output);
+        const std::string data = output.str();
+        auto loaded = Sheet::LoadSnapshot(data);
+
+        std::ostringstream texts, loaded_texts;
+        sheet.PrintTexts(texts);
+        loaded->PrintTexts(loaded_texts);
+        ASSERT_EQUAL(loaded_texts.str(), texts.str());
+        ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+
+        // Вычисленные значения берутся из снимка, а не считаются заново
+        ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(-2.5));
+        ASSERT_EQUAL(loaded->GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0 + 4 + 1 + 0));
+        ASSERT_EQUAL(loaded->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(loaded->GetRecalcStats().recomputed, 0u);
+        ASSERT_EQUAL(loaded->GetCell("C3"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT(loaded->GetCell("Z9"_pos) != nullptr);
+
+        // Зависимости восстановлены: изменение сбрасывает кэши, циклы находятся
+        loaded->SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(-7.0));
+        ASSERT_EQUAL(loaded->GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0 + 4 + 1 + 0));
+        try {
+            loaded->SetCell("B3"_pos, "=B2");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+
+        // Повреждённые снимки отвергаются, а не загружаются частично
+        auto expect_broken = [](std::string_view broken) {
+            try {
+                Sheet::LoadSnapshot(broken);
+                ASSERT(false);
+            } catch (const BinaryFormatException&) {
+            }
+        };
+        for (size_t size = 0; size < data.size(); ++size) {
+            expect_broken(std::string_view(data).substr(0, size));
+        }
+        std::string wrong_version = data;
+        ++wrong_version[8];
+        expect_broken(wrong_version);
+        expect_broken(data + '\0');
+
+        // Программа формулы с недостающим операндом: PushNumber 1, Add
+        std::string formula;
+        binary_io::Write(formula, std::uint32_t{0});
+        binary_io::Write(formula, std::uint32_t{2});
+        binary_io::Write(formula, static_cast<std::uint8_t>(ASTImpl::OpCode::PushNumber));
+        binary_io::Write(formula, 1.0);
+        binary_io::Write(formula, static_cast<std::uint8_t>(ASTImpl::OpCode::Add));
+        std::string_view formula_data = formula;
+        try {
+            DeserializeFormula(formula_data);
+            ASSERT(false);
+        } catch (const BinaryFormatException&) {
+        }
+
+        Sheet empty;
+        std::ostringstream empty_output;
+        empty.SaveSnapshot(empty_output);
+        ASSERT_EQUAL(Sheet::LoadSnapshot(empty_output.str())->GetPrintableSize(), (Size{0, 0}));
+    }
+
+    void TestNumericValue() {
+        ASSERT_EQUAL(ParseNumber("1.5").value_or(0), 1.5);
+        ASSERT_EQUAL(ParseNumber("  +2e3").value_or(0), 2000.0);
+        ASSERT_EQUAL(ParseNumber("-.5").value_or(0), -0.5);
+        for (std::string_view text : {"", " ", "+", "+-1", "3D", "1e400", "1 ", "abc"}) {
+            ASSERT(!ParseNumber(text));
+        }
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "12");
+        sheet.SetCell("A2"_pos, "'7");
+        sheet.SetCell("A3"_pos, "'");
+        sheet.SetCell("A4"_pos, "text");
+        sheet.SetCell("A5"_pos, "=A1/2");
+        sheet.SetCell("A6"_pos, "=1/0");
+        sheet.SetCell("A7"_pos, "=A9");    // создаёт пустую ячейку A9
+
+        using NumericValue = CellInterface::NumericValue;
+        ASSERT(sheet.GetCell("A1"_pos)->GetNumericValue() == NumericValue(12.0));
+        ASSERT(sheet.GetCell("A2"_pos)->GetNumericValue() == NumericValue(7.0));
+        ASSERT(sheet.GetCell("A3"_pos)->GetNumericValue() == NumericValue(std::monostate{}));
+        ASSERT(sheet.GetCell("A4"_pos)->GetNumericValue() == NumericValue(FormulaError::Category::Value));
+        ASSERT(sheet.GetCell("A5"_pos)->GetNumericValue() == NumericValue(6.0));
+        ASSERT(sheet.GetCell("A6"_pos)->GetNumericValue() == NumericValue(FormulaError::Category::Div0));
+        ASSERT(sheet.GetCell("A9"_pos)->GetNumericValue() == NumericValue(std::monostate{}));
+
+        // Пустой текст не учитывается агрегатами, но в выражении равен нулю
+        sheet.SetCell("B1"_pos, "=COUNT(A1:A3)+A3");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        // Текст, не являющийся числом, агрегат по диапазону пропускает
+        sheet.SetCell("B2"_pos, "=SUM(A1:A4)");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0 + 7));
+
+        // Числовое значение текста запоминается при установке и обновляется вместе с текстом
+        sheet.SetCell("A4"_pos, " 8");
+        ASSERT(sheet.GetCell("A4"_pos)->GetNumericValue() == NumericValue(8.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0 + 7 + 8));
+        sheet.SetCell("A4"_pos, "8 apples");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0 + 7));
+    }
+
+    void TestErrorPropagation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "text");
+        sheet.SetCell("A2"_pos, "=1/0");
+        sheet.SetCell("A3"_pos, "=1e200*1e200");
+
+        auto value = [&sheet](std::string_view pos) {
+            return sheet.GetCell(Position::FromString(pos))->GetValue();
+        };
+        const CellInterface::Value div0 = FormulaError(FormulaError::Category::Div0);
+        const CellInterface::Value text = FormulaError(FormulaError::Category::Value);
+
+        ASSERT_EQUAL(value("A2"), div0);
+        ASSERT_EQUAL(value("A3"), div0);
+
+        // Результатом становится первая ошибка в порядке вычисления
+        sheet.SetCell("B1"_pos, "=A1+1/0");
+        ASSERT_EQUAL(value("B1"), text);
+        sheet.SetCell("B2"_pos, "=1/0+A1");
+        ASSERT_EQUAL(value("B2"), div0);
+        // Текст в диапазоне пропускается, ошибка формулы остаётся
+        sheet.SetCell("B3"_pos, "=SUM(A2:A1)");
+        ASSERT_EQUAL(value("B3"), div0);
+        sheet.SetCell("B4"_pos, "=MAX(A2,A1)");
+        ASSERT_EQUAL(value("B4"), div0);
+        sheet.SetCell("B5"_pos, "=AVERAGE(C1:C5)+A1");
+        ASSERT_EQUAL(value("B5"), div0);
+
+        // Ошибки передаются через цепочку формул
+        sheet.SetCell("C6"_pos, "=A2*0");
+        sheet.SetCell("C7"_pos, "=-C6");
+        ASSERT_EQUAL(value("C7"), div0);
+        sheet.SetCell("A2"_pos, "=2");
+        ASSERT_EQUAL(value("C7"), CellInterface::Value(0.0));
+    }
+
+    void TestFormulaOptimization() {
+        using ASTImpl::OpCode;
+        auto executable = [](std::string_view expr) {
+            const FormulaAST ast = ParseFormulaASTNative(expr);
+            std::vector<OpCode> codes;
+            for (const auto& instruction : ast.GetExecutableProgram()) {
+                codes.push_back(instruction.code);
+            }
+            return codes;
+        };
+
+        // Константы сворачиваются, унарный плюс убирается, печать не меняется
+        ASSERT(executable("1+2*3+A1") == (std::vector{OpCode::PushNumber, OpCode::LoadCell, OpCode::Add}));
+        ASSERT(executable("+A1") == std::vector{OpCode::LoadCell});
+        ASSERT(executable("-(1+2)") == std::vector{OpCode::PushNumber});
+        // Деление на ноль не сворачивается: ошибка возникает при вычислении
+        ASSERT(executable("1/0").size() == 3);
+        // Повторяющиеся подвыражения вычисляются один раз
+        ASSERT(executable("(A1+B1)*(A1+B1)") == (std::vector{OpCode::LoadCell, OpCode::LoadCell, OpCode::Add,
+                                                             OpCode::StoreLocal, OpCode::LoadLocal, OpCode::Multiply}));
+        ASSERT_EQUAL(executable("SUM(A1:B2)/SUM(B2:A1)").size(), 6u);
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "3");
+        sheet.SetCell("C1"_pos, "=+1+2*3+A1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=+1+2*3+A1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(9.0));
+        sheet.SetCell("C2"_pos, "=(A1+B1)*(A1+B1)-SUM(A1:B1)/SUM(A1:B1)");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(24.0));
+
+        // Оптимизированная формула вычисляется так же, как формула, в которой
+        // каждое число заменено ссылкой на ячейку с этим числом
+        sheet.SetCell("A2"_pos, "text");
+        sheet.SetCell("A3"_pos, "=1/0");
+        unsigned state = 12345;
+        auto next = [&state](unsigned bound) {
+            state = state * 1103515245u + 12345u;
+            return (state >> 16) % bound;
+        };
+        const std::string numbers[] = {"0", "1", "2", "0.5", "3", "1e200"};
+        const std::string cells[] = {"A1", "B1", "A2", "A3", "D1"};
+        int next_constant_row = 0;
+        std::function<void(int, std::string&, std::string&)> generate =
+                [&](int depth, std::string& optimized, std::string& reference) {
+            const unsigned kind = depth == 0 ? next(2) : next(7);
+            switch (kind) {
+                case 0: {
+                    const std::string& number = numbers[next(6)];
+                    const std::string cell = Position{next_constant_row++, 25}.ToString();
+                    sheet.SetCell(Position::FromString(cell), number);
+                    optimized += number;
+                    reference += cell;
+                    break;
+                }
+                case 1: {
+                    const std::string& cell = cells[next(5)];
+                    optimized += cell;
+                    reference += cell;
+                    break;
+                }
+                case 2:
+                case 3: {
+                    const char sign = "+-*/"[next(4)];
+                    optimized += '(';
+                    reference += '(';
+                    generate(depth - 1, optimized, reference);
+                    optimized += sign;
+                    reference += sign;
+                    generate(depth - 1, optimized, reference);
+                    optimized += ')';
+                    reference += ')';
+                    break;
+                }
+                case 4: {
+                    const char sign = "+-"[next(2)];
+                    optimized += sign;
+                    reference += sign;
+                    generate(depth - 1, optimized, reference);
+                    break;
+                }
+                case 5: {
+                    // Одно и то же подвыражение дважды
+                    std::string optimized_operand;
+                    std::string reference_operand;
+                    generate(depth - 1, optimized_operand, reference_operand);
+                    optimized += "(" + optimized_operand + ")*(" + optimized_operand + ")";
+                    reference += "(" + reference_operand + ")*(" + reference_operand + ")";
+                    break;
+                }
+                default: {
+                    const std::string function = next(2) == 0 ? "SUM(" : "MAX(";
+                    optimized += function;
+                    reference += function;
+                    generate(depth - 1, optimized, reference);
+                    const std::string range = next(2) == 0 ? ",A1:B1)" : ")";
+                    optimized += range;
+                    reference += range;
+                    break;
+                }
+            }
+        };
+
+        for (int i = 0; i < 500; ++i) {
+            std::string optimized = "=";
+            std::string reference = "=";
+            generate(4, optimized, reference);
+            sheet.SetCell("E1"_pos, optimized);
+            sheet.SetCell("E2"_pos, reference);
+            ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), sheet.GetCell("E2"_pos)->GetValue());
+            ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), ParseFormula(optimized.substr(1))->GetExpression().insert(0, "="));
+        }
+
+        // Перемещённая формула остаётся пустой, а не ссылается на чужой блок
+        FormulaAST source = ParseFormulaASTNative("SUM(A1:B2)+C3*2");
+        FormulaAST moved = std::move(source);
+        FormulaAST assigned = ParseFormulaASTNative("1");
+        assigned = std::move(moved);
+        for (const FormulaAST* empty : {&source, &moved}) {
+            ASSERT(empty->GetProgram().empty() && empty->GetExecutableProgram().empty());
+            ASSERT(empty->GetCells().empty() && empty->GetRanges().empty());
+            std::ostringstream printed;
+            empty->Print(printed);
+            empty->PrintFormula(printed);
+            ASSERT(printed.str().empty());
+        }
+        std::ostringstream printed;
+        assigned.PrintFormula(printed);
+        ASSERT_EQUAL(printed.str(), "SUM(A1:B2)+C3*2");
+        ASSERT_EQUAL(assigned.GetCells().size(), 1u);
+    }
+
+    void TestInsertDeleteRowsCols() {
+        const CellInterface::Value ref_error = FormulaError(FormulaError::Category::Ref);
+        {
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("A2"_pos, "2");
+            sheet.SetCell("A3"_pos, "=A1+A2");
+            sheet.SetCell("B5"_pos, "=SUM(A1:A3)");
+            sheet.SetCell("C1"_pos, "=A3*2");
+            sheet.SetCell("D1"_pos, "=SUM(A10:A20)");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+            // Вставка внутри диапазона расширяет его, ссылки за вставкой сдвигаются
+            sheet.InsertRows(1);
+            ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+            ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "2");
+            ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+A3");
+            ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=SUM(A1:A4)");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A4*2");
+            ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(A11:A21)");
+            ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(6.0));
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 4}));
+
+            // Новые ячейки вставленной строки попадают в расширенный диапазон
+            sheet.SetCell("A2"_pos, "10");
+            ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(16.0));
+            sheet.SetCell("A15"_pos, "7");
+            ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+            // Удаление ячейки, на которую ссылаются, даёт #REF!, диапазон сужается
+            sheet.DeleteRows(2);
+            ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A1+#REF!");
+            ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), ref_error);
+            ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=SUM(A1:A3)");
+            ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), ref_error);
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ref_error);
+            ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(A10:A20)");
+
+            // Формулу с #REF! можно сохранить в снимок и прочитать обратно
+            std::ostringstream snapshot;
+            sheet.SaveSnapshot(snapshot);
+            auto loaded = Sheet::LoadSnapshot(snapshot.str());
+            ASSERT_EQUAL(loaded->GetCell("A3"_pos)->GetText(), "=A1+#REF!");
+            ASSERT_EQUAL(loaded->GetCell("C1"_pos)->GetValue(), ref_error);
+
+            // Столбцы: диапазон, удалённый целиком, становится #REF!
+            sheet.SetCell("F1"_pos, "=SUM(D2:D3)+E1");
+            sheet.SetCell("E1"_pos, "5");
+            sheet.DeleteCols(3);
+            ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=SUM(#REF!)+D1");
+            ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), ref_error);
+            sheet.InsertCols(0, 2);
+            ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetText(), "=SUM(#REF!)+F1");
+            ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=C3*2");
+            ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=SUM(C1:C3)");
+        }
+        {
+            // Сдвинутые формулы остаются в порядке проверки циклов
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=B1");
+            sheet.InsertRows(0);
+            try {
+                sheet.SetCell("B2"_pos, "=A2");
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+            sheet.DeleteCols(0);
+            ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+
+            // Непустые ячейки не вытесняются за границу листа
+            sheet.SetCell({Position::MAX_ROWS - 1, 0}, "last");
+            try {
+                sheet.InsertRows(0);
+                ASSERT(false);
+            } catch (const InvalidPositionException&) {
+            }
+            sheet.DeleteRows(0, Position::MAX_ROWS);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+            // И пустые ячейки, на которые ссылаются формулы
+            sheet.SetCell("A1"_pos, "=" + Position{0, Position::MAX_COLS - 1}.ToString() + "+" +
+                                    Position{Position::MAX_ROWS - 2, 1}.ToString());
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+            try {
+                sheet.InsertCols(1);
+                ASSERT(false);
+            } catch (const InvalidPositionException&) {
+            }
+            sheet.InsertRows(1);
+            try {
+                sheet.InsertRows(1);
+                ASSERT(false);
+            } catch (const InvalidPositionException&) {
+            }
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        }
+        {
+            // Количество вставляемых строк (столбцов) ограничено границей листа
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=SUM(B1:B5)");
+            sheet.InsertRows(2, std::numeric_limits<int>::max());
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=SUM(B1:B16384)");
+            sheet.InsertCols(1, std::numeric_limits<int>::max());
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=SUM(#REF!)");
+            sheet.InsertRows(Position::MAX_ROWS - 1, std::numeric_limits<int>::max());
+            sheet.InsertCols(Position::MAX_COLS - 1, std::numeric_limits<int>::max());
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+        }
+        {
+            // Журнал изменений видит сдвиг как изменение затронутых позиций
+            Sheet sheet;
+            sheet.SetCell("A1"_pos, "=A2*2");
+            sheet.SetCell("A2"_pos, "3");
+            sheet.SetCell("B2"_pos, "=A2");
+            sheet.SetCell("C1"_pos, "=A1");
+            sheet.GetCell("C1"_pos)->GetValue();
+            sheet.GetCell("B2"_pos)->GetValue();
+            sheet.SetChangeTracking(true);
+            sheet.InsertRows(1);
+            const auto delta = sheet.TakeChanges();
+            ASSERT_EQUAL(delta.text_changed, (std::vector{"A1"_pos, "A2"_pos, "B2"_pos, "A3"_pos, "B3"_pos}));
+            ASSERT_EQUAL(delta.value_changed, (std::vector{"A2"_pos, "B2"_pos, "A3"_pos, "B3"_pos}));
+        }
+
+        // Лист после случайных вставок и удалений совпадает с листом, в который
+        // те же тексты записаны заново, в том числе после последующих изменений
+        unsigned state = 11;
+        auto next = [&state](int bound) {
+            state = state * 1103515245u + 12345u;
+            return static_cast<int>((state >> 16) % static_cast<unsigned>(bound));
+        };
+        auto random_formula = [&next]() {
+            const std::string a = Position{next(12), next(6)}.ToString();
+            const std::string b = Position{next(12), next(6)}.ToString();
+            return next(2) ? "=" + a + "+1" : "=SUM(" + Range::FromCorners(Position::FromString(a),
+                                                                           Position::FromString(b)).ToString() + ")";
+        };
+        Sheet sheet;
+        for (int i = 0; i < 150; ++i) {
+            const Position pos{next(12), next(6)};
+            try {
+                sheet.SetCell(pos, next(3) ? std::to_string(next(100)) : random_formula());
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        for (int step = 0; step < 30; ++step) {
+            switch (next(4)) {
+                case 0:
+                    sheet.InsertRows(next(14), 1 + next(2));
+                    break;
+                case 1:
+                    sheet.InsertCols(next(8), 1 + next(2));
+                    break;
+                case 2:
+                    sheet.DeleteRows(next(14), 1 + next(2));
+                    break;
+                default:
+                    sheet.DeleteCols(next(8), 1 + next(2));
+                    break;
+            }
+
+            Sheet expected;
+            const Size size = sheet.GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    const auto* cell = sheet.GetCell({row, col});
+                    if (cell && cell->GetText().find("#REF!") == std::string::npos) {
+                        expected.SetCell({row, col}, cell->GetText());
+                    } else if (cell && !cell->GetText().empty()) {
+                        expected.SetCell({row, col}, "=1/0");
+                        sheet.SetCell({row, col}, "=1/0");
+                    }
+                }
+            }
+            for (int i = 0; i < 5; ++i) {
+                const Position pos{next(20), next(10)};
+                const std::string text = next(2) ? std::to_string(next(100)) : random_formula();
+                bool cycle = false;
+                try {
+                    sheet.SetCell(pos, text);
+                } catch (const CircularDependencyException&) {
+                    cycle = true;
+                }
+                try {
+                    expected.SetCell(pos, text);
+                    ASSERT(!cycle);
+                } catch (const CircularDependencyException&) {
+                    ASSERT(cycle);
+                }
+            }
+
+            std::ostringstream values;
+            std::ostringstream expected_values;
+            sheet.PrintValues(values);
+            expected.PrintValues(expected_values);
+            ASSERT_EQUAL(values.str(), expected_values.str());
+            std::ostringstream texts;
+            std::ostringstream expected_texts;
+            sheet.PrintTexts(texts);
+            expected.PrintTexts(expected_texts);
+            ASSERT_EQUAL(texts.str(), expected_texts.str());
+        }
+    }
+
+    void TestFillAndCopyRange() {
+        const CellInterface::Value ref_error = FormulaError(FormulaError::Category::Ref);
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1*2+SUM(A1:A2)");
+        const size_t programs = sheet.GetFormulaCache().GetStats().programs;
+
+        // Протягивание формулы вниз: копии используют общую программу
+        sheet.FillRange(Range::FromCorners("B1"_pos, "B1"_pos), Range::FromCorners("B2"_pos, "B1000"_pos));
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().programs, programs);
+        ASSERT_EQUAL(sheet.GetCell("B500"_pos)->GetText(), "=A500*2+SUM(A500:A501)");
+        sheet.SetCell("A500"_pos, "3");
+        sheet.SetCell("A501"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("B500"_pos)->GetValue(), CellInterface::Value(13.0));
+        ASSERT_EQUAL(sheet.GetCell("B499"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        // Заполнение повторяет источник по строкам и столбцам
+        sheet.SetCell("D1"_pos, "x");
+        sheet.SetCell("E1"_pos, "=D1");
+        sheet.FillRange(Range::FromCorners("D1"_pos, "E1"_pos), Range::FromCorners("D3"_pos, "G4"_pos));
+        ASSERT_EQUAL(sheet.GetCell("F4"_pos)->GetText(), "x");
+        ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetText(), "=F3");
+        ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+        // Ссылки, вышедшие за пределы листа, становятся #REF!
+        sheet.SetCell("K2"_pos, "=J1+SUM(J1:K1)+K3");
+        sheet.CopyRange(Range::FromCorners("K2"_pos, "K2"_pos), "A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=#REF!+SUM(#REF!)+A2");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ref_error);
+
+        // Пустые ячейки источника очищают назначение, source и target могут пересекаться
+        sheet.SetCell("M1"_pos, "1");
+        sheet.SetCell("M2"_pos, "=M1+1");
+        sheet.CopyRange(Range::FromCorners("M1"_pos, "M3"_pos), "M2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("M2"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("M3"_pos)->GetText(), "=M2+1");
+        ASSERT(sheet.GetCell("M4"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("M3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // Копия, замыкающая цикл, не меняет лист
+        sheet.SetCell("S1"_pos, "=T1");
+        sheet.SetCell("W1"_pos, "=V1");
+        try {
+            sheet.CopyRange(Range::FromCorners("W1"_pos, "W1"_pos), "T1"_pos);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("T1"_pos)->GetText(), "");
+
+        // Назначение за пределами листа
+        try {
+            sheet.CopyRange(Range::FromCorners("A1"_pos, "A2"_pos), {Position::MAX_ROWS - 1, 0});
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        for (const Position target : {Position{std::numeric_limits<int>::max(), 0}, Position{0, std::numeric_limits<int>::max()}}) {
+            try {
+                sheet.CopyRange(Range::FromCorners("A1"_pos, "B2"_pos), target);
+                ASSERT(false);
+            } catch (const InvalidPositionException&) {
+            }
+        }
+    }
+
+    void TestChangeLog() {
+        using Positions = std::vector<Position>;
+        Sheet sheet;
+        sheet.SetChangeTracking(true);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        sheet.SetCell("D1"_pos, "=A1*0");
+        auto delta = sheet.TakeChanges();
+        ASSERT_EQUAL(delta.text_changed, (Positions{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+        ASSERT_EQUAL(delta.value_changed, (Positions{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+        ASSERT(sheet.TakeChanges().Empty());
+
+        // Значения формул сравниваются с прежними: D1 осталась нулём
+        sheet.SetCell("A1"_pos, "2");
+        delta = sheet.TakeChanges();
+        ASSERT_EQUAL(delta.text_changed, (Positions{"A1"_pos}));
+        ASSERT_EQUAL(delta.value_changed, (Positions{"A1"_pos, "B1"_pos, "C1"_pos}));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // Правки, вернувшие лист к прежнему виду, в журнал не попадают
+        sheet.SetCell("A1"_pos, "7");
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("E5"_pos, "tmp");
+        sheet.ClearCell("E5"_pos);
+        ASSERT(sheet.TakeChanges().Empty());
+
+        // Формула с другим текстом и тем же значением
+        sheet.SetCell("B1"_pos, "=A1+A1");
+        delta = sheet.TakeChanges();
+        ASSERT_EQUAL(delta.text_changed, (Positions{"B1"_pos}));
+        ASSERT(delta.value_changed.empty());
+
+        // Отменённая загрузка ничего не меняет
+        try {
+            sheet.SetCell("A1"_pos, "=C1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.LoadCells({{"J10"_pos, "=J11"}, {"J11"_pos, "=J10"}});
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(sheet.TakeChanges().Empty());
+
+        // Подписчики получают изменения каждого действия
+        std::vector<SheetDelta> deltas;
+        const size_t id = sheet.Subscribe([&deltas](const SheetDelta& change) {
+            deltas.push_back(change);
+        });
+        sheet.LoadCells({{"A2"_pos, "x"}, {"A1"_pos, "4"}});
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(deltas.size(), 2u);
+        ASSERT_EQUAL(deltas[0].text_changed, (Positions{"A1"_pos, "A2"_pos}));
+        ASSERT_EQUAL(deltas[0].value_changed, (Positions{"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos}));
+        ASSERT_EQUAL(deltas[1].text_changed, (Positions{"C1"_pos}));
+        ASSERT_EQUAL(deltas[1].value_changed, (Positions{"C1"_pos}));
+
+        sheet.Unsubscribe(id);
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(deltas.size(), 2u);
+        ASSERT_EQUAL(sheet.TakeChanges().value_changed, (Positions{"A1"_pos, "B1"_pos}));
+
+        // Выключенный журнал ничего не запоминает
+        sheet.SetChangeTracking(false);
+        sheet.SetCell("A1"_pos, "6");
+        ASSERT(sheet.TakeChanges().Empty());
+    }
+
+    void TestOccupancyIndex() {
+        Sheet sheet;
+        // Пустые ячейки, созданные ссылками формулы, в печатную область не входят
+        sheet.SetCell("B2"_pos, "=Z100+SUM(C3:AA200)");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+        ASSERT_EQUAL(sheet.GetOccupancy().GetRowCount(1), 1u);
+        ASSERT_EQUAL(sheet.GetOccupancy().GetColCount(25), 0u);
+
+        // Граница отступает к последней непустой строке и столбцу
+        sheet.SetCell("E3"_pos, "x");
+        sheet.SetCell("C7"_pos, "=1");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{7, 5}));
+        sheet.ClearCell("C7"_pos);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 5}));
+        sheet.SetCell("E3"_pos, "");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+
+        // Отменённая пакетная загрузка не меняет счётчики
+        try {
+            sheet.LoadCells({{"J10"_pos, "=J11"}, {"J11"_pos, "=J10"}});
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+
+        // Случайные изменения сверяются с полным обходом листа
+        unsigned state = 7;
+        auto next = [&state](int bound) {
+            state = state * 1103515245u + 12345u;
+            return static_cast<int>((state >> 16) % static_cast<unsigned>(bound));
+        };
+        for (int i = 0; i < 2000; ++i) {
+            const Position pos{next(20), next(20)};
+            switch (next(4)) {
+                case 0:
+                    sheet.ClearCell(pos);
+                    break;
+                case 1:
+                    sheet.SetCell(pos, "");
+                    break;
+                case 2:
+                    sheet.SetCell(pos, "text");
+                    break;
+                default:
+                    try {
+                        sheet.SetCell(pos, "=" + Position{next(25), next(25)}.ToString());
+                    } catch (const CircularDependencyException&) {
+                    }
+                    break;
+            }
+
+            Size expected;
+            for (int row = 0; row < 30; ++row) {
+                for (int col = 0; col < 30; ++col) {
+                    const auto* cell = sheet.GetCell({row, col});
+                    if (cell && !cell->GetText().empty()) {
+                        expected.rows = std::max(expected.rows, row + 1);
+                        expected.cols = std::max(expected.cols, col + 1);
+                    }
+                }
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), expected);
+        }
+    }
+
+    void TestSheetVersions() {
+        Sheet sheet;
+        ASSERT(!sheet.GetPublishedVersion());
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("CZ300"_pos, "=A1*2");
+        sheet.SetCell("B2"_pos, "'text");
+
+        const auto first = sheet.Publish();
+        ASSERT_EQUAL(first->GetNumber(), 1u);
+        ASSERT_EQUAL(sheet.GetPublishedVersion(), first);
+        ASSERT_EQUAL(first->GetCell("CZ300"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(first->GetCell("B2"_pos)->GetText(), "'text");
+        ASSERT_EQUAL(first->GetCell("CZ300"_pos)->GetReferencedCells(), std::vector<Position>{"A1"_pos});
+        ASSERT(first->GetCell("C3"_pos) == nullptr);
+        ASSERT_EQUAL(first->GetPrintableSize(), sheet.GetPrintableSize());
+
+        // Изменения не видны в опубликованной версии; зависимая ячейка в другом
+        // блоке попадает в следующую версию, а неизменённые блоки общие
+        sheet.SetCell("A1"_pos, "5");
+        sheet.ClearCell("B2"_pos);
+        sheet.SetCell("A5000"_pos, "far");
+        const auto second = sheet.Publish();
+        ASSERT_EQUAL(first->GetCell("CZ300"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(second->GetCell("CZ300"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT(first->GetCell("B2"_pos) != nullptr);
+        ASSERT(second->GetCell("B2"_pos) == nullptr);
+        ASSERT_EQUAL(second->GetPrintableSize(), (Size{5000, 104}));
+
+        sheet.SetCell("A5000"_pos, "near");
+        const auto third = sheet.Publish();
+        ASSERT_EQUAL(third->GetCell("CZ300"_pos), second->GetCell("CZ300"_pos));
+        ASSERT_EQUAL(third->GetCell("A1"_pos), second->GetCell("A1"_pos));
+        ASSERT(third->GetCell("A5000"_pos) != second->GetCell("A5000"_pos));
+
+        std::ostringstream live;
+        std::ostringstream published;
+        sheet.PrintValues(live);
+        third->PrintValues(published);
+        ASSERT_EQUAL(published.str(), live.str());
+
+        // Читатели всегда видят согласованную версию: все ячейки столбца A
+        // равны, а сумма соответствует им, хотя писатель меняет их по одной
+        constexpr int rows = 100;
+        sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, "0");
+        }
+        sheet.Publish();
+
+        std::atomic<bool> done = false;
+        std::atomic<size_t> checked = 0;
+        std::atomic<bool> consistent = true;
+        auto read = [&] {
+            while (!done) {
+                const auto version = sheet.GetPublishedVersion();
+                const std::string text = version->GetCell("A1"_pos)->GetText();
+                for (int row = 0; row < rows; ++row) {
+                    if (version->GetCell({row, 0})->GetText() != text) {
+                        consistent = false;
+                    }
+                }
+                if (!(version->GetCell("B1"_pos)->GetValue() == CellInterface::Value(std::stod(text) * rows))) {
+                    consistent = false;
+                }
+                ++checked;
+            }
+        };
+        std::thread first_reader(read);
+        std::thread second_reader(read);
+        for (int edit = 1; edit <= 200; ++edit) {
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({row, 0}, std::to_string(edit));
+            }
+            sheet.Publish();
+        }
+        done = true;
+        first_reader.join();
+        second_reader.join();
+        ASSERT(consistent);
+        ASSERT(checked > 0);
+        ASSERT_EQUAL(sheet.GetPublishedVersion()->GetCell("B1"_pos)->GetValue(), CellInterface::Value(200.0 * rows));
+    }
+
+    void TestConcurrentEvaluation() {
+        // Двоичное дерево формул: ячейка i складывает ячейки 2i и 2i+1,
+        // листья зависят от A1, поэтому изменение A1 сбрасывает всё дерево
+        constexpr int size = 1 << 12;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int node = 1; node < size; ++node) {
+            const int left = 2 * node;
+            sheet.SetCell({node, 1}, left + 1 < size
+                                     ? "=B" + std::to_string(left + 1) + "+B" + std::to_string(left + 2)
+                                     : "=A1+" + std::to_string(node));
+        }
+        sheet.GetCell("B2"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetRecalcStats().invalidated, static_cast<size_t>(size - 1));
+
+        // Потоки читают дерево в разном порядке; каждая формула вычисляется один раз
+        const Sheet& reader = sheet;
+        std::vector<std::thread> threads;
+        std::atomic<bool> correct = true;
+        for (int thread = 0; thread < 4; ++thread) {
+            threads.emplace_back([&reader, &correct, thread] {
+                for (int i = 0; i < size - 1; ++i) {
+                    const int node = 1 + (i * (2 * thread + 1) + thread * 997) % (size - 1);
+                    const auto value = reader.GetCell({node, 1})->GetNumericValue();
+                    if (!std::holds_alternative<double>(value)) {
+                        correct = false;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT(correct);
+        ASSERT_EQUAL(sheet.GetRecalcStats().recomputed, static_cast<size_t>(size - 1));
+
+        // Корень — сумма листьев: (size / 2) значений A1 + node для node из [size / 2, size)
+        const double leaves = size / 2.0;
+        const double expected = leaves * 2 + (leaves * (size / 2 + size - 1)) / 2;
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(expected));
+    }
+
+    void TestSharedFormulas() {
+        // Текст формулы не зависит от положения ячейки, если ссылки записаны относительно неё
+        ASSERT_EQUAL(NormalizeFormulaText("A1*B1 + SUM(A1:B2)", "C1"_pos),
+                     NormalizeFormulaText("A2 * B2+SUM(A2:B3)", "C2"_pos));
+        ASSERT(NormalizeFormulaText("A1*B1", "C1"_pos) != NormalizeFormulaText("A1*B1", "C2"_pos));
+        ASSERT(NormalizeFormulaText("A1+1", "C1"_pos) != NormalizeFormulaText("A1+10", "C1"_pos));
+
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "2");
+            sheet.SetCell({row, 2}, "=A" + r + "*B" + r + "+SUM(A" + r + ":B" + r + ")");
+        }
+        // Ссылки формул только относительные: диапазон от A1 у каждой строки свой
+        sheet.SetCell("C101"_pos, "=SUM(A1:A100)");
+        auto stats = sheet.GetFormulaCache().GetStats();
+        ASSERT_EQUAL(stats.lookups, 101u);
+        ASSERT_EQUAL(stats.hits, 99u);
+        ASSERT_EQUAL(stats.programs, 2u);
+
+        for (int row = 0; row < 100; ++row) {
+            const std::string r = std::to_string(row + 1);
+            const auto* cell = sheet.GetCell({row, 2});
+            ASSERT_EQUAL(cell->GetText(), "=A" + r + "*B" + r + "+SUM(A" + r + ":B" + r + ")");
+            ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(row * 3.0 + 2));
+            ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector<Position>{{row, 0}, {row, 1}}));
+        }
+        sheet.SetCell("A100"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(32.0));
+        ASSERT_EQUAL(sheet.GetCell("C99"_pos)->GetValue(), CellInterface::Value(98 * 3.0 + 2));
+
+        // Пакетная загрузка разбирает формулы параллельно через тот же кэш
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < 100; ++row) {
+            cells.emplace_back(Position{row, 3}, "=C" + std::to_string(row + 1) + "/B" + std::to_string(row + 1));
+        }
+        sheet.LoadCells(std::move(cells), 4);
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().programs, 3u);
+        ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetValue(), CellInterface::Value(16.0));
+
+        // Программа удаляется из кэша вместе с последней использующей её формулой
+        for (int row = 0; row < 100; ++row) {
+            sheet.ClearCell({row, 3});
+        }
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().programs, 2u);
+
+        // Ошибки разбора не зависят от кэша
+        try {
+            sheet.SetCell("E3"_pos, "=A1+");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+#ifdef SPREADSHEET_WITH_ANTLR
+    void TestFormulaParsersAgree() {
+        const std::vector<std::string> corpus = {
+                "1", "  -1  ", "2 + 2*2", "(2*3)-4", "( ( (  1) ) )", "1e+200/1e-200",
+                ".5+1.25e1", "-+-A1*2", "A1+A2+A1+A3", "(12+13) * (14+(13-24/(1+1))*55-46)",
+                "1-(2-3)-4", "1/(2/3)", "XFD16384", "", "1.", "1e", "1 2", "A2B", "3X",
+                "A0++", "((1)", "2+4-", "=1", "R2D2", "ZZZZ1", "a1",
+                "SUM(A1:B2)", "AVERAGE(B2:A1, 3*C4, -A1) / COUNT(A1:A1)", "MIN(1,MAX(A2*3,2))",
+                "SUM()", "SUM(A1:)", "SUM(A1:B2+1)", "A1:B2", "SUMX(A1)", "SUM(A1 B2)",
+        };
+
+        auto describe = [](std::string_view expr, FormulaParserBackend backend) -> std::string {
+            try {
+                auto ast = ParseFormulaAST(expr, backend);
+                std::ostringstream out;
+                ast.Print(out);
+                out << " | ";
+                ast.PrintFormula(out);
+                out << " | ";
+                ast.PrintCells(out);
+                return out.str();
+            } catch (const std::exception&) {
+                return "error";
+            }
+        };
+
+        for (const auto& expr : corpus) {
+            ASSERT_EQUAL(describe(expr, FormulaParserBackend::Native),
+                         describe(expr, FormulaParserBackend::Antlr));
+        }
+    }
+#endif
+}  // namespace
+
+
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionPackedAndBatch);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TEST10);
+    RUN_TEST(tr, TestCacheInvalidation);
+    RUN_TEST(tr, TestNativeFormulaParser);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestCellStorageTiles);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeDependencyIndex);
+    RUN_TEST(tr, TestIncrementalCycleDetection);
+    RUN_TEST(tr, TestBatchLoad);
+    RUN_TEST(tr, TestCsv);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestNumericValue);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestFormulaOptimization);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestOccupancyIndex);
+    RUN_TEST(tr, TestSheetVersions);
+    RUN_TEST(tr, TestConcurrentEvaluation);
+    RUN_TEST(tr, TestChangeLog);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestFillAndCopyRange);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParsersAgree);
+#endif
+    return 0;
+}
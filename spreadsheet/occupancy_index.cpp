@@ -0,0 +1,42 @@
+#include "occupancy_index.h"
+
+#include <cassert>
+
+void OccupancyIndex::Add(Position pos) {
+    Increment(row_counts_, pos.row);
+    Increment(col_counts_, pos.col);
+}
+
+void OccupancyIndex::Remove(Position pos) {
+    Decrement(row_counts_, pos.row);
+    Decrement(col_counts_, pos.col);
+}
+
+std::uint32_t OccupancyIndex::GetRowCount(int row) const {
+    return static_cast<size_t>(row) < row_counts_.size() ? row_counts_[row] : 0;
+}
+
+std::uint32_t OccupancyIndex::GetColCount(int col) const {
+    return static_cast<size_t>(col) < col_counts_.size() ? col_counts_[col] : 0;
+}
+
+void OccupancyIndex::Increment(std::vector<std::uint32_t>& counts, int index) {
+    const auto i = static_cast<size_t>(index);
+    if (i >= counts.size()) {
+        counts.resize(i + 1);
+    }
+    ++counts[i];
+}
+
+void OccupancyIndex::Decrement(std::vector<std::uint32_t>& counts, int index) {
+    const auto i = static_cast<size_t>(index);
+    assert(i < counts.size() && counts[i] > 0);
+    --counts[i];
+
+    // Пустые строки в конце отбрасываются: граница сдвигается к последней непустой
+    size_t size = counts.size();
+    while (size > 0 && counts[size - 1] == 0) {
+        --size;
+    }
+    counts.resize(size);
+}
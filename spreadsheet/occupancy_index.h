@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+/// Количество непустых ячеек в каждой строке и в каждом столбце листа.
+/// Счётчики обновляются при каждом изменении ячейки, поэтому размер печатной
+/// области известен за O(1). Когда пустеет крайняя строка (столбец), новая
+/// граница ищется просмотром счётчиков от неё к началу листа
+class OccupancyIndex {
+public:
+    void Add(Position pos);
+    void Remove(Position pos);
+
+    /// Минимальная область, начинающаяся с A1 и содержащая все непустые ячейки
+    [[nodiscard]] Size GetPrintableSize() const {
+        return {static_cast<int>(row_counts_.size()), static_cast<int>(col_counts_.size())};
+    }
+    [[nodiscard]] std::uint32_t GetRowCount(int row) const;
+    [[nodiscard]] std::uint32_t GetColCount(int col) const;
+
+private:
+    /// Счётчики хранятся только до последней непустой строки (столбца),
+    /// так что размер вектора и есть граница печатной области
+    std::vector<std::uint32_t> row_counts_;
+    std::vector<std::uint32_t> col_counts_;
+
+    static void Increment(std::vector<std::uint32_t>& counts, int index);
+    static void Decrement(std::vector<std::uint32_t>& counts, int index);
+};
@@ -1,163 +1,808 @@
-#include "sheet.h"
-
-#include "cell.h"
-#include "common.h"
-
-#include <algorithm>
-#include <functional>
-#include <iostream>
-#include <optional>
-
-using namespace std::literals;
-
-void Sheet::SetCell(Position pos, std::string text) {
-    ThrowIfInvalidPosition(pos);
-
-    auto newRowSize = std::max(pos.row + 1, static_cast<int>(cells_.size()));
-    cells_.resize(newRowSize);
-    auto newColSize = std::max(pos.col + 1, static_cast<int>(cells_[pos.row].size()));
-    cells_[pos.row].resize(newColSize);
-
-    auto& cell = cells_[pos.row][pos.col];
-
-    if (!cell) {
-        cell = std::make_unique<Cell>(*this);
-    }
-    cell->Set(std::move(text));
-}
-
-CellInterface* Sheet::GetCell(Position pos) {
-    ThrowIfInvalidPosition(pos);
-
-    if (pos.row < static_cast<int>(cells_.size()) &&
-        pos.col < static_cast<int>(cells_[pos.row].size())) {
-        auto& cell = cells_[pos.row][pos.col];
-        if (!cell->GetText().empty()) {
-            return cell.get();
-        }
-    }
-
-    return nullptr;
-}
-
-const CellInterface* Sheet::GetCell(Position pos) const {
-    ThrowIfInvalidPosition(pos);
-
-    if (pos.row < static_cast<int>(cells_.size()) &&
-        pos.col < static_cast<int>(cells_[pos.row].size())) {
-        auto& cell = cells_[pos.row][pos.col];
-        if (!cell->GetText().empty()) {
-            return cell.get();
-        }
-    }
-
-    return nullptr;
-}
-
-Cell* Sheet::GetCellNotInterface(Position pos) {
-    ThrowIfInvalidPosition(pos);
-
-    if (pos.row < static_cast<int>(cells_.size()) && pos.col < static_cast<int>(cells_[pos.row].size())) {
-        return cells_[pos.row][pos.col].get();
-    }
-
-    return nullptr;
-}
-
-const Cell* Sheet::GetCellNotInterface(Position pos) const {
-    ThrowIfInvalidPosition(pos);
-
-    if (pos.row < static_cast<int>(cells_.size()) && pos.col < static_cast<int>(cells_[pos.row].size())) {
-        return cells_[pos.row][pos.col].get();
-    }
-
-    return nullptr;
-}
-
-void Sheet::ClearCell(Position pos) {
-    ThrowIfInvalidPosition(pos);
-
-    const auto row = static_cast<size_t>(pos.row);
-    const auto col = static_cast<size_t>(pos.col);
-
-    if (row < cells_.size() && col < cells_[row].size()) {
-        auto& cell = cells_[row][col];
-        if (cell) {
-            cell->Clear();
-            if (!cell->IsReferenced()) {
-                cell.reset();
-            }
-        }
-    }
-}
-
-Size Sheet::GetPrintableSize() const {
-    Size size;
-
-    for (int row = 0; row < static_cast<int>(cells_.size()); ++row) {
-        const auto& rowCells = cells_[row];
-        for (int col = static_cast<int>(rowCells.size() - 1); col >= 0; --col) {
-            auto& cell = rowCells[col];
-            if (cell && !cell->GetText().empty()) {
-                size.rows = std::max(size.rows, row + 1);
-                size.cols = std::max(size.cols, col + 1);
-                break;
-            }
-        }
-    }
-
-    return size;
-}
-
-void Sheet::PrintValues(std::ostream& output) const {
-    Size printableSize = GetPrintableSize();
-
-    for (int row = 0; row < printableSize.rows; ++row) {
-        for (int col = 0; col < printableSize.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
-            }
-
-            if (col < static_cast<int>(cells_[row].size())) {
-                auto& cell = cells_[row][col];
-                if (cell) {
-                    std::visit([&output] (const auto& obj) {
-                        output << obj;
-                    }, cell->GetValue());
-                }
-            }
-        }
-
-        output << '\n';
-    }
-}
-
-void Sheet::PrintTexts(std::ostream& output) const {
-    Size printableSize = GetPrintableSize();
-
-    for (int row = 0; row < printableSize.rows; ++row) {
-        for (int col = 0; col < printableSize.cols; ++col) {
-            if (col > 0) {
-                output << '\t';
-            }
-
-            if (col < static_cast<int>(cells_[row].size())) {
-                auto& cell = cells_[row][col];
-                if (cell) {
-                    output << cell->GetText();
-                }
-            }
-        }
-
-        output << '\n';
-    }
-}
-
-void Sheet::ThrowIfInvalidPosition(Position pos) const {
-    if (!pos.IsValid())
-        throw InvalidPositionException("invalid position" + pos.ToString());
-}
-
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
-}
+#include "sheet.h"
+
+#include "cell.h"
+#include "common.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <unordered_map>
+
+using namespace std::literals;
+
+Sheet::Sheet() : cells_(*this) {}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    if (batch_) {
+        ThrowIfInvalidPosition(pos);
+        batch_->push_back({pos, std::move(text)});
+        return;
+    }
+
+    Cell* cell = GetOrCreateCell(pos);
+
+    ResetRecalcStats();
+    cell->Set(std::move(text));
+    recalc_stats_.invalidated = cell->InvalidateDependentCaches();
+    NotifySubscribers();
+}
+
+Cell* Sheet::GetOrCreateCell(Position pos) {
+    ThrowIfInvalidPosition(pos);
+
+    return cells_.GetOrCreate(pos);
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    return GetCellNotInterface(pos);
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    return GetCellNotInterface(pos);
+}
+
+Cell* Sheet::GetCellNotInterface(Position pos) {
+    ThrowIfInvalidPosition(pos);
+
+    return cells_.Get(pos);
+}
+
+const Cell* Sheet::GetCellNotInterface(Position pos) const {
+    ThrowIfInvalidPosition(pos);
+
+    return cells_.Get(pos);
+}
+
+void Sheet::ClearCell(Position pos) {
+    ThrowIfInvalidPosition(pos);
+
+    if (batch_) {
+        batch_->push_back({pos, std::nullopt});
+        return;
+    }
+
+    Cell* cell = cells_.Get(pos);
+    if (cell) {
+        ResetRecalcStats();
+        cell->Clear();
+        recalc_stats_.invalidated = cell->InvalidateDependentCaches();
+        if (!cell->IsReferenced()) {
+            cells_.Erase(pos);
+        }
+        NotifySubscribers();
+    }
+}
+
+Size Sheet::GetPrintableSize() const {
+    return occupancy_.GetPrintableSize();
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (before < 0 || before >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("invalid rows to insert");
+    }
+    // Больше строк, чем осталось до границы листа, вставлять незачем: все
+    // сдвигаемые ячейки и так выйдут за неё
+    count = std::min(count, Position::MAX_ROWS - before);
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    if (count > 0 && HasStoredCells({{Position::MAX_ROWS - count, 0}, last})) {
+        throw InvalidPositionException("inserted rows would push cells off the sheet");
+    }
+    ApplyShift({SheetShift::Axis::Rows, before, count});
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    if (first < 0 || first >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("invalid rows to delete");
+    }
+    ApplyShift({SheetShift::Axis::Rows, first, -std::min(count, Position::MAX_ROWS - first)});
+}
+
+void Sheet::InsertCols(int before, int count) {
+    if (before < 0 || before >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("invalid columns to insert");
+    }
+    count = std::min(count, Position::MAX_COLS - before);
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    if (count > 0 && HasStoredCells({{0, Position::MAX_COLS - count}, last})) {
+        throw InvalidPositionException("inserted columns would push cells off the sheet");
+    }
+    ApplyShift({SheetShift::Axis::Cols, before, count});
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    if (first < 0 || first >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("invalid columns to delete");
+    }
+    ApplyShift({SheetShift::Axis::Cols, first, -std::min(count, Position::MAX_COLS - first)});
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintValues(output, CsvFormat::Tsv());
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintTexts(output, CsvFormat::Tsv());
+}
+
+void Sheet::PrintValues(std::ostream& output, CsvFormat format) const {
+    Size printableSize = GetPrintableSize();
+    CsvWriter writer(output, format);
+
+    for (int row = 0; row < printableSize.rows; ++row) {
+        for (int col = 0; col < printableSize.cols; ++col) {
+            const Cell* cell = cells_.Get({row, col});
+            if (cell) {
+                writer.WriteValue(cell->GetValue());
+            } else {
+                writer.WriteEmpty();
+            }
+        }
+
+        writer.EndRecord();
+    }
+}
+
+void Sheet::PrintTexts(std::ostream& output, CsvFormat format) const {
+    Size printableSize = GetPrintableSize();
+    CsvWriter writer(output, format);
+
+    for (int row = 0; row < printableSize.rows; ++row) {
+        for (int col = 0; col < printableSize.cols; ++col) {
+            const Cell* cell = cells_.Get({row, col});
+            if (cell) {
+                writer.WriteText(cell->GetText());
+            } else {
+                writer.WriteEmpty();
+            }
+        }
+
+        writer.EndRecord();
+    }
+}
+
+void Sheet::RecalculateAll(size_t threads) {
+    cells_.ForEach([](Position, Cell& cell) {
+        if (cell.IsFormula()) {
+            cell.InvalidateCache();
+        }
+    });
+
+    size_t formula_count = 0;
+    auto levels = GetFormulaLevels(formula_count);
+    ResetRecalcStats({formula_count, formula_count});
+
+    // Уровни обрабатываются по очереди: к началу уровня все ячейки, на которые
+    // ссылаются его формулы, уже вычислены, и потоки только читают их кэш
+    ThreadPool pool(threads);
+    for (const auto& level : levels) {
+        pool.ParallelFor(level.size(), [&level](size_t i) {
+            level[i]->Recalculate();
+        });
+    }
+}
+
+std::shared_ptr<const SheetVersion> Sheet::Publish() {
+    auto version = std::make_shared<SheetVersion>();
+    if (published_number_ == 0) {
+        // Первая публикация строит все блоки
+        cells_.ForEach([this](Position pos, const Cell&) {
+            changed_tiles_.insert(Position{pos.row / CellStorage::TILE_SIZE, pos.col / CellStorage::TILE_SIZE}.Pack());
+        });
+    } else {
+        version->tiles_ = published_->tiles_;
+    }
+
+    for (const std::uint32_t key : changed_tiles_) {
+        const Position tile = Position::Unpack(key);
+        const auto tile_row = static_cast<size_t>(tile.row);
+        const auto tile_col = static_cast<size_t>(tile.col);
+        version->SetTile(tile_row, tile_col, SheetVersion::BuildTile(cells_, tile_row, tile_col));
+    }
+    changed_tiles_.clear();
+
+    version->printable_size_ = occupancy_.GetPrintableSize();
+    version->number_ = ++published_number_;
+
+    std::shared_ptr<const SheetVersion> result = std::move(version);
+    std::atomic_store(&published_, result);
+    return result;
+}
+
+std::shared_ptr<const SheetVersion> Sheet::GetPublishedVersion() const {
+    return std::atomic_load(&published_);
+}
+
+void Sheet::SetChangeTracking(bool enabled) {
+    change_log_.SetEnabled(enabled || !subscribers_.empty());
+}
+
+SheetDelta Sheet::TakeChanges() {
+    return change_log_.Take(*this);
+}
+
+size_t Sheet::Subscribe(ChangeCallback callback) {
+    change_log_.SetEnabled(true);
+    subscribers_.emplace_back(next_subscription_, std::move(callback));
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(), [id](const auto& subscriber) {
+        return subscriber.first == id;
+    }), subscribers_.end());
+}
+
+void Sheet::NotifySubscribers() {
+    if (subscribers_.empty() || !change_log_.HasRecords()) {
+        return;
+    }
+
+    const SheetDelta delta = change_log_.Take(*this);
+    if (delta.Empty()) {
+        return;
+    }
+    // Подписчик может отписаться во время оповещения
+    const auto subscribers = subscribers_;
+    for (const auto& [id, callback] : subscribers) {
+        callback(delta);
+    }
+}
+
+void Sheet::RecordCellState(Position pos) {
+    if (const Cell* cell = cells_.Get(pos)) {
+        cell->RecordInChangeLog();
+    } else {
+        change_log_.RecordEdit(pos, {}, CellInterface::Value{});
+    }
+}
+
+void Sheet::ApplyShift(const SheetShift& shift) {
+    if (batch_) {
+        throw std::logic_error("rows and columns cannot be inserted or deleted during a batch");
+    }
+    if (shift.count == 0) {
+        return;
+    }
+
+    // Шаг 1: Ячейки, которые сдвигаются или удаляются
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    const Range region = shift.axis == SheetShift::Axis::Rows ? Range{{shift.first, 0}, last}
+                                                              : Range{{0, shift.first}, last};
+    std::vector<Position> moved;
+    cells_.ForEachInRange(region, [&moved](Position pos, const Cell&) {
+        moved.push_back(pos);
+    });
+
+    // Шаг 2: Формулы, которые сдвигаются сами или ссылаются на сдвигаемые ячейки.
+    // На каждую ячейку, указанную в формуле отдельно, есть ячейка в хранилище,
+    // а диапазоны могут задевать область и одними пустыми ячейками
+    std::vector<Position> affected;
+    for (Position pos : moved) {
+        if (cells_.Get(pos)->IsFormula()) {
+            affected.push_back(pos);
+        }
+        dependencies_.ForEachCellDependent(pos, [&affected](Position dependent) {
+            affected.push_back(dependent);
+        });
+    }
+    dependencies_.ForEachRangeReference(shift, [&affected](Position dependent, const Range&) {
+        affected.push_back(dependent);
+    });
+    std::sort(affected.begin(), affected.end());
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+
+    // Шаг 3: Переписываем ссылки затронутых формул и убираем их старые ссылки из индекса
+    struct Rewrite {
+        Position from;
+        Position to;
+        std::unique_ptr<Cell::Impl> impl;    /// nullptr, если ссылки формулы не изменились
+    };
+    std::vector<Rewrite> rewrites;
+    rewrites.reserve(affected.size());
+    for (Position pos : affected) {
+        const Cell* cell = cells_.Get(pos);
+        rewrites.push_back({pos, shift.Apply(pos), cell->impl_->Shift(shift)});
+        dependencies_.Remove(pos, cell->GetReferencedCells(), cell->GetReferencedRanges());
+    }
+
+    if (change_log_.IsEnabled()) {
+        for (Position pos : moved) {
+            RecordCellState(pos);
+            if (const Position to = shift.Apply(pos); to.IsValid()) {
+                RecordCellState(to);
+            }
+        }
+        for (const Rewrite& rewrite : rewrites) {
+            RecordCellState(rewrite.from);
+        }
+    }
+
+    // Шаг 4: Переносим содержимое ячеек. Сначала область освобождается целиком:
+    // новое место одной ячейки может быть старым местом другой
+    std::vector<std::pair<Position, std::unique_ptr<Cell::Impl>>> contents;
+    contents.reserve(moved.size());
+    for (Position pos : moved) {
+        Cell* cell = cells_.Get(pos);
+        if (cell->impl_->GetType() != CellType::EMPTY) {
+            occupancy_.Remove(pos);
+        }
+        contents.emplace_back(shift.Apply(pos), std::move(cell->impl_));
+        cells_.Erase(pos);
+    }
+    std::vector<Position> moved_empty;
+    for (auto& [pos, impl] : contents) {
+        if (!pos.IsValid()) {
+            continue;
+        }
+        if (impl->GetType() != CellType::EMPTY) {
+            occupancy_.Add(pos);
+        } else {
+            moved_empty.push_back(pos);
+        }
+        cells_.GetOrCreate(pos)->impl_ = std::move(impl);
+    }
+
+    // Шаг 5: Номера формул в топологическом порядке остаются прежними: ссылки
+    // ведут на те же ячейки, что и раньше, а ссылки на удалённые пропадают
+    std::vector<std::pair<Position, Position>> renames;
+    for (const Rewrite& rewrite : rewrites) {
+        if (!(rewrite.from == rewrite.to)) {
+            renames.emplace_back(rewrite.from, rewrite.to);
+        }
+    }
+    formula_order_.Move(renames);
+
+    // Шаг 6: Ставим переписанные формулы и добавляем в индекс новые ссылки.
+    // Ячейки, на которые ссылаются формулы, уже есть: это те же ячейки, что и до сдвига
+    std::vector<Cell*> rewritten;
+    for (Rewrite& rewrite : rewrites) {
+        if (!rewrite.to.IsValid()) {
+            continue;
+        }
+        Cell* cell = cells_.Get(rewrite.to);
+        if (rewrite.impl) {
+            cell->impl_ = std::move(rewrite.impl);
+            MarkChanged(rewrite.to);
+            rewritten.push_back(cell);
+        }
+        dependencies_.Add(rewrite.to, cell->GetReferencedCells(), cell->GetReferencedRanges());
+    }
+
+    // Пустая ячейка хранится, пока на неё ссылаются, а ссылавшиеся формулы могли быть удалены
+    for (Position pos : moved_empty) {
+        if (!cells_.Get(pos)->IsReferenced()) {
+            cells_.Erase(pos);
+        }
+    }
+
+    // Шаг 7: Значения переписанных формул вычисляются заново, а с ними и значения
+    // зависящих от них формул. Сдвинутые формулы с прежними ссылками сохраняют кэш
+    ResetRecalcStats({rewritten.size(), 0});
+    for (Cell* cell : rewritten) {
+        recalc_stats_.invalidated += cell->InvalidateDependentCaches();
+    }
+    NotifySubscribers();
+}
+
+bool Sheet::HasStoredCells(const Range& range) const {
+    bool found = false;
+    cells_.ForEachInRange(range, [&found](Position, const Cell&) {
+        found = true;
+    });
+    return found;
+}
+
+void Sheet::SetCycleDetection(CycleDetection mode) {
+    if (mode == cycle_detection_) {
+        return;
+    }
+
+    cycle_detection_ = mode;
+    RebuildFormulaOrder();
+}
+
+bool Sheet::RebuildFormulaOrder() {
+    formula_order_.Clear();
+
+    size_t formula_count = 0;
+    size_t ordered = 0;
+    for (const auto& level : GetFormulaLevels(formula_count)) {
+        ordered += level.size();
+        if (cycle_detection_ == CycleDetection::Incremental) {
+            for (const Cell* cell : level) {
+                formula_order_.Append(cell->GetPosition());
+            }
+        }
+    }
+    return ordered == formula_count;
+}
+
+bool Sheet::ReorderFormulas(const std::vector<Position>& roots) {
+    // Формулы, достижимые из roots по рёбрам к зависимым формулам. Остальные
+    // формулы от них не зависят, поэтому их место в порядке — после всех остальных
+    std::unordered_map<Position, size_t, PositionHasher> pending;
+    std::vector<Position> reached;
+    for (Position root : roots) {
+        if (pending.emplace(root, 0).second) {
+            reached.push_back(root);
+        }
+    }
+    for (size_t i = 0; i < reached.size(); ++i) {
+        dependencies_.ForEachDependent(reached[i], [&pending, &reached](Position dependent) {
+            if (pending.emplace(dependent, 0).second) {
+                reached.push_back(dependent);
+            }
+        });
+    }
+
+    // Алгоритм Кана по достигнутым формулам: рёбра к ним идут только от них же
+    // или от формул, которые остаются на своих местах впереди
+    for (Position pos : reached) {
+        dependencies_.ForEachDependent(pos, [&pending](Position dependent) {
+            ++pending[dependent];
+        });
+    }
+    std::vector<Position> ordered;
+    ordered.reserve(reached.size());
+    for (Position pos : reached) {
+        if (pending[pos] == 0) {
+            ordered.push_back(pos);
+        }
+    }
+    for (size_t i = 0; i < ordered.size(); ++i) {
+        dependencies_.ForEachDependent(ordered[i], [&pending, &ordered](Position dependent) {
+            if (--pending[dependent] == 0) {
+                ordered.push_back(dependent);
+            }
+        });
+    }
+    if (ordered.size() != reached.size()) {
+        return false;
+    }
+
+    if (cycle_detection_ == CycleDetection::Incremental) {
+        for (Position pos : ordered) {
+            formula_order_.Append(pos);
+        }
+    }
+    return true;
+}
+
+void Sheet::BeginBatch() {
+    if (!batch_) {
+        batch_.emplace();
+    }
+}
+
+void Sheet::CommitBatch(size_t threads) {
+    if (!batch_) {
+        return;
+    }
+
+    std::vector<BatchEntry> entries = std::move(*batch_);
+    batch_.reset();
+    ApplyBatch(std::move(entries), threads);
+}
+
+void Sheet::LoadCells(std::vector<std::pair<Position, std::string>> cells, size_t threads) {
+    if (batch_) {
+        throw std::logic_error("cells cannot be loaded during a batch");
+    }
+    std::vector<BatchEntry> entries;
+    entries.reserve(cells.size());
+    for (auto& [pos, text] : cells) {
+        entries.push_back({pos, std::move(text)});
+    }
+    ApplyBatch(std::move(entries), threads);
+}
+
+void Sheet::LoadCells(const CellProducer& producer, size_t threads) {
+    if (batch_) {
+        throw std::logic_error("cells cannot be loaded during a batch");
+    }
+    ThreadPool pool(threads);
+    std::vector<BatchEntry> entries;
+    size_t parsed = 0;
+    // Разобранный текст заменяется пустой строкой: запись остаётся установкой
+    // текста, а не очисткой, но память текста освобождается
+    auto parse_pending = [this, &pool, &entries, &parsed] {
+        pool.ParallelFor(entries.size() - parsed, [this, &entries, parsed](size_t i) {
+            BatchEntry& entry = entries[parsed + i];
+            entry.impl = Cell::CreateImplFromText(std::exchange(*entry.text, std::string()), entry.pos, *this);
+        });
+        parsed = entries.size();
+    };
+
+    producer([this, &entries, &parsed, &parse_pending](Position pos, std::string_view text) {
+        ThrowIfInvalidPosition(pos);
+        entries.push_back({pos, std::string(text)});
+        if (entries.size() - parsed == LOAD_CHUNK_CELLS) {
+            parse_pending();
+        }
+    });
+    parse_pending();
+    ApplyBatch(std::move(entries), threads);
+}
+
+void Sheet::ApplyBatch(std::vector<BatchEntry> entries, size_t threads) {
+    // Для каждой позиции действует последнее изменение
+    std::unordered_map<Position, size_t, PositionHasher> last_change;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ThrowIfInvalidPosition(entries[i].pos);
+        last_change[entries[i].pos] = i;
+    }
+    std::vector<BatchEntry*> changes;
+    changes.reserve(last_change.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (last_change.at(entries[i].pos) == i) {
+            changes.push_back(&entries[i]);
+        }
+    }
+
+    // Шаг 1: Разбираем тексты. Лист при этом не меняется, поэтому ошибка
+    // разбора просто прерывает загрузку
+    std::vector<std::unique_ptr<Cell::Impl>> impls(changes.size());
+    ThreadPool pool(threads);
+    pool.ParallelFor(changes.size(), [this, &changes, &impls](size_t i) {
+        if (changes[i]->impl) {
+            impls[i] = std::move(changes[i]->impl);
+            return;
+        }
+        impls[i] = Cell::CreateImplFromText(std::move(changes[i]->text).value_or(std::string()),
+                                               changes[i]->pos, *this);
+    });
+
+    // Шаг 2: Запоминаем ячейки, которых ещё нет, чтобы удалить их при откате
+    std::vector<Position> created;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        if (!cells_.Get(changes[i]->pos)) {
+            created.push_back(changes[i]->pos);
+        }
+        for (Position referenced : impls[i]->GetReferencedCells()) {
+            if (!cells_.Get(referenced)) {
+                created.push_back(referenced);
+            }
+        }
+    }
+
+    // Шаг 3: Связываем зависимости всех ячеек без проверки циклов
+    std::vector<std::unique_ptr<Cell::Impl>> old_impls(changes.size());
+    std::vector<Position> formulas;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        Cell* cell = cells_.GetOrCreate(changes[i]->pos);
+        old_impls[i] = cell->UpdateDependencies(std::move(impls[i]));
+        if (cell->IsFormula()) {
+            formulas.push_back(cell->GetPosition());
+        }
+    }
+
+    // Шаг 4: Строим порядок формул. До загрузки циклов не было, значит, каждый
+    // новый цикл проходит через одну из загруженных формул. Порядок остальных
+    // формул не меняется, поэтому заново упорядочиваются только загруженные
+    // формулы и зависящие от них. Лист, загруженный большей частью заново,
+    // дешевле упорядочить целиком
+    const bool rebuild = changes.size() * 2 >= cells_.GetCellCount();
+    if (!(rebuild ? RebuildFormulaOrder() : ReorderFormulas(formulas))) {
+        std::vector<Position> cycle_cells = FindCycleCells(formulas);
+        std::vector<Position> restored;
+        for (size_t i = changes.size(); i-- > 0;) {
+            Cell* cell = cells_.Get(changes[i]->pos);
+            cell->UpdateDependencies(std::move(old_impls[i]));
+            if (cell->IsFormula()) {
+                restored.push_back(cell->GetPosition());
+            }
+        }
+        for (Position pos : created) {
+            cells_.Erase(pos);
+        }
+        if (rebuild) {
+            RebuildFormulaOrder();
+        } else {
+            ReorderFormulas(restored);
+        }
+
+        std::string message = "circular dependency detected: ";
+        Position::AppendStrings(message, cycle_cells, ' ');
+        throw CircularDependencyException(message, std::move(cycle_cells));
+    }
+
+    // Шаг 5: Сбрасываем кэши ячеек, зависящих от загруженных
+    ResetRecalcStats();
+    for (const BatchEntry* change : changes) {
+        Cell* cell = cells_.Get(change->pos);
+        recalc_stats_.invalidated += cell->InvalidateDependentCaches();
+        if (!change->text && cell->impl_->GetType() == CellType::EMPTY && !cell->IsReferenced()) {
+            cells_.Erase(change->pos);
+        }
+    }
+    NotifySubscribers();
+}
+
+Sheet::BatchEntry Sheet::MakeCopyEntry(Position from, Position to) const {
+    const Cell* cell = cells_.Get(from);
+    if (!cell || cell->impl_->GetType() == CellType::EMPTY) {
+        return {to, std::nullopt, nullptr};
+    }
+    return {to, std::nullopt, cell->impl_->Copy({to.row - from.row, to.col - from.col})};
+}
+
+void Sheet::CopyRange(Range source, Position target, size_t threads) {
+    if (!source.IsValid()) {
+        throw InvalidPositionException("invalid range to copy");
+    }
+    ThrowIfInvalidPosition(target);
+    const Size size = source.GetSize();
+    FillRange(source, {target, {target.row + size.rows - 1, target.col + size.cols - 1}}, threads);
+}
+
+void Sheet::FillRange(Range source, Range target, size_t threads) {
+    if (!source.IsValid() || !target.IsValid()) {
+        throw InvalidPositionException("invalid range to fill");
+    }
+    if (batch_) {
+        throw std::logic_error("cells cannot be copied during a batch");
+    }
+
+    // Содержимое источника копируется до изменения листа, поэтому source и
+    // target могут пересекаться
+    const Size size = source.GetSize();
+    std::vector<BatchEntry> entries;
+    entries.reserve(static_cast<size_t>(target.GetSize().rows) * static_cast<size_t>(target.GetSize().cols));
+    for (int row = target.from.row; row <= target.to.row; ++row) {
+        for (int col = target.from.col; col <= target.to.col; ++col) {
+            const Position from{source.from.row + (row - target.from.row) % size.rows,
+                                source.from.col + (col - target.from.col) % size.cols};
+            entries.push_back(MakeCopyEntry(from, {row, col}));
+        }
+    }
+    ApplyBatch(std::move(entries), threads);
+}
+
+std::vector<Position> Sheet::FindCycleCells(const std::vector<Position>& roots) const {
+    struct Vertex {
+        size_t index = 0;
+        size_t low_link = 0;
+        bool on_stack = false;
+        bool self_loop = false;
+    };
+    /// Кадр обхода в глубину: вершина и её ещё не просмотренные зависимые формулы
+    struct Frame {
+        Position pos;
+        std::vector<Position> dependents;
+        size_t next = 0;
+    };
+
+    std::unordered_map<Position, Vertex, PositionHasher> vertices;
+    std::vector<Position> component_stack;
+    std::vector<Frame> frames;
+    std::vector<Position> cycle_cells;
+    size_t counter = 0;
+
+    auto enter = [&](Position pos) {
+        vertices[pos] = {counter, counter, true, false};
+        ++counter;
+        component_stack.push_back(pos);
+        frames.push_back({pos, dependencies_.GetDependents(pos), 0});
+    };
+
+    for (Position root : roots) {
+        if (vertices.count(root)) {
+            continue;
+        }
+
+        enter(root);
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+            if (frame.next < frame.dependents.size()) {
+                const Position dependent = frame.dependents[frame.next++];
+                Vertex& vertex = vertices.at(frame.pos);
+                if (dependent == frame.pos) {
+                    vertex.self_loop = true;
+                }
+
+                auto it = vertices.find(dependent);
+                if (it == vertices.end()) {
+                    enter(dependent);
+                } else if (it->second.on_stack) {
+                    vertex.low_link = std::min(vertex.low_link, it->second.index);
+                }
+                continue;
+            }
+
+            const Position pos = frame.pos;
+            frames.pop_back();
+            const Vertex& vertex = vertices.at(pos);
+
+            // Вершина — корень компоненты сильной связности: снимаем компоненту со стека
+            if (vertex.low_link == vertex.index) {
+                auto first = std::find(component_stack.rbegin(), component_stack.rend(), pos).base() - 1;
+                const bool cycle = component_stack.end() - first > 1 || vertex.self_loop;
+                for (auto it = first; it != component_stack.end(); ++it) {
+                    vertices.at(*it).on_stack = false;
+                    if (cycle) {
+                        cycle_cells.push_back(*it);
+                    }
+                }
+                component_stack.erase(first, component_stack.end());
+            }
+
+            if (!frames.empty()) {
+                Vertex& parent = vertices.at(frames.back().pos);
+                parent.low_link = std::min(parent.low_link, vertex.low_link);
+            }
+        }
+    }
+
+    std::sort(cycle_cells.begin(), cycle_cells.end());
+    return cycle_cells;
+}
+
+std::vector<std::vector<Cell*>> Sheet::GetFormulaLevels(size_t& formula_count) {
+    // Для каждой формулы считаем, от скольких ещё не вычисленных формул она зависит
+    std::unordered_map<const Cell*, size_t> pending;
+    std::vector<Cell*> formulas;
+
+    cells_.ForEach([&pending, &formulas](Position, Cell& cell) {
+        if (cell.IsFormula()) {
+            pending[&cell] = 0;
+            formulas.push_back(&cell);
+        }
+    });
+
+    // В индексе зависимостей есть только формулы, поэтому каждое ребро от
+    // формулы к зависящей от неё формуле учитывается ровно один раз
+    for (const Cell* cell : formulas) {
+        dependencies_.ForEachDependent(cell->GetPosition(), [this, &pending](Position dependent) {
+            ++pending[cells_.Get(dependent)];
+        });
+    }
+
+    formula_count = formulas.size();
+    std::vector<std::vector<Cell*>> levels(1);
+    for (Cell* cell : formulas) {
+        if (pending[cell] == 0) {
+            levels.back().push_back(cell);
+        }
+    }
+
+    while (!levels.back().empty()) {
+        std::vector<Cell*> next_level;
+        for (const Cell* cell : levels.back()) {
+            dependencies_.ForEachDependent(cell->GetPosition(), [this, &pending, &next_level](Position dependent) {
+                Cell* dependent_cell = cells_.Get(dependent);
+                if (--pending[dependent_cell] == 0) {
+                    next_level.push_back(dependent_cell);
+                }
+            });
+        }
+        levels.push_back(std::move(next_level));
+    }
+    levels.pop_back();
+
+    return levels;
+}
+
+RecalcStats Sheet::GetRecalcStats() const {
+    return {recalc_stats_.invalidated, recalc_stats_.recomputed + recomputed_.load(std::memory_order_relaxed)};
+}
+
+void Sheet::CountRecomputed() const {
+    recomputed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Sheet::ResetRecalcStats(RecalcStats stats) {
+    recalc_stats_ = stats;
+    recomputed_.store(0, std::memory_order_relaxed);
+}
+
+void Sheet::ThrowIfInvalidPosition(Position pos) const {
+    if (!pos.IsValid())
+        throw InvalidPositionException("invalid position" + pos.ToString());
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
+}
@@ -1,32 +1,251 @@
-#pragma once
-
-#include "cell.h"
-#include "common.h"
-
-#include <functional>
-#include <vector>
-
-
-class Sheet : public SheetInterface {
-public:
-    ~Sheet() override = default;
-
-    void SetCell(Position pos, std::string text) override;
-
-    CellInterface* GetCell(Position pos) override;
-    [[nodiscard]] const CellInterface* GetCell(Position pos) const override;
-    Cell* GetCellNotInterface(Position pos);
-    [[nodiscard]] const Cell* GetCellNotInterface(Position pos) const;
-
-    void ClearCell(Position pos) override;
-
-    [[nodiscard]] Size GetPrintableSize() const override;
-
-    void PrintValues(std::ostream& output) const override;
-    void PrintTexts(std::ostream& output) const override;
-
-private:
-    std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
-
-    void ThrowIfInvalidPosition(Position pos) const;
+#pragma once
+
+#include "cell.h"
+#include "cell_storage.h"
+#include "change_log.h"
+#include "common.h"
+#include "csv.h"
+#include "dependency_index.h"
+#include "formula.h"
+#include "occupancy_index.h"
+#include "sheet_version.h"
+#include "topological_order.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+/// Способ проверки циклических зависимостей при изменении формулы
+enum class CycleDetection {
+    Incremental,    /// по поддерживаемому топологическому порядку формул
+    FullSearch,     /// полным обходом зависимых ячеек, порядок не поддерживается
+};
+
+/// Статистика пересчёта, накопленная с момента последнего изменения листа
+struct RecalcStats {
+    size_t invalidated = 0;    /// ячеек, кэш которых был сброшен изменением
+    size_t recomputed = 0;     /// ячеек, значение которых было вычислено заново
+};
+
+class Sheet : public SheetInterface {
+public:
+    Sheet();
+    ~Sheet() override = default;
+
+    void SetCell(Position pos, std::string text) override;
+
+    CellInterface* GetCell(Position pos) override;
+    /// Пока лист не меняется, ячейки и их значения можно читать из многих потоков:
+    /// каждая формула вычисляется один раз, остальные потоки ждут её результата
+    [[nodiscard]] const CellInterface* GetCell(Position pos) const override;
+    Cell* GetCellNotInterface(Position pos);
+    [[nodiscard]] const Cell* GetCellNotInterface(Position pos) const;
+    Cell* GetOrCreateCell(Position pos);
+
+    void ClearCell(Position pos) override;
+
+    [[nodiscard]] Size GetPrintableSize() const override;
+
+    /// Вставка count строк (столбцов) перед before и удаление count строк
+    /// (столбцов), начиная с first. Ячейки за изменённым местом сдвигаются,
+    /// ссылки формул переписываются, ссылки на удалённые ячейки становятся #REF!.
+    /// Затрагиваются только ячейки, которые сдвигаются, и формулы, которые
+    /// ссылаются на них или на диапазоны, задевающие изменённое место.
+    /// Указатели на сдвинутые ячейки становятся недействительными.
+    /// Вставка бросает InvalidPositionException, если за границу листа вышли бы
+    /// непустые ячейки или ячейки, на которые ссылаются формулы. Во время
+    /// пакетной загрузки не выполняются
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    /// Печатают таблицу в формате TSV
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+    void PrintValues(std::ostream& output, CsvFormat format) const;
+    void PrintTexts(std::ostream& output, CsvFormat format) const;
+
+    /// Пакетная загрузка. Между BeginBatch и CommitBatch изменения SetCell и ClearCell
+    /// только накапливаются и не видны через GetCell, CommitBatch применяет их
+    /// разом так же, как LoadCells. Если применить пакет не удалось, он отбрасывается
+    void BeginBatch();
+    void CommitBatch(size_t threads = 0);
+    [[nodiscard]] bool IsBatchActive() const { return batch_.has_value(); }
+
+    /// Копирует ячейки source так, что левый верхний угол source попадает в
+    /// target. Ссылки формул сдвигаются вместе с ячейками, ссылки, вышедшие за
+    /// пределы листа, становятся #REF!. Формулы не разбираются заново: копии
+    /// используют скомпилированную программу источника. Пустые ячейки source
+    /// очищают ячейки назначения. Ячейки устанавливаются так же, как LoadCells:
+    /// зависимости связываются за один проход, при цикле лист не меняется.
+    /// Во время пакетной загрузки не выполняется
+    void CopyRange(Range source, Position target, size_t threads = 0);
+    /// Заполняет target, повторяя source по строкам и столбцам, как при
+    /// протягивании: FillRange(A1:A1, A2:A1000) копирует A1 в каждую ячейку A2:A1000
+    void FillRange(Range source, Range target, size_t threads = 0);
+
+    /// Устанавливает тексты ячеек за один проход: тексты разбираются параллельно
+    /// в threads потоках (0 — по числу ядер), зависимости связываются один раз,
+    /// а циклы ищутся одним обходом графа (алгоритм Тарьяна). Обход затрагивает
+    /// только загруженные формулы и зависящие от них, поэтому небольшая загрузка
+    /// в большой лист не перебирает все его формулы. Если позиция встречается
+    /// несколько раз, действует последний текст. При ошибке лист не меняется,
+    /// а CircularDependencyException перечисляет все ячейки циклов.
+    /// Во время пакетной загрузки не выполняется
+    void LoadCells(std::vector<std::pair<Position, std::string>> cells, size_t threads = 0);
+
+    /// Потоковый вариант LoadCells для больших входов: producer вызывает
+    /// add(pos, text) для каждой ячейки. Тексты разбираются порциями по
+    /// LOAD_CHUNK_CELLS по мере поступления, поэтому в памяти одновременно
+    /// держится одна порция текстов, а не весь вход. Зависимости связываются
+    /// и циклы ищутся один раз для всех ячеек, при ошибке лист не меняется
+    static constexpr size_t LOAD_CHUNK_CELLS = 1 << 16;
+    using CellConsumer = std::function<void(Position, std::string_view)>;
+    using CellProducer = std::function<void(const CellConsumer& add)>;
+    void LoadCells(const CellProducer& producer, size_t threads = 0);
+
+    /// Двоичный снимок листа: тексты ячеек, скомпилированные формулы и кэши
+    /// значений. Формат версионирован и рассчитан на чтение той же платформой
+    void SaveSnapshot(std::ostream& output) const;
+    void SaveSnapshotFile(const std::string& path) const;
+    /// Восстанавливает лист из снимка без разбора формул и без пересчёта:
+    /// зависимости связываются за один проход, кэши значений берутся из снимка.
+    /// Лист восстанавливается целиком до возврата, а не по мере обращения к
+    /// ячейкам: индексу зависимостей, порядку формул и печатной области нужны
+    /// ссылки всех формул сразу. Поэтому время загрузки пропорционально числу
+    /// ячеек — порядка 1–1.5 млн ячеек в секунду на одном ядре, то есть
+    /// несколько секунд на лист из 5 млн ячеек.
+    /// Бросает BinaryFormatException, если снимок повреждён или другой версии
+    static std::unique_ptr<Sheet> LoadSnapshot(std::string_view data);
+    static std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path);
+
+    /// Публикует текущее состояние листа как новую неизменяемую версию и
+    /// возвращает её. Значения формул при этом вычисляются. Заново строятся
+    /// только блоки ячеек, изменившиеся с прошлой публикации, остальные
+    /// блоки общие с прошлой версией. Вызывается тем же потоком, что меняет лист
+    std::shared_ptr<const SheetVersion> Publish();
+    /// Последняя опубликованная версия, nullptr до первой публикации. В отличие
+    /// от остальных методов листа может вызываться из любых потоков одновременно
+    /// с изменениями листа и публикацией
+    [[nodiscard]] std::shared_ptr<const SheetVersion> GetPublishedVersion() const;
+    /// Отмечает, что ячейка изменилась и её блок нужно опубликовать заново.
+    /// До первой публикации ничего не делает
+    void MarkChanged(Position pos) {
+        if (published_number_ != 0) {
+            changed_tiles_.insert(Position{pos.row / CellStorage::TILE_SIZE, pos.col / CellStorage::TILE_SIZE}.Pack());
+        }
+    }
+
+    /// Включает и выключает журнал изменений. Пока журнал включён, лист запоминает
+    /// затронутые изменениями ячейки, а TakeChanges возвращает ячейки, текст или
+    /// значение которых отличаются от бывших при предыдущем вызове
+    void SetChangeTracking(bool enabled);
+    [[nodiscard]] bool IsChangeTracking() const { return change_log_.IsEnabled(); }
+    SheetDelta TakeChanges();
+
+    /// Подписка на изменения: после каждого SetCell, ClearCell, LoadCells и
+    /// CommitBatch подписчики получают изменения, сделанные этим действием.
+    /// Подписка включает журнал; пока есть подписчики, журнал разбирают они,
+    /// и TakeChanges возвращает пустой результат. Подписчик не должен менять лист
+    using ChangeCallback = std::function<void(const SheetDelta&)>;
+    size_t Subscribe(ChangeCallback callback);
+    void Unsubscribe(size_t id);
+
+    ChangeLog& GetChangeLog() { return change_log_; }
+
+    /// Пересчитывает все формулы листа. Формулы разбиваются на уровни по графу
+    /// зависимостей, ячейки одного уровня вычисляются параллельно в threads потоках
+    /// (0 — по числу ядер)
+    void RecalculateAll(size_t threads = 0);
+
+    [[nodiscard]] RecalcStats GetRecalcStats() const;
+    /// Вызывается из вычисления формулы и потому может вызываться одновременно из многих потоков
+    void CountRecomputed() const;
+
+    /// Счётчики непустых ячеек по строкам и столбцам, по ним считается печатная область
+    OccupancyIndex& GetOccupancy() { return occupancy_; }
+    [[nodiscard]] const OccupancyIndex& GetOccupancy() const { return occupancy_; }
+
+    /// Общие программы формул, скопированных со сдвигом
+    FormulaCache& GetFormulaCache() { return formula_cache_; }
+    [[nodiscard]] const FormulaCache& GetFormulaCache() const { return formula_cache_; }
+
+    DependencyIndex& GetDependencies() { return dependencies_; }
+    [[nodiscard]] const DependencyIndex& GetDependencies() const { return dependencies_; }
+
+    /// При переходе к Incremental порядок формул строится заново
+    void SetCycleDetection(CycleDetection mode);
+    [[nodiscard]] CycleDetection GetCycleDetection() const { return cycle_detection_; }
+    TopologicalOrder& GetFormulaOrder() { return formula_order_; }
+
+    template <typename Func>
+    void ForEachCellInRange(const Range& range, Func&& func) const {
+        cells_.ForEachInRange(range, std::forward<Func>(func));
+    }
+
+private:
+    DependencyIndex dependencies_;
+    TopologicalOrder formula_order_;
+    CycleDetection cycle_detection_ = CycleDetection::Incremental;
+    CellStorage cells_;
+    OccupancyIndex occupancy_;
+    FormulaCache formula_cache_;
+    RecalcStats recalc_stats_;
+    /// Формулы, вычисленные при чтении значений после ResetRecalcStats
+    mutable std::atomic<size_t> recomputed_{0};
+
+    /// Последняя опубликованная версия. Читается и заменяется только через
+    /// std::atomic_load и std::atomic_store
+    std::shared_ptr<const SheetVersion> published_;
+    std::uint64_t published_number_ = 0;
+    /// Упакованные координаты блоков, изменившихся после последней публикации
+    std::unordered_set<std::uint32_t> changed_tiles_;
+
+    ChangeLog change_log_;
+    std::vector<std::pair<size_t, ChangeCallback>> subscribers_;
+    size_t next_subscription_ = 0;
+
+    /// Отложенное изменение ячейки. Скопированное содержимое приходит готовым
+    /// в impl и не разбирается; отсутствие и текста, и impl означает очистку
+    struct BatchEntry {
+        Position pos;
+        std::optional<std::string> text;
+        std::unique_ptr<Cell::Impl> impl = nullptr;
+    };
+    std::optional<std::vector<BatchEntry>> batch_;
+
+    void ResetRecalcStats(RecalcStats stats = {});
+    /// Передаёт подписчикам изменения, накопившиеся в журнале
+    void NotifySubscribers();
+    /// Запоминает в журнале изменений состояние позиции, в том числе пустой
+    void RecordCellState(Position pos);
+    void ApplyShift(const SheetShift& shift);
+    /// Есть ли в range хранимые ячейки, в том числе пустые, на которые ссылаются формулы
+    [[nodiscard]] bool HasStoredCells(const Range& range) const;
+    void ThrowIfInvalidPosition(Position pos) const;
+    void ApplyBatch(std::vector<BatchEntry> entries, size_t threads);
+    /// Изменение, копирующее содержимое ячейки from в ячейку to
+    [[nodiscard]] BatchEntry MakeCopyEntry(Position from, Position to) const;
+    /// Ячейки, лежащие на циклах, достижимых из roots по рёбрам к зависимым формулам
+    [[nodiscard]] std::vector<Position> FindCycleCells(const std::vector<Position>& roots) const;
+    /// Строит топологический порядок формул заново (в режиме FullSearch порядок
+    /// не хранится). Возвращает false, если на листе есть циклы
+    bool RebuildFormulaOrder();
+    /// Ставит в конец порядка формулы roots и все формулы, зависящие от них,
+    /// упорядочив их между собой. Затрагивает только эти формулы. Возвращает
+    /// false и не меняет порядок, если среди них есть цикл
+    bool ReorderFormulas(const std::vector<Position>& roots);
+    /// Разбивает формулы листа на уровни: формулы уровня ссылаются только
+    /// на формулы предыдущих уровней. Формулы на циклах и зависящие от них
+    /// не попадают ни в один уровень. formula_count — общее количество формул
+    std::vector<std::vector<Cell*>> GetFormulaLevels(size_t& formula_count);
 };
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "sheet_version.h"
+
+SheetVersion::CellView::CellView(const CellInterface& cell)
+        : text_(cell.GetText())
+        , value_(cell.GetValue())
+        , numeric_value_(cell.GetNumericValue())
+        , referenced_cells_(cell.GetReferencedCells()) {}
+
+const CellInterface* SheetVersion::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("invalid position" + pos.ToString());
+    }
+
+    const auto tile_row = static_cast<size_t>(pos.row / TILE_SIZE);
+    const auto tile_col = static_cast<size_t>(pos.col / TILE_SIZE);
+    if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size() || !tiles_[tile_row][tile_col]) {
+        return nullptr;
+    }
+
+    const Tile& tile = *tiles_[tile_row][tile_col];
+    const auto slot = tile.slots[static_cast<size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE];
+    return slot == 0 ? nullptr : &tile.cells[slot - 1];
+}
+
+void SheetVersion::PrintValues(std::ostream& output, CsvFormat format) const {
+    Print(output, format, [](CsvWriter& writer, const CellInterface& cell) {
+        writer.WriteValue(cell.GetValue());
+    });
+}
+
+void SheetVersion::PrintTexts(std::ostream& output, CsvFormat format) const {
+    Print(output, format, [](CsvWriter& writer, const CellInterface& cell) {
+        writer.WriteText(cell.GetText());
+    });
+}
+
+template <typename Func>
+void SheetVersion::Print(std::ostream& output, CsvFormat format, Func&& write_cell) const {
+    CsvWriter writer(output, format);
+    for (int row = 0; row < printable_size_.rows; ++row) {
+        for (int col = 0; col < printable_size_.cols; ++col) {
+            const CellInterface* cell = GetCell({row, col});
+            if (cell) {
+                write_cell(writer, *cell);
+            } else {
+                writer.WriteEmpty();
+            }
+        }
+        writer.EndRecord();
+    }
+}
+
+std::shared_ptr<const SheetVersion::Tile> SheetVersion::BuildTile(const CellStorage& cells,
+                                                                  size_t tile_row, size_t tile_col) {
+    const int top = static_cast<int>(tile_row) * TILE_SIZE;
+    const int left = static_cast<int>(tile_col) * TILE_SIZE;
+    const Range range{{top, left}, {top + TILE_SIZE - 1, left + TILE_SIZE - 1}};
+
+    auto tile = std::make_shared<Tile>();
+    cells.ForEachInRange(range, [&tile, top, left](Position pos, const Cell& cell) {
+        tile->cells.emplace_back(cell);
+        tile->slots[static_cast<size_t>(pos.row - top) * TILE_SIZE + (pos.col - left)] =
+                static_cast<std::uint16_t>(tile->cells.size());
+    });
+    if (tile->cells.empty()) {
+        return nullptr;
+    }
+    return tile;
+}
+
+void SheetVersion::SetTile(size_t tile_row, size_t tile_col, std::shared_ptr<const Tile> tile) {
+    if (tile_row >= tiles_.size()) {
+        if (!tile) {
+            return;
+        }
+        tiles_.resize(tile_row + 1);
+    }
+    auto& row = tiles_[tile_row];
+    if (tile_col >= row.size()) {
+        if (!tile) {
+            return;
+        }
+        row.resize(tile_col + 1);
+    }
+    row[tile_col] = std::move(tile);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "cell_storage.h"
+#include "common.h"
+#include "csv.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Неизменяемая версия листа, опубликованная Sheet::Publish(). Ячейки версии
+/// хранят готовые текст, значение и ссылки, поэтому её можно читать из любого
+/// числа потоков без синхронизации, пока писатель меняет лист. Блоки ячеек,
+/// не изменившиеся между публикациями, общие для этих версий
+class SheetVersion {
+public:
+    /// Ячейка версии: снимок текста, значения и ссылок ячейки листа
+    class CellView final : public CellInterface {
+    public:
+        explicit CellView(const CellInterface& cell);
+
+        [[nodiscard]] Value GetValue() const override { return value_; }
+        [[nodiscard]] std::string GetText() const override { return text_; }
+        [[nodiscard]] std::vector<Position> GetReferencedCells() const override { return referenced_cells_; }
+        [[nodiscard]] NumericValue GetNumericValue() const override { return numeric_value_; }
+        [[nodiscard]] NumericValue GetRangeValue() const override {
+            if (std::holds_alternative<std::string>(value_) && std::holds_alternative<FormulaError>(numeric_value_)) {
+                return std::monostate{};
+            }
+            return numeric_value_;
+        }
+
+    private:
+        std::string text_;
+        Value value_;
+        NumericValue numeric_value_;
+        std::vector<Position> referenced_cells_;
+    };
+
+    /// Номер версии, растёт с каждой публикацией
+    [[nodiscard]] std::uint64_t GetNumber() const { return number_; }
+
+    /// Как и Sheet::GetCell, бросает InvalidPositionException для неверной позиции
+    [[nodiscard]] const CellInterface* GetCell(Position pos) const;
+    [[nodiscard]] Size GetPrintableSize() const { return printable_size_; }
+
+    void PrintValues(std::ostream& output, CsvFormat format = CsvFormat::Tsv()) const;
+    void PrintTexts(std::ostream& output, CsvFormat format = CsvFormat::Tsv()) const;
+
+private:
+    friend class Sheet;
+
+    static constexpr int TILE_SIZE = CellStorage::TILE_SIZE;
+
+    /// Ячейки одного блока. slots[i] — номер ячейки в cells, увеличенный на 1,
+    /// или 0, если ячейки нет
+    struct Tile {
+        std::array<std::uint16_t, TILE_SIZE * TILE_SIZE> slots{};
+        std::vector<CellView> cells;
+    };
+    using TileDirectory = std::vector<std::vector<std::shared_ptr<const Tile>>>;
+
+    TileDirectory tiles_;
+    Size printable_size_;
+    std::uint64_t number_ = 0;
+
+    /// Строит блок версии по ячейкам блока листа; nullptr, если ячеек в нём нет
+    static std::shared_ptr<const Tile> BuildTile(const CellStorage& cells, size_t tile_row, size_t tile_col);
+    void SetTile(size_t tile_row, size_t tile_col, std::shared_ptr<const Tile> tile);
+
+    template <typename Func>
+    void Print(std::ostream& output, CsvFormat format, Func&& write_cell) const;
+};
@@ -0,0 +1,201 @@
+#include "small_object_pool.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace {
+
+    /// Размеры объектов округляются до шага, кратного максимальному выравниванию
+    constexpr size_t GRANULARITY = alignof(std::max_align_t);
+    constexpr size_t CLASS_COUNT = SmallObjectPool::MAX_SIZE / GRANULARITY;
+    /// Сколько мест поток берёт из общих списков за раз
+    constexpr size_t BATCH = 64;
+
+    size_t GetSizeClass(size_t size) {
+        return size == 0 ? 0 : (size - 1) / GRANULARITY;
+    }
+
+    size_t GetClassSize(size_t size_class) {
+        return (size_class + 1) * GRANULARITY;
+    }
+
+    /// Свободное место хранит ссылку на следующее свободное место
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    /// Список свободных мест одного класса размера
+    struct FreeList {
+        FreeNode* head = nullptr;
+        size_t count = 0;
+
+        void Push(void* ptr) {
+            auto* node = static_cast<FreeNode*>(ptr);
+            node->next = head;
+            head = node;
+            ++count;
+        }
+
+        void* Pop() {
+            FreeNode* node = head;
+            head = node->next;
+            --count;
+            return node;
+        }
+
+        /// Отделяет от списка первые split_count мест
+        FreeList Split(size_t split_count) {
+            FreeList result{head, split_count};
+            FreeNode* last = head;
+            for (size_t i = 1; i < split_count; ++i) {
+                last = last->next;
+            }
+            head = last->next;
+            last->next = nullptr;
+            count -= split_count;
+            return result;
+        }
+    };
+
+    /// Общие для всех потоков куски и возвращённые потоками пачки мест
+    class GlobalPool {
+    public:
+        FreeList TakeBatch(size_t size_class, size_t max_count) {
+            std::lock_guard lock(mutex_);
+            const size_t class_size = GetClassSize(size_class);
+
+            FreeList batch;
+            auto& returned = returned_[size_class];
+            if (!returned.empty()) {
+                batch = returned.back();
+                returned.pop_back();
+                if (batch.count > max_count) {
+                    FreeList rest = std::move(batch);
+                    batch = rest.Split(max_count);
+                    returned.push_back(rest);
+                }
+            } else {
+                auto& [current, end] = unused_[size_class];
+                for (size_t i = 0; i < max_count; ++i) {
+                    if (current == end) {
+                        chunks_.push_back(std::make_unique<std::byte[]>(SmallObjectPool::CHUNK_BYTES));
+                        current = chunks_.back().get();
+                        end = current + SmallObjectPool::CHUNK_BYTES / class_size * class_size;
+                        stats_.reserved_bytes += SmallObjectPool::CHUNK_BYTES;
+                    }
+                    batch.Push(current);
+                    current += class_size;
+                }
+            }
+            stats_.used_bytes += batch.count * class_size;
+            return batch;
+        }
+
+        void PutBatch(size_t size_class, FreeList batch) {
+            std::lock_guard lock(mutex_);
+            stats_.used_bytes -= batch.count * GetClassSize(size_class);
+            returned_[size_class].push_back(batch);
+        }
+
+        SmallObjectPool::Stats GetStats() {
+            std::lock_guard lock(mutex_);
+            return stats_;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<std::byte[]>> chunks_;
+        /// Ещё не нарезанная часть последнего куска каждого класса размера
+        std::array<std::pair<std::byte*, std::byte*>, CLASS_COUNT> unused_{};
+        std::array<std::vector<FreeList>, CLASS_COUNT> returned_;
+        SmallObjectPool::Stats stats_;
+    };
+
+    /// Пул живёт до конца программы: объекты могут освобождаться деструкторами
+    /// статических переменных
+    GlobalPool& GetGlobalPool() {
+        static auto* pool = new GlobalPool;
+        return *pool;
+    }
+
+    /// Кэш потока тривиально разрушаем и доступен до самого завершения потока.
+    /// После того как ThreadCacheReleaser вернул его содержимое, места берутся
+    /// и возвращаются напрямую через общие списки
+    struct ThreadCache {
+        std::array<FreeList, CLASS_COUNT> lists;
+        bool released = false;
+    };
+
+    thread_local ThreadCache thread_cache;
+
+    struct ThreadCacheReleaser {
+        ~ThreadCacheReleaser() {
+            for (size_t size_class = 0; size_class < CLASS_COUNT; ++size_class) {
+                FreeList& list = thread_cache.lists[size_class];
+                if (list.count != 0) {
+                    GetGlobalPool().PutBatch(size_class, std::exchange(list, FreeList{}));
+                }
+            }
+            thread_cache.released = true;
+        }
+    };
+
+    /// Кэш текущего потока; первое обращение в потоке заводит его возврат
+    ThreadCache& GetThreadCache() {
+        thread_local ThreadCacheReleaser releaser;
+        return thread_cache;
+    }
+
+}  // namespace
+
+void* SmallObjectPool::Allocate(size_t size) {
+    if (size > MAX_SIZE) {
+        return ::operator new(size);
+    }
+
+    const size_t size_class = GetSizeClass(size);
+    ThreadCache& cache = GetThreadCache();
+    if (cache.released) {
+        return GetGlobalPool().TakeBatch(size_class, 1).Pop();
+    }
+
+    FreeList& list = cache.lists[size_class];
+    if (list.count == 0) {
+        list = GetGlobalPool().TakeBatch(size_class, BATCH);
+    }
+    return list.Pop();
+}
+
+void SmallObjectPool::Deallocate(void* ptr, size_t size) noexcept {
+    if (!ptr) {
+        return;
+    }
+    if (size > MAX_SIZE) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    const size_t size_class = GetSizeClass(size);
+    ThreadCache& cache = GetThreadCache();
+    if (cache.released) {
+        FreeList single;
+        single.Push(ptr);
+        GetGlobalPool().PutBatch(size_class, single);
+        return;
+    }
+
+    FreeList& list = cache.lists[size_class];
+    list.Push(ptr);
+    // Поток, который только освобождает, отдаёт лишнее остальным
+    if (list.count > 2 * BATCH) {
+        GetGlobalPool().PutBatch(size_class, list.Split(BATCH));
+    }
+}
+
+SmallObjectPool::Stats SmallObjectPool::GetStats() {
+    return GetGlobalPool().GetStats();
+}
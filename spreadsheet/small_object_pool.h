@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+/// Память для небольших объектов, которых на листе по одному на ячейку
+/// (содержимое ячеек). Объекты одного класса размера нарезаются из общих
+/// кусков по CHUNK_BYTES, освобождённые места используются повторно, так что
+/// объект не стоит отдельного обращения к системному распределителю.
+/// Каждый поток берёт и возвращает места пачками через свой кэш, общие списки
+/// блокируются раз на пачку. Куски не возвращаются системе
+class SmallObjectPool {
+public:
+    /// Объекты больше MAX_SIZE выделяются обычным operator new
+    static constexpr size_t MAX_SIZE = 64;
+    static constexpr size_t CHUNK_BYTES = 64 * 1024;
+
+    struct Stats {
+        size_t reserved_bytes = 0;    /// память всех кусков
+        size_t used_bytes = 0;        /// из неё отдано потокам, вместе с их кэшами
+    };
+
+    static void* Allocate(size_t size);
+    static void Deallocate(void* ptr, size_t size) noexcept;
+
+    [[nodiscard]] static Stats GetStats();
+};
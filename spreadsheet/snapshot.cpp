@@ -0,0 +1,116 @@
+#include "sheet.h"
+
+#include "binary_io.h"
+#include "cell.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// Формат снимка листа:
+//   заголовок: сигнатура SNAPSHOT_MAGIC, версия формата, метка порядка байтов,
+//              количество ячеек
+//   ячейки:    строка и столбец (int32), затем содержимое в виде Cell::Impl::Serialize
+// Пустые ячейки не сохраняются: ячейки, на которые ссылаются формулы, создаются
+// заново при связывании зависимостей. Рёбра графа зависимостей тоже не хранятся
+// отдельно: они однозначно следуют из ссылок скомпилированных формул.
+// Снимок читается целиком: ячейки декодируются и связываются при загрузке,
+// а не при первом обращении.
+
+namespace {
+    constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+    constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+    /// Записывается в порядке байтов платформы; на платформе с другим порядком
+    /// читается иначе, и снимок отвергается
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+}//end namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+    std::string data(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    binary_io::Write(data, SNAPSHOT_VERSION);
+    binary_io::Write(data, BYTE_ORDER_MARK);
+    const size_t count_offset = data.size();
+    binary_io::Write(data, std::uint64_t{0});
+
+    std::uint64_t count = 0;
+    cells_.ForEach([&data, &count](Position pos, const Cell& cell) {
+        if (cell.impl_->GetType() == CellType::EMPTY) {
+            return;
+        }
+        binary_io::Write(data, static_cast<std::int32_t>(pos.row));
+        binary_io::Write(data, static_cast<std::int32_t>(pos.col));
+        cell.impl_->Serialize(data);
+        ++count;
+    });
+    std::memcpy(data.data() + count_offset, &count, sizeof(count));
+
+    output.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+void Sheet::SaveSnapshotFile(const std::string& path) const {
+    std::ofstream output(path, std::ios::binary);
+    if (!output) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    SaveSnapshot(output);
+    if (!output.flush()) {
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(std::string_view data) {
+    if (data.substr(0, sizeof(SNAPSHOT_MAGIC)) != std::string_view(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) {
+        throw BinaryFormatException("not a sheet snapshot");
+    }
+    data.remove_prefix(sizeof(SNAPSHOT_MAGIC));
+    if (binary_io::Read<std::uint32_t>(data) != SNAPSHOT_VERSION) {
+        throw BinaryFormatException("unsupported snapshot version");
+    }
+    if (binary_io::Read<std::uint32_t>(data) != BYTE_ORDER_MARK) {
+        throw BinaryFormatException("snapshot byte order does not match the platform");
+    }
+    const auto count = binary_io::Read<std::uint64_t>(data);
+
+    auto sheet = std::make_unique<Sheet>();
+    for (std::uint64_t i = 0; i < count; ++i) {
+        Position pos;
+        pos.row = binary_io::Read<std::int32_t>(data);
+        pos.col = binary_io::Read<std::int32_t>(data);
+        if (!pos.IsValid()) {
+            throw BinaryFormatException("invalid cell position in snapshot");
+        }
+
+        auto impl = Cell::DeserializeImpl(data, *sheet);
+        // Ячейка могла быть уже создана пустой как ссылка из другой формулы
+        Cell* cell = sheet->cells_.GetOrCreate(pos);
+        if (cell->impl_->GetType() != CellType::EMPTY) {
+            throw BinaryFormatException("duplicate cell in snapshot: " + pos.ToString());
+        }
+        cell->UpdateDependencies(std::move(impl));
+    }
+    if (!data.empty()) {
+        throw BinaryFormatException("unexpected data after the last cell");
+    }
+
+    // Циклов в сохранённом листе быть не могло, так что их наличие означает
+    // повреждённый снимок
+    if (!sheet->RebuildFormulaOrder()) {
+        throw BinaryFormatException("circular dependency in snapshot");
+    }
+    return sheet;
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshotFile(const std::string& path) {
+    // Файл читается в память одним вызовом, дальше данные только декодируются
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (!input) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    std::string data(static_cast<size_t>(input.tellg()), '\0');
+    input.seekg(0);
+    if (!input.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+        throw std::runtime_error("cannot read " + path);
+    }
+    return LoadSnapshot(data);
+}
@@ -1,72 +1,250 @@
-#include "common.h"
-
-#include <cctype>
-#include <sstream>
-#include <algorithm>
-
-constexpr int LETTERS = 26;
-constexpr int MAX_POSITION_LENGTH = 17;
-constexpr int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = {-1, -1};
-
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
-}
-
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
-}
-
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
-}
-
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return {};
-    }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
-}
-
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if_not(str.begin(), str.end(), [](const char c) {
-        return std::isalpha(c) && std::isupper(c);
-    });
-
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty() || letters.size() > MAX_POS_LETTER_COUNT || !std::isdigit(digits[0])) {
-        return Position::NONE;
-    }
-
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
-    }
-
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
-    }
-
-    return {row - 1, col - 1};
-}
-
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+#include "common.h"
+
+#include <cctype>
+#include <charconv>
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+
+constexpr int LETTERS = 26;
+constexpr int MAX_POS_LETTER_COUNT = 3;
+
+const Position Position::NONE = {-1, -1};
+
+bool Position::operator==(const Position rhs) const {
+    return row == rhs.row && col == rhs.col;
+}
+
+bool Position::operator<(const Position rhs) const {
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+}
+
+bool Position::IsValid() const {
+    return static_cast<unsigned>(row) < static_cast<unsigned>(MAX_ROWS)
+           && static_cast<unsigned>(col) < static_cast<unsigned>(MAX_COLS);
+}
+
+char* Position::ToChars(char* first) const {
+    if (!IsValid()) {
+        return first;
+    }
+
+    // Столбцы нумеруются A..Z, AA..ZZ, AAA..: сначала находим число букв,
+    // затем записываем их с конца
+    int letter_count = 1;
+    int c = col;
+    for (int block = LETTERS; letter_count < MAX_POS_LETTER_COUNT && c >= block; block *= LETTERS) {
+        c -= block;
+        ++letter_count;
+    }
+    for (int i = letter_count - 1; i >= 0; --i) {
+        first[i] = static_cast<char>('A' + c % LETTERS);
+        c /= LETTERS;
+    }
+
+    return std::to_chars(first + letter_count, first + MAX_STRING_LENGTH, row + 1).ptr;
+}
+
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return {buffer, ToChars(buffer)};
+}
+
+Position Position::FromString(std::string_view str) {
+    size_t letter_count = 0;
+    int col = 0;
+    while (letter_count < str.size() && str[letter_count] >= 'A' && str[letter_count] <= 'Z') {
+        if (letter_count == MAX_POS_LETTER_COUNT) {
+            return Position::NONE;
+        }
+        col = col * LETTERS + (str[letter_count] - 'A' + 1);
+        ++letter_count;
+    }
+
+    const char* digits = str.data() + letter_count;
+    const char* end = str.data() + str.size();
+    if (letter_count == 0 || digits == end || *digits < '0' || *digits > '9') {
+        return Position::NONE;
+    }
+
+    int row;
+    const auto [ptr, ec] = std::from_chars(digits, end, row);
+    if (ec != std::errc() || ptr != end) {
+        return Position::NONE;
+    }
+
+    return {row - 1, col - 1};
+}
+
+std::vector<Position> Position::FromStrings(const std::vector<std::string_view>& names) {
+    std::vector<Position> result;
+    result.reserve(names.size());
+    for (std::string_view name : names) {
+        result.push_back(FromString(name));
+    }
+    return result;
+}
+
+void Position::AppendStrings(std::string& out, const std::vector<Position>& positions, char separator) {
+    out.reserve(out.size() + positions.size() * (MAX_STRING_LENGTH + 1));
+    char buffer[MAX_STRING_LENGTH];
+    for (size_t i = 0; i < positions.size(); ++i) {
+        if (i > 0) {
+            out += separator;
+        }
+        out.append(buffer, positions[i].ToChars(buffer));
+    }
+}
+
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Range::operator==(const Range rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::operator<(const Range rhs) const {
+    return std::tie(from, to) < std::tie(rhs.from, rhs.to);
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(const Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+Size Range::GetSize() const {
+    return {to.row - from.row + 1, to.col - from.col + 1};
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return {};
+    }
+    char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+    char* end = from.ToChars(buffer);
+    *end++ = ':';
+    return {buffer, to.ToChars(end)};
+}
+
+Range Range::FromCorners(const Position first, const Position second) {
+    return {{std::min(first.row, second.row), std::min(first.col, second.col)},
+            {std::max(first.row, second.row), std::max(first.col, second.col)}};
+}
+
+namespace {
+    int& GetIndex(Position& pos, SheetShift::Axis axis) {
+        return axis == SheetShift::Axis::Rows ? pos.row : pos.col;
+    }
+
+    int GetLimit(SheetShift::Axis axis) {
+        return axis == SheetShift::Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    }
+}//end namespace
+
+Position SheetShift::Apply(Position pos) const {
+    if (!Affects(pos)) {
+        return pos;
+    }
+
+    int& index = GetIndex(pos, axis);
+    if (count > 0) {
+        index += count;
+        return index < GetLimit(axis) ? pos : Position::NONE;
+    }
+    if (index < first - count) {
+        return Position::NONE;
+    }
+    index += count;
+    return pos;
+}
+
+Range SheetShift::Apply(Range range) const {
+    if (!Affects(range)) {
+        return range;
+    }
+
+    int& from = GetIndex(range.from, axis);
+    int& to = GetIndex(range.to, axis);
+    if (count > 0) {
+        if (from >= first) {
+            from += count;
+        }
+        to = std::min(to + count, GetLimit(axis) - 1);
+        return from <= to ? range : Range{Position::NONE, Position::NONE};
+    }
+
+    const int end = first - count;
+    if (from >= first && to < end) {
+        return {Position::NONE, Position::NONE};
+    }
+    if (from >= end) {
+        from += count;
+    } else if (from > first) {
+        from = first;
+    }
+    to = to >= end ? to + count : first - 1;
+    return range;
+}
+
+bool SheetShift::Affects(Position pos) const {
+    return pos.IsValid() && GetIndex(pos, axis) >= first;
+}
+
+bool SheetShift::Affects(Range range) const {
+    return range.IsValid() && GetIndex(range.to, axis) >= first;
+}
+
+std::optional<double> ParseNumber(std::string_view text) {
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+    // from_chars не принимает '+', а "+-1" не является числом и для std::stod
+    if (!text.empty() && text.front() == '+') {
+        text.remove_prefix(1);
+        if (!text.empty() && text.front() == '-') {
+            return std::nullopt;
+        }
+    }
+
+    double value = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc() || ptr != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+CellInterface::NumericValue CellInterface::GetNumericValue() const {
+    return std::visit([](const auto& value) -> NumericValue {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+            if (value.empty()) {
+                return std::monostate{};
+            }
+            if (auto number = ParseNumber(value)) {
+                return *number;
+            }
+            return FormulaError(FormulaError::Category::Value);
+        } else {
+            return value;
+        }
+    }, GetValue());
+}
+
+CellInterface::NumericValue CellInterface::GetRangeValue() const {
+    return std::visit([](const auto& value) -> NumericValue {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+            if (auto number = ParseNumber(value)) {
+                return *number;
+            }
+            return std::monostate{};
+        } else {
+            return value;
+        }
+    }, GetValue());
+}
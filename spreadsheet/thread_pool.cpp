@@ -0,0 +1,108 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    workers_.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers_.emplace_back([this] { WorkerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    job_ready_.notify_all();
+
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+
+    // Без рабочих потоков или на маленьком задании будить пул дороже, чем сделать всё самому
+    if (workers_.empty() || count == 1) {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        task_ = &task;
+        count_ = count;
+        // Порции помельче, чтобы потоки выравнивали нагрузку, но не толкались на счётчике
+        chunk_ = std::max<size_t>(1, count / (GetThreadCount() * 8));
+        next_.store(0, std::memory_order_relaxed);
+        busy_workers_ = workers_.size();
+        error_ = nullptr;
+        ++generation_;
+    }
+    job_ready_.notify_all();
+
+    RunChunks();
+
+    std::unique_lock lock(mutex_);
+    job_done_.wait(lock, [this] { return busy_workers_ == 0; });
+    task_ = nullptr;
+
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    size_t seen_generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            job_ready_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+            if (stopping_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        RunChunks();
+
+        {
+            std::lock_guard lock(mutex_);
+            --busy_workers_;
+        }
+        job_done_.notify_one();
+    }
+}
+
+void ThreadPool::RunChunks() {
+    while (true) {
+        const size_t begin = next_.fetch_add(chunk_, std::memory_order_relaxed);
+        if (begin >= count_) {
+            return;
+        }
+
+        const size_t end = std::min(count_, begin + chunk_);
+        try {
+            for (size_t i = begin; i < end; ++i) {
+                (*task_)(i);
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+    }
+}
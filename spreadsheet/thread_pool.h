@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Пул потоков для параллельной обработки набора независимых задач.
+/// Вызывающий поток участвует в работе наравне с рабочими потоками
+class ThreadPool {
+public:
+    /// threads — общее число потоков с учётом вызывающего; 0 — по числу ядер
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Вызывает task(i) для каждого i из [0, count) и дожидается завершения всех вызовов.
+    /// Индексы раздаются порциями через общий счётчик, поэтому освободившийся поток
+    /// забирает работу, оставшуюся у остальных. Первое выброшенное задачей исключение
+    /// пробрасывается вызывающему
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+    [[nodiscard]] size_t GetThreadCount() const { return workers_.size() + 1; }
+
+private:
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable job_ready_;
+    std::condition_variable job_done_;
+
+    /// Текущее задание
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t count_ = 0;
+    size_t chunk_ = 1;
+    std::atomic<size_t> next_{0};
+    size_t generation_ = 0;
+    size_t busy_workers_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+
+    void WorkerLoop();
+    void RunChunks();
+};
@@ -0,0 +1,69 @@
+#include "topological_order.h"
+
+void TopologicalOrder::Append(Position pos) {
+    Assign(pos, ++max_);
+}
+
+void TopologicalOrder::Prepend(Position pos) {
+    Assign(pos, --min_);
+}
+
+void TopologicalOrder::Erase(Position pos) {
+    auto it = order_.find(pos);
+    if (it == order_.end()) {
+        return;
+    }
+    by_order_.erase(it->second);
+    order_.erase(it);
+}
+
+void TopologicalOrder::Clear() {
+    order_.clear();
+    by_order_.clear();
+    min_ = max_ = 0;
+}
+
+void TopologicalOrder::Move(const std::vector<std::pair<Position, Position>>& moves) {
+    std::vector<std::pair<Position, std::int64_t>> assigned;
+    assigned.reserve(moves.size());
+    for (const auto& [from, to] : moves) {
+        auto it = order_.find(from);
+        if (it == order_.end()) {
+            continue;
+        }
+        if (to.IsValid()) {
+            assigned.emplace_back(to, it->second);
+        } else {
+            by_order_.erase(it->second);
+        }
+        order_.erase(it);
+    }
+    // Номера не меняются, поэтому записи by_order_ обновляются на месте
+    for (const auto& [pos, order] : assigned) {
+        order_[pos] = order;
+        by_order_.at(order) = pos;
+    }
+}
+
+void TopologicalOrder::Assign(Position pos, std::int64_t order) {
+    Erase(pos);
+    order_[pos] = order;
+    by_order_[order] = pos;
+}
+
+void TopologicalOrder::Reorder(std::int64_t lower, std::int64_t upper,
+                               const std::unordered_set<Position, PositionHasher>& moved) {
+    std::vector<std::int64_t> slots;
+    std::vector<Position> kept;
+    std::vector<Position> shifted;
+    for (auto it = by_order_.upper_bound(lower); it != by_order_.end() && it->first <= upper; ++it) {
+        slots.push_back(it->first);
+        (moved.count(it->second) ? shifted : kept).push_back(it->second);
+    }
+
+    kept.insert(kept.end(), shifted.begin(), shifted.end());
+    for (size_t i = 0; i < slots.size(); ++i) {
+        order_[kept[i]] = slots[i];
+        by_order_[slots[i]] = kept[i];
+    }
+}
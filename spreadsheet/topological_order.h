@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/// Топологический порядок формул листа, поддерживаемый инкрементально
+/// (алгоритм Пирса — Келли). Каждой формуле сопоставлен номер, и каждая
+/// формула имеет номер больше, чем формулы, на которые она ссылается.
+///
+/// Новое ребро from → to, согласованное с порядком, проверяется за O(1).
+/// Иначе поиск в глубину от to обходит только формулы с номерами между
+/// номерами концов ребра: если он дошёл до from, ребро замыкает цикл,
+/// если нет — найденные формулы переносятся в порядке за from.
+///
+/// Ячейки без формул в порядке не участвуют: у них нет входящих рёбер,
+/// и они не могут лежать на цикле
+class TopologicalOrder {
+public:
+    [[nodiscard]] bool Contains(Position pos) const { return order_.count(pos) > 0; }
+    [[nodiscard]] size_t GetSize() const { return order_.size(); }
+
+    /// Ставит формулу в конец порядка: на неё ещё никто не ссылается
+    void Append(Position pos);
+    /// Ставит формулу в начало порядка: она ещё ни на что не ссылается
+    void Prepend(Position pos);
+    void Erase(Position pos);
+    void Clear();
+    /// Переносит формулы на новые позиции с сохранением их номеров. Перенос на
+    /// Position::NONE удаляет формулу. Новая позиция одной формулы может быть
+    /// старой позицией другой
+    void Move(const std::vector<std::pair<Position, Position>>& moves);
+
+    /// Добавляет ребро from → to между формулами, которые уже есть в порядке.
+    /// for_each_dependent(pos, func) должна вызывать func для каждой формулы,
+    /// ссылающейся на pos. Возвращает false, если ребро замыкает цикл;
+    /// порядок при этом остаётся корректным
+    template <typename ForEachDependent>
+    bool AddEdge(Position from, Position to, ForEachDependent&& for_each_dependent);
+
+private:
+    std::unordered_map<Position, std::int64_t, PositionHasher> order_;
+    std::map<std::int64_t, Position> by_order_;
+    std::int64_t min_ = 0;
+    std::int64_t max_ = 0;
+
+    void Assign(Position pos, std::int64_t order);
+    /// Переставляет формулы с номерами из (lower, upper]: сначала не вошедшие
+    /// в moved, затем вошедшие, с сохранением их взаимного порядка
+    void Reorder(std::int64_t lower, std::int64_t upper, const std::unordered_set<Position, PositionHasher>& moved);
+};
+
+template <typename ForEachDependent>
+bool TopologicalOrder::AddEdge(Position from, Position to, ForEachDependent&& for_each_dependent) {
+    const std::int64_t upper = order_.at(from);
+    const std::int64_t lower = order_.at(to);
+    if (upper < lower) {
+        return true;
+    }
+
+    // Всё, что достижимо из to и не позже from, придётся поставить после from
+    std::unordered_set<Position, PositionHasher> visited{to};
+    std::vector<Position> to_enter_collection{to};
+    bool cycle = false;
+    while (!to_enter_collection.empty() && !cycle) {
+        const Position ongoing = to_enter_collection.back();
+        to_enter_collection.pop_back();
+
+        for_each_dependent(ongoing, [&](Position dependent) {
+            if (dependent == from) {
+                cycle = true;
+            } else if (order_.at(dependent) < upper && visited.insert(dependent).second) {
+                to_enter_collection.push_back(dependent);
+            }
+        });
+    }
+    if (cycle) {
+        return false;
+    }
+
+    Reorder(lower - 1, upper, visited);
+    return true;
+}